@@ -0,0 +1,329 @@
+#include "barnes_hut.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+// deepest level a 63 bit Morton key can split to
+static const uint32_t max_level = 21;
+
+barnes_hut::barnes_hut(thread_pool *pool, float theta, uint32_t leaf_size) :
+	force_solver(pool)
+{
+	this->theta = theta;
+	this->leaf_size = leaf_size;
+	G = 0.0f;
+
+	// enough subtrees for every thread to get a few
+	top_depth = 0;
+	for(uint32_t cells = 1; cells < pool->size() * 4 && top_depth < 3;
+		cells *= 8)
+		top_depth++;
+}
+
+void barnes_hut::prepare(const particle_soa &src, float G)
+{
+	this->G = G;
+	order.sort(pool, src);
+	build_tree();
+}
+
+void barnes_hut::build_tree()
+{
+	const uint32_t n = order.sorted.size();
+	nodes.clear();
+	if(n == 0)
+		return;
+
+	cell root;
+	root.first = 0;
+	root.count = n;
+	root.level = 0;
+	root.half = 0.5f * order.size;
+	for(int k = 0; k < 3; k++)
+		root.center[k] = order.min_corner[k] + root.half;
+
+	// top levels serially, they are at most a few hundred nodes
+	std::vector<bh_node> top_nodes;
+	std::vector<cell> top;
+	build_node(top_nodes, root, &top);
+
+	std::vector<cell> tasks;
+	std::vector<int32_t> task_of(top_nodes.size(), -1);
+	for(const cell &c : top)
+	{
+		if(c.level == top_depth)
+		{
+			task_of[c.node] = (int32_t)tasks.size();
+			tasks.push_back(c);
+		}
+	}
+
+	std::vector<std::vector<bh_node>> subtrees(tasks.size());
+	pool->parallel_for(0, (uint32_t)tasks.size(), [&](uint32_t begin,
+		uint32_t end)
+	{
+		for(uint32_t t = begin; t < end; t++)
+			build_node(subtrees[t], tasks[t], nullptr);
+	}, 1);
+
+	// splice the subtrees in where their placeholders were, keeping the
+	// whole array depth first
+	std::vector<uint32_t> pos(top_nodes.size() + 1);
+	uint32_t total = 0;
+	for(uint32_t t = 0; t < top_nodes.size(); t++)
+	{
+		pos[t] = total;
+		total += task_of[t] < 0 ? 1 : (uint32_t)subtrees[task_of[t]].size();
+	}
+	pos[top_nodes.size()] = total;
+
+	nodes.resize(total);
+	pool->parallel_for(0, (uint32_t)top_nodes.size(), [&](uint32_t begin,
+		uint32_t end)
+	{
+		for(uint32_t t = begin; t < end; t++)
+		{
+			if(task_of[t] < 0)
+			{
+				nodes[pos[t]] = top_nodes[t];
+				nodes[pos[t]].next = pos[top_nodes[t].next];
+				continue;
+			}
+			const std::vector<bh_node> &sub = subtrees[task_of[t]];
+			for(uint32_t k = 0; k < sub.size(); k++)
+			{
+				nodes[pos[t] + k] = sub[k];
+				nodes[pos[t] + k].next += pos[t];
+			}
+		}
+	}, 1);
+
+	// the unfinished top nodes were appended parent first
+	for(auto c = top.rbegin(); c != top.rend(); ++c)
+	{
+		if(c->level != top_depth)
+			finish_node(nodes, pos[c->node], *c);
+	}
+}
+
+void barnes_hut::build_node(std::vector<bh_node> &out, const cell &c,
+	std::vector<cell> *top)
+{
+	uint32_t index = (uint32_t)out.size();
+	out.emplace_back();
+	out[index].first = c.first;
+	out[index].count = c.count;
+
+	if(c.count <= leaf_size || c.level >= max_level)
+	{
+		out[index].next = index + 1;
+		finish_node(out, index, c);
+		return;
+	}
+
+	if(top && c.level == top_depth)
+	{
+		out[index].next = index + 1;
+		top->push_back(c);
+		top->back().node = index;
+		return;
+	}
+
+	if(top)
+	{
+		top->push_back(c);
+		top->back().node = index;
+	}
+
+	uint32_t bounds[9];
+	order.split(c.first, c.count, c.level, bounds);
+	for(uint32_t oct = 0; oct < 8; oct++)
+	{
+		if(bounds[oct + 1] == bounds[oct])
+			continue;
+
+		cell child;
+		child.first = bounds[oct];
+		child.count = bounds[oct + 1] - bounds[oct];
+		child.level = c.level + 1;
+		child.half = 0.5f * c.half;
+		child.center[0] = c.center[0] + (oct & 4 ? child.half : -child.half);
+		child.center[1] = c.center[1] + (oct & 2 ? child.half : -child.half);
+		child.center[2] = c.center[2] + (oct & 1 ? child.half : -child.half);
+		build_node(out, child, top);
+	}
+
+	out[index].next = (uint32_t)out.size();
+	if(!top)
+		finish_node(out, index, c);
+}
+
+void barnes_hut::finish_node(std::vector<bh_node> &out, uint32_t i,
+	const cell &c)
+{
+	const particle_soa &sorted = order.sorted;
+	bh_node &n = out[i];
+	double mass = 0.0, cx = 0.0, cy = 0.0, cz = 0.0;
+	double q[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+
+	if(n.next == i + 1)
+	{
+		for(uint32_t k = n.first; k < n.first + n.count; k++)
+		{
+			mass += sorted.m[k];
+			cx += sorted.m[k] * sorted.x[k];
+			cy += sorted.m[k] * sorted.y[k];
+			cz += sorted.m[k] * sorted.z[k];
+		}
+		cx /= mass;
+		cy /= mass;
+		cz /= mass;
+		for(uint32_t k = n.first; k < n.first + n.count; k++)
+		{
+			double dx = sorted.x[k] - cx;
+			double dy = sorted.y[k] - cy;
+			double dz = sorted.z[k] - cz;
+			double d2 = dx * dx + dy * dy + dz * dz;
+			double m = sorted.m[k];
+			q[0] += m * (3.0 * dx * dx - d2);
+			q[1] += m * 3.0 * dx * dy;
+			q[2] += m * 3.0 * dx * dz;
+			q[3] += m * (3.0 * dy * dy - d2);
+			q[4] += m * 3.0 * dy * dz;
+			q[5] += m * (3.0 * dz * dz - d2);
+		}
+	}
+	else
+	{
+		for(uint32_t k = i + 1; k < n.next; k = out[k].next)
+		{
+			mass += out[k].mass;
+			cx += out[k].mass * out[k].cx;
+			cy += out[k].mass * out[k].cy;
+			cz += out[k].mass * out[k].cz;
+		}
+		cx /= mass;
+		cy /= mass;
+		cz /= mass;
+		// parallel axis theorem for each child's quadrupole
+		for(uint32_t k = i + 1; k < n.next; k = out[k].next)
+		{
+			const bh_node &ch = out[k];
+			double dx = ch.cx - cx;
+			double dy = ch.cy - cy;
+			double dz = ch.cz - cz;
+			double d2 = dx * dx + dy * dy + dz * dz;
+			double m = ch.mass;
+			q[0] += ch.qxx + m * (3.0 * dx * dx - d2);
+			q[1] += ch.qxy + m * 3.0 * dx * dy;
+			q[2] += ch.qxz + m * 3.0 * dx * dz;
+			q[3] += ch.qyy + m * (3.0 * dy * dy - d2);
+			q[4] += ch.qyz + m * 3.0 * dy * dz;
+			q[5] += ch.qzz + m * (3.0 * dz * dz - d2);
+		}
+	}
+
+	n.mass = (float)mass;
+	n.cx = (float)cx;
+	n.cy = (float)cy;
+	n.cz = (float)cz;
+	n.qxx = (float)q[0];
+	n.qxy = (float)q[1];
+	n.qxz = (float)q[2];
+	n.qyy = (float)q[3];
+	n.qyz = (float)q[4];
+	n.qzz = (float)q[5];
+
+	// Barnes' opening criterion, size / theta plus how far the center of
+	// mass sits from the middle of the cell
+	double ox = cx - c.center[0];
+	double oy = cy - c.center[1];
+	double oz = cz - c.center[2];
+	double r = 2.0 * c.half / theta + std::sqrt(ox * ox + oy * oy + oz * oz);
+	n.open2 = (float)(r * r);
+}
+
+Eigen::Vector3f barnes_hut::walk(float px, float py, float pz, uint32_t skip,
+	uint64_t &interactions) const
+{
+	const particle_soa &sorted = order.sorted;
+	const std::vector<uint32_t> &id = order.id;
+	float ax = 0.0f, ay = 0.0f, az = 0.0f;
+	const uint32_t n = (uint32_t)nodes.size();
+	uint32_t i = 0;
+
+	while(i < n)
+	{
+		const bh_node &node = nodes[i];
+		float dx = node.cx - px;
+		float dy = node.cy - py;
+		float dz = node.cz - pz;
+		float d2 = dx * dx + dy * dy + dz * dz;
+
+		if(d2 > node.open2)
+		{
+			// monopole plus quadrupole
+			float inv = 1.0f / std::sqrt(d2);
+			float inv2 = inv * inv;
+			float inv3 = inv * inv2;
+			float inv5 = inv3 * inv2;
+			float qx = node.qxx * dx + node.qxy * dy + node.qxz * dz;
+			float qy = node.qxy * dx + node.qyy * dy + node.qyz * dz;
+			float qz = node.qxz * dx + node.qyz * dy + node.qzz * dz;
+			float dqd = dx * qx + dy * qy + dz * qz;
+			float s = node.mass * inv3 + 2.5f * dqd * inv5 * inv2;
+
+			ax += s * dx - qx * inv5;
+			ay += s * dy - qy * inv5;
+			az += s * dz - qz * inv5;
+			interactions++;
+			i = node.next;
+		}
+		else if(node.next == i + 1)
+		{
+			for(uint32_t k = node.first; k < node.first + node.count; k++)
+			{
+				if(id[k] == skip)
+					continue;
+				float bx = sorted.x[k] - px;
+				float by = sorted.y[k] - py;
+				float bz = sorted.z[k] - pz;
+				float b2 = bx * bx + by * by + bz * bz;
+				float inv = 1.0f / std::sqrt(b2);
+				float s = sorted.m[k] * inv * inv * inv;
+				ax += s * bx;
+				ay += s * by;
+				az += s * bz;
+			}
+			interactions += node.count;
+			i = node.next;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	return Eigen::Vector3f(G * ax, G * ay, G * az);
+}
+
+void barnes_hut::accel(const vec3_soa &q, const uint32_t *ids,
+	uint32_t count, vec3_soa &a)
+{
+	// when the queries are the bodies themselves walk them in Morton order
+	// so consecutive walks hit the same nodes
+	const bool in_order = count == order.sorted.size();
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		uint64_t interactions = 0;
+		for(uint32_t k = begin; k < end; k++)
+		{
+			uint32_t i = in_order ? order.id[k] : k;
+			a.set(i, walk(q.x[i], q.y[i], q.z[i], ids[i], interactions));
+		}
+		pair_count += interactions;
+	}, 64);
+}
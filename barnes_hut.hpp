@@ -0,0 +1,105 @@
+#ifndef BARNES_HUT_HPP
+#define BARNES_HUT_HPP
+
+#include <vector>
+
+#include "force_solver.hpp"
+#include "morton.hpp"
+
+/**
+ * @brief One octree cell, 64 bytes so a node never spans two cache lines
+ *
+ * Nodes are stored depth first so the first child of node i is node i + 1 and
+ * next is the node after the whole subtree. A walk never needs a stack, it
+ * either descends to i + 1 or skips to next.
+ */
+struct alignas(64) bh_node
+{
+	/**
+	 * @brief Center of mass and total mass
+	 */
+	float cx, cy, cz, mass;
+	/**
+	 * @brief Traceless quadrupole about the center of mass
+	 */
+	float qxx, qxy, qxz, qyy, qyz, qzz;
+	/**
+	 * @brief Squared distance from the center of mass inside which the node
+	 * has to be opened
+	 */
+	float open2;
+	/**
+	 * @brief Index of the node after this subtree, a leaf is the only kind
+	 * of node with next == its own index + 1
+	 */
+	uint32_t next;
+	/**
+	 * @brief Range of the node's bodies in the sorted body arrays
+	 */
+	uint32_t first, count;
+};
+
+/**
+ * @brief O(N log N) Barnes-Hut tree code
+ *
+ * prepare() sorts the bodies along a Morton curve, builds the octree from the
+ * sorted keys with the subtrees below the top levels built in parallel and
+ * computes monopole and quadrupole moments bottom up. A node is used whole
+ * when the query point is further than size / theta plus the offset of its
+ * center of mass from its geometric center.
+ */
+class barnes_hut : public force_solver
+{
+public:
+	barnes_hut(thread_pool *pool, float theta = 0.5f,
+		uint32_t leaf_size = 16);
+
+	const char *name() const { return "barnes-hut"; }
+	void prepare(const particle_soa &src, float G);
+	void accel(const vec3_soa &q, const uint32_t *ids, uint32_t count,
+		vec3_soa &a);
+
+	uint32_t node_count() const { return (uint32_t)nodes.size(); }
+
+private:
+	/**
+	 * @brief A cell, its bodies and its geometric center and half width
+	 */
+	struct cell
+	{
+		uint32_t first, count, level;
+		float center[3];
+		float half;
+		// index of the node built for this cell
+		uint32_t node;
+	};
+
+	void build_tree();
+	/**
+	 * @brief Append c and everything under it to out depth first
+	 *
+	 * With top set, cells at top_depth get a placeholder node and internal
+	 * nodes above them are left unfinished. Both are appended to top so the
+	 * caller can build the subtrees in parallel and finish the rest after.
+	 */
+	void build_node(std::vector<bh_node> &out, const cell &c,
+		std::vector<cell> *top);
+	/**
+	 * @brief Compute the moments and opening distance of node i, its children
+	 * have to be finished already
+	 */
+	void finish_node(std::vector<bh_node> &out, uint32_t i, const cell &c);
+	Eigen::Vector3f walk(float px, float py, float pz, uint32_t skip,
+		uint64_t &interactions) const;
+
+	float theta;
+	uint32_t leaf_size;
+	uint32_t top_depth;
+	float G;
+
+	morton_order order;
+
+	std::vector<bh_node> nodes;
+};
+
+#endif
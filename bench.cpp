@@ -0,0 +1,440 @@
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <boost/program_options.hpp>
+
+#include "gfx.hpp"
+#include "shader_cache.hpp"
+#include "cpu_physics.hpp"
+#include "thread_pool.hpp"
+#include "force_solver.hpp"
+#include "barnes_hut.hpp"
+#include "fmm.hpp"
+#include "fox/counter.hpp"
+
+namespace po = boost::program_options;
+
+/**
+ * @brief Floating point operations counted for one pair interaction, the
+ * usual figure for an all-pairs step (3 sub, 3 mul and 2 add for d2,
+ * rsqrt and 2 mul for 1/d3, 1 mul for m/d3 and 3 fma for the accumulate)
+ */
+const double flops_per_interaction = 20.0;
+
+/**
+ * @brief One row of the sweep
+ */
+struct bench_result
+{
+	std::string backend;
+	uint32_t count;
+	uint32_t threads;
+	uint32_t local_size;
+	uint32_t steps;
+	double steps_per_s;
+	double interactions_per_s;
+	double gflops;
+	// step times in ms
+	double min, mean, p50, p90, p99, max;
+};
+
+/**
+ * @brief Parse a comma separated list of numbers like 1000,10000
+ */
+bool parse_list(const std::string &s, std::vector<uint32_t> &out)
+{
+	out.clear();
+	std::stringstream ss(s);
+	std::string item;
+	while(std::getline(ss, item, ','))
+	{
+		try
+		{
+			out.push_back((uint32_t)std::stoul(item));
+		}
+		catch(const std::exception &)
+		{
+			return false;
+		}
+	}
+	return !out.empty();
+}
+
+std::vector<std::string> split_list(const std::string &s)
+{
+	std::vector<std::string> out;
+	std::stringstream ss(s);
+	std::string item;
+	while(std::getline(ss, item, ','))
+		out.push_back(item);
+	return out;
+}
+
+/**
+ * @brief Fill in the rates and percentiles from the time of every step
+ * @param times step times in seconds, sorted by this function
+ */
+void summarize(std::vector<double> &times, double interactions_per_step,
+	bench_result &r)
+{
+	r.steps = (uint32_t)times.size();
+	if(times.empty())
+	{
+		r.steps_per_s = r.interactions_per_s = r.gflops = 0.0;
+		r.min = r.mean = r.p50 = r.p90 = r.p99 = r.max = 0.0;
+		return;
+	}
+
+	std::sort(times.begin(), times.end());
+	double total = 0.0;
+	for(double t : times)
+		total += t;
+
+	// nearest rank percentile
+	auto percentile = [&times](double p)
+	{
+		size_t rank = (size_t)std::ceil(p / 100.0 * times.size());
+		return times[std::max(rank, (size_t)1) - 1];
+	};
+
+	r.steps_per_s = times.size() / total;
+	r.interactions_per_s = interactions_per_step * r.steps_per_s;
+	r.gflops = r.interactions_per_s * flops_per_interaction * 1.0e-9;
+	r.min = times.front() * 1.0e3;
+	r.mean = total / times.size() * 1.0e3;
+	r.p50 = percentile(50.0) * 1.0e3;
+	r.p90 = percentile(90.0) * 1.0e3;
+	r.p99 = percentile(99.0) * 1.0e3;
+	r.max = times.back() * 1.0e3;
+}
+
+/**
+ * @brief Time steps after warmup steps, stopping early once time_limit
+ * seconds have been spent on the measured steps
+ * @param step runs one step and only returns once it is done
+ */
+template<typename F>
+std::vector<double> time_steps(uint32_t warmup, uint32_t steps,
+	double time_limit, F step)
+{
+	for(uint32_t i = 0; i < warmup; i++)
+		step();
+
+	std::vector<double> times;
+	times.reserve(steps);
+	fox::counter step_counter;
+	double total = 0.0;
+	// the first step runs whatever the limit, as --time-limit promises
+	for(uint32_t i = 0; i < steps && (i == 0 || total < time_limit); i++)
+	{
+		step_counter.update_double();
+		step();
+		double t = step_counter.update_double();
+		times.push_back(t);
+		total += t;
+	}
+	return times;
+}
+
+/**
+ * @return false if backend could not be started, r is left unfilled then
+ */
+bool run_cpu(const std::string &backend, uint32_t count, uint32_t threads,
+	integrator_type integrator, const po::variables_map &vm, bench_result &r)
+{
+	thread_pool pool(threads, vm.count("pin") > 0);
+	std::mt19937_64 generator(vm["seed"].as<uint64_t>());
+
+	cpu_physics physics(&pool);
+	physics.set_integrator(integrator);
+	physics.set_sort_interval(vm["sort-every"].as<uint32_t>());
+	if(backend == "bh")
+		physics.set_solver(new barnes_hut(&pool, vm["theta"].as<float>()));
+	else if(backend == "fmm")
+		physics.set_solver(new fmm(&pool, vm["order"].as<uint32_t>(),
+			vm["theta"].as<float>()));
+	else if(backend == "scalar")
+		physics.set_solver(new direct_solver(&pool, simd_level::scalar));
+	else if(backend == "simd")
+		physics.set_solver(new direct_solver(&pool, detect_simd()));
+	else if(backend == "symmetric")
+		physics.set_solver(new symmetric_solver(&pool, detect_simd()));
+	else
+		return false;
+	physics.init(count, generator);
+
+	float delta_t = vm["dt"].as<float>();
+	std::vector<double> times = time_steps(vm["warmup"].as<uint32_t>(),
+		vm["steps"].as<uint32_t>(), vm["time-limit"].as<double>(),
+		[&]() { physics.step(delta_t); });
+
+	r.backend = backend == "simd" ? simd_name(detect_simd()) : backend;
+	if(backend == "symmetric")
+		r.backend = std::string("sym-") + simd_name(detect_simd());
+	r.count = count;
+	r.threads = pool.size();
+	r.local_size = 0;
+	// the tree codes count what they actually evaluated
+	summarize(times, (double)physics.interactions_per_step(), r);
+
+	physics.deinit();
+	return true;
+}
+
+void run_gpu(uint32_t count, uint32_t local_size, integrator_type integrator,
+	barrier_type barrier, const po::variables_map &vm, bench_result &r)
+{
+	gfx_config config;
+	config.obj_count = count;
+	config.headless = true;
+	config.work_group_size = local_size;
+	config.integrator = integrator;
+	config.barrier = barrier;
+	// with more than one the step times are the rate steps retire at once
+	// the queue is full, not the latency of one step
+	config.steps_in_flight = vm["steps-in-flight"].as<uint32_t>();
+	// every local size is its own program, only the first sweep compiles them
+	config.shader_cache_dir = shader_cache::default_dir();
+
+	gfx *g = new gfx();
+	g->init(config);
+
+	float delta_t = vm["dt"].as<float>();
+	std::vector<double> times = time_steps(vm["warmup"].as<uint32_t>(),
+		vm["steps"].as<uint32_t>(), vm["time-limit"].as<double>(),
+		[&]() { g->step(delta_t); });
+
+	r.backend = barrier == barrier_type::full ? "gpu-full" : "gpu";
+	r.count = count;
+	r.threads = 0;
+	r.local_size = local_size;
+	summarize(times, g->interactions_per_step(), r);
+
+	g->deinit();
+	delete g;
+}
+
+void write_csv(const std::string &fname, const std::vector<bench_result> &rs)
+{
+	std::ofstream f(fname);
+	f << "backend,count,threads,local_size,steps,steps_per_s,"
+		"interactions_per_s,gflops,min_ms,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+	for(const bench_result &r : rs)
+	{
+		f << r.backend << ',' << r.count << ',' << r.threads << ','
+			<< r.local_size << ',' << r.steps << ',' << r.steps_per_s << ','
+			<< r.interactions_per_s << ',' << r.gflops << ',' << r.min << ','
+			<< r.mean << ',' << r.p50 << ',' << r.p90 << ',' << r.p99 << ','
+			<< r.max << '\n';
+	}
+}
+
+void write_json(const std::string &fname, const std::vector<bench_result> &rs)
+{
+	std::ofstream f(fname);
+	f << "[\n";
+	for(size_t i = 0; i < rs.size(); i++)
+	{
+		const bench_result &r = rs[i];
+		f << "  {\"backend\": \"" << r.backend << "\", \"count\": " << r.count
+			<< ", \"threads\": " << r.threads << ", \"local_size\": "
+			<< r.local_size << ", \"steps\": " << r.steps
+			<< ", \"steps_per_s\": " << r.steps_per_s
+			<< ", \"interactions_per_s\": " << r.interactions_per_s
+			<< ", \"gflops\": " << r.gflops << ", \"ms\": {\"min\": " << r.min
+			<< ", \"mean\": " << r.mean << ", \"p50\": " << r.p50
+			<< ", \"p90\": " << r.p90 << ", \"p99\": " << r.p99
+			<< ", \"max\": " << r.max << "}}"
+			<< (i + 1 < rs.size() ? ",\n" : "\n");
+	}
+	f << "]\n";
+}
+
+void print_result(const bench_result &r)
+{
+	printf("%-10s %9u %7u %5u %6u %11.3f %12.4g %9.2f %9.3f %9.3f %9.3f\n",
+		r.backend.c_str(), r.count, r.threads, r.local_size, r.steps,
+		r.steps_per_s, r.interactions_per_s, r.gflops, r.p50, r.p90, r.p99);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	po::options_description desc("Options");
+	desc.add_options()
+		("help,h", "print this help")
+		("counts,n", po::value<std::string>()->default_value(
+			"1000,10000,100000,1000000"), "body counts to sweep")
+		("backends,b", po::value<std::string>()->default_value(
+			"gpu,scalar,simd,symmetric,bh,fmm"), "backends to sweep: gpu, "
+			"scalar, simd (best SIMD kernel), symmetric (best SIMD kernel, "
+			"each pair once), bh and fmm")
+		("threads,t", po::value<std::string>()->default_value("0"),
+			"thread counts to sweep for the CPU backends, 0 for one per "
+			"logical core")
+		("pin", "pin each CPU worker thread to its own CPU (Linux)")
+		("sort-every", po::value<uint32_t>()->default_value(0),
+			"reorder the bodies along a Morton curve every this many steps "
+			"for the CPU backends, 0 never")
+		("local-size,l", po::value<std::string>()->default_value("64,128,256"),
+			"compute shader local_size_x values to sweep for the gpu backend")
+		("barrier", po::value<std::string>()->default_value("targeted"),
+			"GPU memory barriers to sweep: full (every bit after every step, "
+			"shown as gpu-full) and targeted (only what the next pass reads)")
+		("steps-in-flight", po::value<uint32_t>()->default_value(1),
+			"GPU steps queued before waiting on the oldest one's fence, 1 "
+			"times every step on its own")
+		("steps,s", po::value<uint32_t>()->default_value(20),
+			"measured steps per configuration")
+		("warmup", po::value<uint32_t>()->default_value(2),
+			"unmeasured steps before the measured ones")
+		("time-limit", po::value<double>()->default_value(10.0),
+			"stop measuring a configuration after this many seconds, it "
+			"always gets at least one step")
+		("max-direct", po::value<uint32_t>()->default_value(131072),
+			"skip the all-pairs CPU backends above this many bodies")
+		("dt", po::value<float>()->default_value(1.0f / 60.0f),
+			"time step in seconds")
+		("integrator", po::value<std::string>()->default_value("rk4"),
+			"rk4, leapfrog or block (leapfrog with per body power of two time "
+			"steps at their default accuracy)")
+		("theta", po::value<float>()->default_value(0.5f),
+			"opening angle for bh and fmm")
+		("order", po::value<uint32_t>()->default_value(4),
+			"expansion order for fmm")
+		("seed", po::value<uint64_t>()->default_value(1),
+			"random seed for the CPU initial conditions")
+		("csv", po::value<std::string>(), "write the results to this CSV file")
+		("json", po::value<std::string>(),
+			"write the results to this JSON file");
+
+	po::variables_map vm;
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	}
+	catch(const po::error &e)
+	{
+		std::cout << "ERROR: " << e.what() << "\n" << desc << std::endl;
+		return 1;
+	}
+
+	if(vm.count("help"))
+	{
+		std::cout << desc << std::endl;
+		return 0;
+	}
+
+	std::vector<uint32_t> counts, threads, local_sizes;
+	if(!parse_list(vm["counts"].as<std::string>(), counts) ||
+		!parse_list(vm["threads"].as<std::string>(), threads) ||
+		!parse_list(vm["local-size"].as<std::string>(), local_sizes))
+	{
+		std::cout << "ERROR: --counts, --threads and --local-size take comma "
+			"separated numbers" << std::endl;
+		return 1;
+	}
+	std::vector<barrier_type> barriers;
+	for(const std::string &name : split_list(vm["barrier"].as<std::string>()))
+	{
+		barrier_type barrier;
+		if(!parse_barrier(name, barrier))
+		{
+			std::cout << "ERROR: unknown barrier " << name << std::endl;
+			return 1;
+		}
+		barriers.push_back(barrier);
+	}
+	if(barriers.empty() || vm["steps-in-flight"].as<uint32_t>() == 0)
+	{
+		std::cout << "ERROR: --barrier needs at least one name and "
+			"--steps-in-flight at least 1" << std::endl;
+		return 1;
+	}
+	if(vm["steps"].as<uint32_t>() == 0)
+	{
+		std::cout << "ERROR: --steps has to be at least 1" << std::endl;
+		return 1;
+	}
+	std::vector<std::string> backends =
+		split_list(vm["backends"].as<std::string>());
+	for(const std::string &b : backends)
+	{
+		if(b != "gpu" && b != "scalar" && b != "simd" && b != "symmetric" &&
+			b != "bh" && b != "fmm")
+		{
+			std::cout << "ERROR: unknown backend " << b << std::endl;
+			return 1;
+		}
+	}
+	uint32_t max_direct = vm["max-direct"].as<uint32_t>();
+	integrator_type integrator;
+	if(!parse_integrator(vm["integrator"].as<std::string>(), integrator))
+	{
+		std::cout << "ERROR: unknown integrator "
+			<< vm["integrator"].as<std::string>() << std::endl;
+		return 1;
+	}
+
+	std::vector<bench_result> results;
+
+	printf("%-10s %9s %7s %5s %6s %11s %12s %9s %9s %9s %9s\n", "backend",
+		"count", "threads", "local", "steps", "steps/s", "inter/s", "GFLOP/s",
+		"p50 ms", "p90 ms", "p99 ms");
+
+	for(uint32_t count : counts)
+	{
+		for(const std::string &backend : backends)
+		{
+			if(backend == "gpu")
+			{
+				for(barrier_type barrier : barriers)
+				{
+					for(uint32_t local_size : local_sizes)
+					{
+						bench_result r;
+						run_gpu(count, local_size, integrator, barrier, vm, r);
+						print_result(r);
+						results.push_back(r);
+					}
+				}
+				continue;
+			}
+
+			if((backend == "scalar" || backend == "simd" ||
+				backend == "symmetric") && count > max_direct)
+			{
+				printf("%-10s %9u skipped, above --max-direct\n",
+					backend.c_str(), count);
+				continue;
+			}
+
+			for(uint32_t t : threads)
+			{
+				bench_result r;
+				if(!run_cpu(backend, count, t, integrator, vm, r))
+				{
+					printf("%-10s %9u skipped, failed to start\n",
+						backend.c_str(), count);
+					continue;
+				}
+				print_result(r);
+				results.push_back(r);
+			}
+		}
+	}
+
+	if(vm.count("csv"))
+		write_csv(vm["csv"].as<std::string>(), results);
+	if(vm.count("json"))
+		write_json(vm["json"].as<std::string>(), results);
+
+	return 0;
+}
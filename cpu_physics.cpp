@@ -0,0 +1,372 @@
+#include "cpu_physics.hpp"
+
+#include "thread_pool.hpp"
+#include "initial_conditions.hpp"
+#include "force_solver.hpp"
+
+cpu_physics::cpu_physics(thread_pool *pool)
+{
+	this->pool = pool;
+	obj_count = 0;
+	current = 0;
+	next = 1;
+	last_interactions = 0;
+	integrator = integrator_type::rk4;
+	accel_valid = false;
+	sort_interval = 0;
+	step_count = 0;
+	solver = new direct_solver(pool, detect_simd());
+}
+
+cpu_physics::~cpu_physics()
+{
+	delete solver;
+}
+
+void cpu_physics::init(uint32_t obj_count, std::mt19937_64 &generator)
+{
+	std::vector<Eigen::Vector3f> x_aos[2], v_aos[2];
+	std::vector<float> m;
+	random_cube(generator, obj_count, x_aos, v_aos, m);
+
+	init(x_aos[0], v_aos[0], m);
+}
+
+void cpu_physics::init(const std::vector<Eigen::Vector3f> &x0,
+	const std::vector<Eigen::Vector3f> &v0, const std::vector<float> &m)
+{
+	obj_count = (uint32_t)x0.size();
+	current = 0;
+	next = 1;
+	accel_valid = false;
+
+	for(int i = 0; i < 2; i++)
+	{
+		// zeroed through the pool so each thread's share of the bodies is
+		// first touched, and so placed, by that thread
+		x[i].resize(obj_count, pool);
+		x[i].m.assign(m.begin(), m.end());
+		v[i].resize(obj_count, pool);
+	}
+	x[0].from_aos(x0);
+	v[0].from_aos(v0);
+
+	xk.resize(obj_count, pool);
+	for(int i = 0; i < 4; i++)
+		ak[i].resize(obj_count, pool);
+
+	ids.resize(obj_count);
+	for(uint32_t i = 0; i < obj_count; i++)
+		ids[i] = i;
+	body_id = ids;
+	step_count = 0;
+}
+
+void cpu_physics::deinit()
+{
+	for(int i = 0; i < 2; i++)
+	{
+		x[i] = particle_soa();
+		v[i] = vec3_soa();
+	}
+	xk = vec3_soa();
+	for(int i = 0; i < 4; i++)
+		ak[i] = vec3_soa();
+	std::vector<uint32_t>().swap(ids);
+	std::vector<uint32_t>().swap(levels);
+	std::vector<uint32_t>().swap(active);
+	std::vector<uint32_t>().swap(body_id);
+	order = morton_order();
+	obj_count = 0;
+}
+
+void cpu_physics::set_solver(force_solver *solver)
+{
+	delete this->solver;
+	this->solver = solver;
+	accel_valid = false;
+}
+
+void cpu_physics::set_integrator(integrator_type type)
+{
+	integrator = type;
+	accel_valid = false;
+}
+
+void cpu_physics::set_block_params(const block_params &params)
+{
+	block = params;
+	accel_valid = false;
+}
+
+void cpu_physics::state_by_id(std::vector<Eigen::Vector3f> &x_out,
+	std::vector<Eigen::Vector3f> &v_out) const
+{
+	x_out.resize(obj_count);
+	v_out.resize(obj_count);
+	for(uint32_t i = 0; i < obj_count; i++)
+	{
+		x_out[body_id[i]] = x[current].get(i);
+		v_out[body_id[i]] = v[current].get(i);
+	}
+}
+
+void cpu_physics::reorder()
+{
+	order.sort(pool, x[current]);
+	const std::vector<uint32_t> &src = order.id;
+
+	// sorted already holds x and m in the new order, everything else is
+	// gathered into a spare buffer and swapped in. The steps only write the
+	// positions of x[next] so its masses need the new order too.
+	std::swap(x[current], order.sorted);
+	particle_soa &x_cur = x[current];
+	particle_soa &x_next = x[next];
+	vec3_soa &v_new = v[next];
+	vec3_soa &a_new = ak[1];
+	body_id_tmp.resize(obj_count);
+	const bool have_levels = levels.size() == obj_count;
+	if(have_levels)
+		levels_tmp.resize(obj_count);
+
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t k = begin; k < end; k++)
+		{
+			uint32_t i = src[k];
+			x_next.m[k] = x_cur.m[k];
+			v_new.set(k, v[current].get(i));
+			if(accel_valid)
+				a_new.set(k, ak[0].get(i));
+			if(have_levels)
+				levels_tmp[k] = levels[i];
+			body_id_tmp[k] = body_id[i];
+		}
+	}, 1024);
+
+	std::swap(v[current], v[next]);
+	if(accel_valid)
+		std::swap(ak[0], ak[1]);
+	if(have_levels)
+		levels.swap(levels_tmp);
+	body_id.swap(body_id_tmp);
+}
+
+void cpu_physics::accel(const vec3_soa &q, vec3_soa &a)
+{
+	solver->accel(q, ids.data(), obj_count, a);
+}
+
+void cpu_physics::step(float delta_t)
+{
+	if(sort_interval != 0 && step_count % sort_interval == 0)
+		reorder();
+	step_count++;
+
+	if(integrator == integrator_type::leapfrog)
+		step_leapfrog(delta_t);
+	else if(integrator == integrator_type::block)
+		step_block(delta_t);
+	else
+		step_rk4(delta_t);
+
+	if(current == 0)
+	{
+		current = 1;
+		next = 0;
+	}
+	else
+	{
+		current = 0;
+		next = 1;
+	}
+}
+
+void cpu_physics::step_rk4(float delta_t)
+{
+	const particle_soa &x0 = x[current];
+	const vec3_soa &v0 = v[current];
+	particle_soa &x1 = x[next];
+	vec3_soa &v1 = v[next];
+	const float h = 0.5f * delta_t;
+
+	// every stage sums forces from x0 so a tree only needs building once
+	solver->reset_interactions();
+	solver->prepare(x0, G);
+
+	// the shader does all four stages per body, here each stage is one pass
+	// over every body so the force sum can run as a single vectorized sweep
+	accel(x0, ak[0]);
+
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+			xk.set(i, x0.get(i) + h * v0.get(i));
+	}, 1024);
+	accel(xk, ak[1]);
+
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f vk2 = v0.get(i) + h * ak[0].get(i);
+			xk.set(i, x0.get(i) + h * vk2);
+		}
+	}, 1024);
+	accel(xk, ak[2]);
+
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f vk3 = v0.get(i) + h * ak[1].get(i);
+			xk.set(i, x0.get(i) + delta_t * vk3);
+		}
+	}, 1024);
+	accel(xk, ak[3]);
+
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f vk1 = v0.get(i);
+			Eigen::Vector3f vk2 = vk1 + h * ak[0].get(i);
+			Eigen::Vector3f vk3 = vk1 + h * ak[1].get(i);
+			Eigen::Vector3f vk4 = vk1 + delta_t * ak[2].get(i);
+
+			v1.set(i, vk1 + (delta_t / 6.0f) * (ak[0].get(i) +
+				2 * ak[1].get(i) + 2 * ak[2].get(i) + ak[3].get(i)));
+			x1.set(i, x0.get(i) + (delta_t / 6.0f) *
+				(vk1 + 2 * vk2 + 2 * vk3 + vk4));
+		}
+	}, 1024);
+
+	last_interactions = solver->interactions();
+}
+
+void cpu_physics::step_leapfrog(float delta_t)
+{
+	const particle_soa &x0 = x[current];
+	const vec3_soa &v0 = v[current];
+	particle_soa &x1 = x[next];
+	vec3_soa &v1 = v[next];
+	vec3_soa &a = ak[0];
+	const float h = 0.5f * delta_t;
+
+	solver->reset_interactions();
+
+	// only the first step after init needs the acceleration at x0
+	if(!accel_valid)
+	{
+		solver->prepare(x0, G);
+		accel(x0, a);
+		accel_valid = true;
+	}
+
+	// kick a half step and drift, v1 holds the half step velocity until the
+	// second kick
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f v_half = v0.get(i) + h * a.get(i);
+			v1.set(i, v_half);
+			x1.set(i, x0.get(i) + delta_t * v_half);
+		}
+	}, 1024);
+
+	solver->prepare(x1, G);
+	accel(x1, a);
+
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+			v1.set(i, v1.get(i) + h * a.get(i));
+	}, 1024);
+
+	last_interactions = solver->interactions();
+}
+
+void cpu_physics::step_block(float delta_t)
+{
+	const uint32_t max_level = block.max_level;
+	const uint32_t substeps = 1u << max_level;
+	const float dt_min = delta_t / substeps;
+	vec3_soa &a = ak[0];
+	vec3_soa &a_new = ak[1];
+
+	// the substeps update next in place
+	particle_soa &x1 = x[next];
+	vec3_soa &v1 = v[next];
+	pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			x1.set(i, x[current].get(i));
+			v1.set(i, v[current].get(i));
+		}
+	}, 1024);
+
+	solver->reset_interactions();
+
+	// everything starts on the finest level until it has a jerk estimate
+	if(!accel_valid)
+	{
+		solver->prepare(x1, G);
+		accel(x1, a);
+		levels.assign(obj_count, max_level);
+		accel_valid = true;
+	}
+
+	for(uint32_t s = 0; s < substeps; s++)
+	{
+		// opening half kick for the bodies starting a step, then drift all of
+		// them with whatever velocity they have
+		pool->parallel_for(0, obj_count, [&](uint32_t begin, uint32_t end)
+		{
+			for(uint32_t i = begin; i < end; i++)
+			{
+				uint32_t stride = 1u << (max_level - levels[i]);
+				Eigen::Vector3f vi = v1.get(i);
+				if(s % stride == 0)
+					vi += (0.5f * stride * dt_min) * a.get(i);
+				v1.set(i, vi);
+				x1.set(i, x1.get(i) + dt_min * vi);
+			}
+		}, 1024);
+
+		active.clear();
+		for(uint32_t i = 0; i < obj_count; i++)
+		{
+			if((s + 1) % (1u << (max_level - levels[i])) == 0)
+				active.push_back(i);
+		}
+		uint32_t count = (uint32_t)active.size();
+		if(count == 0)
+			continue;
+
+		// forces on the finishing bodies from every body where it is now
+		solver->prepare(x1, G);
+		for(uint32_t k = 0; k < count; k++)
+			xk.set(k, x1.get(active[k]));
+		solver->accel(xk, active.data(), count, a_new);
+
+		// closing half kick and the next level
+		pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+		{
+			for(uint32_t k = begin; k < end; k++)
+			{
+				uint32_t i = active[k];
+				float dt = delta_t / (float)(1u << levels[i]);
+				Eigen::Vector3f a0 = a.get(i);
+				Eigen::Vector3f a1 = a_new.get(k);
+				v1.set(i, v1.get(i) + (0.5f * dt) * a1);
+				levels[i] = block_next_level(a0.data(), a1.data(), delta_t,
+					levels[i], s, block);
+				a.set(i, a1);
+			}
+		}, 256);
+	}
+
+	last_interactions = solver->interactions();
+}
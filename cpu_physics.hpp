@@ -0,0 +1,153 @@
+#ifndef CPU_PHYSICS_HPP
+#define CPU_PHYSICS_HPP
+
+#include <vector>
+#include <random>
+#include <Eigen/Core>
+
+#include "particle_soa.hpp"
+#include "integrator.hpp"
+#include "morton.hpp"
+
+class thread_pool;
+class force_solver;
+
+/**
+ * @brief Headless N-body simulation that runs the same RK4 or leapfrog step as
+ * physics.comp across all the threads of a thread_pool
+ *
+ * The state ping-pongs between current and next every step the same way gfx
+ * does, but it is stored as structure-of-arrays so the pair kernel can
+ * vectorize. The masses are kept next to the positions in both x buffers.
+ *
+ * The force sum itself is done by a force_solver, all-pairs by default.
+ *
+ * Bodies can be reordered along a Morton curve every few steps so the ones
+ * close in space are close in memory. body_ids() maps the storage order back
+ * to the order the bodies were given in.
+ */
+class cpu_physics
+{
+public:
+	cpu_physics(thread_pool *pool);
+	~cpu_physics();
+
+	void init(uint32_t obj_count, std::mt19937_64 &generator);
+	/**
+	 * @brief Start from a copy of an existing state, gfx uses this to check
+	 * the GPU against the CPU from the same bodies
+	 */
+	void init(const std::vector<Eigen::Vector3f> &x0,
+		const std::vector<Eigen::Vector3f> &v0, const std::vector<float> &m);
+	void deinit();
+	/**
+	 * @brief Advance every body by delta_t and swap current and next
+	 */
+	void step(float delta_t);
+
+	/**
+	 * @brief Replace the force solver, cpu_physics takes ownership of it
+	 *
+	 * The default is a direct_solver with the widest pair kernel the CPU
+	 * supports.
+	 */
+	void set_solver(force_solver *solver);
+	const force_solver *get_solver() const { return solver; }
+	/**
+	 * @brief Pick the integrator, rk4 by default
+	 */
+	void set_integrator(integrator_type type);
+	integrator_type get_integrator() const { return integrator; }
+	void set_block_params(const block_params &params);
+	/**
+	 * @brief Sort every per body array by Morton key before every steps-th
+	 * step, 0 (the default) keeps the initial order
+	 */
+	void set_sort_interval(uint32_t steps) { sort_interval = steps; }
+
+	uint32_t count() const { return obj_count; }
+	float gravity() const { return G; }
+	/**
+	 * @brief Interactions evaluated by the last step, all 4 RK4 force passes,
+	 * the one leapfrog pass or the bodies finishing each block substep
+	 */
+	uint64_t interactions_per_step() const { return last_interactions; }
+	/**
+	 * @brief The state in storage order, see body_ids()
+	 */
+	const particle_soa &positions() const { return x[current]; }
+	const vec3_soa &velocities() const { return v[current]; }
+	/**
+	 * @brief body_ids()[i] is the index body i of positions() had in init()
+	 */
+	const std::vector<uint32_t> &body_ids() const { return body_id; }
+	/**
+	 * @brief Positions and velocities in the order init() was given them
+	 */
+	void state_by_id(std::vector<Eigen::Vector3f> &x_out,
+		std::vector<Eigen::Vector3f> &v_out) const;
+
+private:
+	/**
+	 * @brief Acceleration at every point in q from every body in x[current],
+	 * the same sum as accel() in physics.comp
+	 */
+	void accel(const vec3_soa &q, vec3_soa &a);
+	void step_rk4(float delta_t);
+	void step_leapfrog(float delta_t);
+	void step_block(float delta_t);
+	/**
+	 * @brief Sort x[current], v[current] and the per body state between steps
+	 */
+	void reorder();
+
+	thread_pool *pool;
+	force_solver *solver;
+	uint64_t last_interactions;
+
+	/**
+	 * @brief Position and mass, two buffers for new and old
+	 */
+	particle_soa x[2];
+	/**
+	 * @brief Velocity, two buffers for new and old
+	 */
+	vec3_soa v[2];
+	/**
+	 * @brief RK4 stage position and the four stage accelerations, leapfrog
+	 * keeps the acceleration at x[current] in ak[0] between steps
+	 */
+	vec3_soa xk;
+	vec3_soa ak[4];
+	integrator_type integrator;
+	/**
+	 * @brief True when ak[0] holds the acceleration at x[current]
+	 */
+	bool accel_valid;
+	block_params block;
+	/**
+	 * @brief Block time step level of every body
+	 */
+	std::vector<uint32_t> levels;
+	/**
+	 * @brief The bodies finishing a step on the current block substep
+	 */
+	std::vector<uint32_t> active;
+	/**
+	 * @brief ids[i] = i, the body each query point skips
+	 */
+	std::vector<uint32_t> ids;
+
+	uint32_t sort_interval;
+	uint64_t step_count;
+	morton_order order;
+	std::vector<uint32_t> body_id, body_id_tmp, levels_tmp;
+
+	// float to match the shader
+	float G = 6.67408e-11f;
+	uint32_t obj_count;
+
+	uint32_t current, next;
+};
+
+#endif
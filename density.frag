@@ -0,0 +1,20 @@
+#version 450
+
+// maps the mass splat.comp summed per pixel to a colour
+
+uniform usampler2D density;
+// brightness of a pixel holding one average body is 1 - exp(-exposure)
+uniform float exposure;
+
+out vec4 out_color;
+
+void main()
+{
+	uint d = texelFetch(density, ivec2(gl_FragCoord.xy), 0).r;
+	float bodies = float(d) / 256.0;
+	// saturates smoothly so the dense core and the sparse halo both show
+	float c = 1.0 - exp(-exposure * bodies);
+	// a little warmer where it is dense
+	vec3 color = vec3(c, pow(c, 1.5), pow(c, 3.0));
+	out_color = vec4(pow(color, vec3(1.0 / 2.2)), 1.0);
+}
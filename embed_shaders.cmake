@@ -0,0 +1,23 @@
+# writes OUTPUT, a C++ file holding every shader in SHADERS (| separated names
+# relative to SOURCE_DIR) as a raw string so the program does not need the
+# GLSL files next to it at run time
+# cmake -DSOURCE_DIR=<dir> -DOUTPUT=<file> -DSHADERS=a.comp|b.vert -P embed_shaders.cmake
+
+string(REPLACE "|" ";" SHADER_LIST "${SHADERS}")
+
+set(CONTENT "// generated by embed_shaders.cmake, edit the GLSL files instead\n\n")
+set(CONTENT "${CONTENT}#include \"shader_cache.hpp\"\n\n")
+set(CONTENT "${CONTENT}const embedded_shader embedded_shaders[] =\n{\n")
+foreach(SHADER ${SHADER_LIST})
+	file(READ "${SOURCE_DIR}/${SHADER}" SOURCE)
+	set(CONTENT "${CONTENT}\t{\"${SHADER}\", R\"glsl(${SOURCE})glsl\"},\n")
+endforeach()
+set(CONTENT "${CONTENT}\t{nullptr, nullptr}\n};\n")
+
+# only touch the output when it changes so nothing rebuilds for nothing
+if(EXISTS "${OUTPUT}")
+	file(READ "${OUTPUT}" OLD_CONTENT)
+endif()
+if(NOT "${CONTENT}" STREQUAL "${OLD_CONTENT}")
+	file(WRITE "${OUTPUT}" "${CONTENT}")
+endif()
@@ -0,0 +1,518 @@
+#include "fmm.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+// deepest level a 63 bit Morton key can split to
+static const uint32_t max_level = 21;
+
+static double binomial(uint32_t n, uint32_t k)
+{
+	double r = 1.0;
+	for(uint32_t i = 1; i <= k; i++)
+		r = r * (n - k + i) / i;
+	return r;
+}
+
+fmm::fmm(thread_pool *pool, uint32_t order, float theta, uint32_t leaf_size) :
+	force_solver(pool)
+{
+	p = std::max(order, 1u);
+	this->theta = theta;
+	this->leaf_size = leaf_size;
+	G = 0.0f;
+	make_tables();
+}
+
+void fmm::make_tables()
+{
+	const uint32_t side = p + 1;
+	index_of.assign(side * side * side, -1);
+	mi.clear();
+	for(uint32_t degree = 0; degree <= p; degree++)
+	{
+		for(uint32_t kx = degree + 1; kx-- > 0;)
+		{
+			for(uint32_t ky = degree - kx + 1; ky-- > 0;)
+			{
+				uint32_t kz = degree - kx - ky;
+				index_of[(kx * side + ky) * side + kz] = (int32_t)mi.size();
+				mi.push_back({(uint8_t)kx, (uint8_t)ky, (uint8_t)kz});
+			}
+		}
+	}
+	ncoef = (uint32_t)mi.size();
+
+	auto index = [&](int kx, int ky, int kz) -> int32_t
+	{
+		if(kx < 0 || ky < 0 || kz < 0 || kx + ky + kz > (int)p)
+			return -1;
+		return index_of[(kx * side + ky) * side + kz];
+	};
+
+	prev.assign(ncoef, -1);
+	prev_axis.assign(ncoef, -1);
+	for(int a = 0; a < 3; a++)
+	{
+		minus1[a].assign(ncoef, -1);
+		minus2[a].assign(ncoef, -1);
+	}
+	for(uint32_t k = 0; k < ncoef; k++)
+	{
+		int kk[3] = {mi[k][0], mi[k][1], mi[k][2]};
+		for(int a = 0; a < 3; a++)
+		{
+			int d1[3] = {kk[0], kk[1], kk[2]};
+			d1[a] -= 1;
+			minus1[a][k] = index(d1[0], d1[1], d1[2]);
+			d1[a] -= 1;
+			minus2[a][k] = index(d1[0], d1[1], d1[2]);
+			if(prev[k] < 0 && minus1[a][k] >= 0)
+			{
+				prev[k] = minus1[a][k];
+				prev_axis[k] = a;
+			}
+		}
+	}
+
+	m2m_terms.clear();
+	m2l_terms.clear();
+	l2l_terms.clear();
+	for(uint32_t k = 0; k < ncoef; k++)
+	{
+		for(uint32_t j = 0; j < ncoef; j++)
+		{
+			int dk[3], sk[3];
+			bool below = true;
+			for(int a = 0; a < 3; a++)
+			{
+				dk[a] = (int)mi[k][a] - (int)mi[j][a];
+				sk[a] = (int)mi[k][a] + (int)mi[j][a];
+				below = below && dk[a] >= 0;
+			}
+
+			// M2M: M_k += C(k, j) d^(k - j) M_j
+			if(below)
+			{
+				double c = 1.0;
+				for(int a = 0; a < 3; a++)
+					c *= binomial(mi[k][a], mi[j][a]);
+				term t = {k, j, (uint32_t)index(dk[0], dk[1], dk[2]), c};
+				m2m_terms.push_back(t);
+				// L2L is the same pairing the other way around:
+				// L_j += C(k, j) d^(k - j) L_k
+				t.out = j;
+				t.in = k;
+				l2l_terms.push_back(t);
+			}
+
+			// M2L: L_k += (-1)^|j| C(k + j, k) T_(k + j) M_j
+			int32_t s = index(sk[0], sk[1], sk[2]);
+			if(s >= 0)
+			{
+				double c = (mi[j][0] + mi[j][1] + mi[j][2]) & 1 ? -1.0 : 1.0;
+				for(int a = 0; a < 3; a++)
+					c *= binomial(sk[a], mi[k][a]);
+				term t = {k, j, (uint32_t)s, c};
+				m2l_terms.push_back(t);
+			}
+		}
+	}
+}
+
+void fmm::powers(const double d[3], double *pw) const
+{
+	pw[0] = 1.0;
+	for(uint32_t k = 1; k < ncoef; k++)
+		pw[k] = pw[prev[k]] * d[prev_axis[k]];
+}
+
+void fmm::derivatives(const double r[3], double *t) const
+{
+	// Taylor coefficients of 1/|r| from the recurrence
+	// |k| r^2 t_k = -(2|k| - 1) sum_i r_i t_(k - e_i)
+	//               - (|k| - 1) sum_i t_(k - 2e_i)
+	double r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+	double inv_r2 = 1.0 / r2;
+	t[0] = std::sqrt(inv_r2);
+	for(uint32_t k = 1; k < ncoef; k++)
+	{
+		double n = mi[k][0] + mi[k][1] + mi[k][2];
+		double s1 = 0.0, s2 = 0.0;
+		for(int a = 0; a < 3; a++)
+		{
+			if(minus1[a][k] >= 0)
+				s1 += r[a] * t[minus1[a][k]];
+			if(minus2[a][k] >= 0)
+				s2 += t[minus2[a][k]];
+		}
+		t[k] = -((2.0 * n - 1.0) * s1 + (n - 1.0) * s2) * inv_r2 / n;
+	}
+}
+
+void fmm::prepare(const particle_soa &src, float G)
+{
+	this->G = G;
+	order.sort(pool, src);
+	build_tree();
+	build_lists();
+	upward();
+	downward();
+}
+
+void fmm::build_tree()
+{
+	const uint32_t n = order.sorted.size();
+	cells.clear();
+	level_start.clear();
+	if(n == 0)
+		return;
+
+	fmm_cell root;
+	root.half = 0.5f * order.size;
+	for(int k = 0; k < 3; k++)
+		root.center[k] = order.min_corner[k] + root.half;
+	root.radius = root.half * std::sqrt(3.0f);
+	root.level = 0;
+	root.parent = 0;
+	root.child = 0;
+	root.child_count = 0;
+	root.first = 0;
+	root.count = n;
+	cells.push_back(root);
+
+	// breadth first so each level is contiguous for the M2M and L2L passes
+	level_start.push_back(0);
+	for(uint32_t level = 0; ; level++)
+	{
+		uint32_t begin = level_start[level];
+		uint32_t end = (uint32_t)cells.size();
+		level_start.push_back(end);
+		if(begin == end)
+			break;
+
+		for(uint32_t c = begin; c < end; c++)
+		{
+			if(cells[c].count <= leaf_size || level + 1 >= max_level)
+				continue;
+
+			uint32_t bounds[9];
+			order.split(cells[c].first, cells[c].count, level, bounds);
+			cells[c].child = (uint32_t)cells.size();
+			for(uint32_t oct = 0; oct < 8; oct++)
+			{
+				if(bounds[oct + 1] == bounds[oct])
+					continue;
+
+				fmm_cell child;
+				child.half = 0.5f * cells[c].half;
+				child.center[0] = cells[c].center[0] +
+					(oct & 4 ? child.half : -child.half);
+				child.center[1] = cells[c].center[1] +
+					(oct & 2 ? child.half : -child.half);
+				child.center[2] = cells[c].center[2] +
+					(oct & 1 ? child.half : -child.half);
+				child.radius = child.half * std::sqrt(3.0f);
+				child.level = level + 1;
+				child.parent = c;
+				child.child = 0;
+				child.child_count = 0;
+				child.first = bounds[oct];
+				child.count = bounds[oct + 1] - bounds[oct];
+				cells.push_back(child);
+			}
+			cells[c].child_count = (uint32_t)cells.size() - cells[c].child;
+		}
+	}
+	// drop the empty last level
+	level_start.pop_back();
+
+	leaf_of.resize(n);
+	pool->parallel_for(0, (uint32_t)cells.size(), [&](uint32_t begin,
+		uint32_t end)
+	{
+		for(uint32_t c = begin; c < end; c++)
+		{
+			if(cells[c].child_count != 0)
+				continue;
+			for(uint32_t k = cells[c].first;
+				k < cells[c].first + cells[c].count; k++)
+				leaf_of[order.id[k]] = c;
+		}
+	}, 256);
+}
+
+void fmm::build_lists()
+{
+	m2l_list.assign(cells.size(), std::vector<uint32_t>());
+	p2p_list.assign(cells.size(), std::vector<uint32_t>());
+	if(cells.empty())
+		return;
+
+	uint64_t m2l_count = 0;
+	std::vector<std::pair<uint32_t, uint32_t>> stack;
+	stack.push_back(std::make_pair(0u, 0u));
+	while(!stack.empty())
+	{
+		uint32_t a = stack.back().first;
+		uint32_t b = stack.back().second;
+		stack.pop_back();
+
+		const fmm_cell &ca = cells[a];
+		const fmm_cell &cb = cells[b];
+		float dx = ca.center[0] - cb.center[0];
+		float dy = ca.center[1] - cb.center[1];
+		float dz = ca.center[2] - cb.center[2];
+		float dist = std::sqrt(dx * dx + dy * dy + dz * dz);
+
+		if(a != b && ca.radius + cb.radius < theta * dist)
+		{
+			m2l_list[a].push_back(b);
+			m2l_count++;
+		}
+		else if(ca.child_count == 0 && cb.child_count == 0)
+		{
+			p2p_list[a].push_back(b);
+		}
+		else if(cb.child_count == 0 ||
+			(ca.child_count != 0 && ca.radius >= cb.radius))
+		{
+			for(uint32_t c = ca.child; c < ca.child + ca.child_count; c++)
+				stack.push_back(std::make_pair(c, b));
+		}
+		else
+		{
+			for(uint32_t c = cb.child; c < cb.child + cb.child_count; c++)
+				stack.push_back(std::make_pair(a, c));
+		}
+	}
+
+	pair_count += m2l_count;
+}
+
+void fmm::upward()
+{
+	multipole.assign(cells.size() * ncoef, 0.0);
+	const particle_soa &sorted = order.sorted;
+
+	// P2M
+	pool->parallel_for(0, (uint32_t)cells.size(), [&](uint32_t begin,
+		uint32_t end)
+	{
+		std::vector<double> pw(ncoef);
+		for(uint32_t c = begin; c < end; c++)
+		{
+			const fmm_cell &cell = cells[c];
+			if(cell.child_count != 0)
+				continue;
+			double *m = &multipole[(size_t)c * ncoef];
+			for(uint32_t k = cell.first; k < cell.first + cell.count; k++)
+			{
+				double d[3] = {sorted.x[k] - (double)cell.center[0],
+					sorted.y[k] - (double)cell.center[1],
+					sorted.z[k] - (double)cell.center[2]};
+				powers(d, pw.data());
+				for(uint32_t j = 0; j < ncoef; j++)
+					m[j] += sorted.m[k] * pw[j];
+			}
+		}
+	}, 64);
+
+	// M2M, deepest level first, every cell of a level is independent
+	for(uint32_t level = (uint32_t)level_start.size() - 1; level-- > 0;)
+	{
+		pool->parallel_for(level_start[level], level_start[level + 1],
+			[&](uint32_t begin, uint32_t end)
+		{
+			std::vector<double> pw(ncoef);
+			for(uint32_t c = begin; c < end; c++)
+			{
+				const fmm_cell &cell = cells[c];
+				double *m = &multipole[(size_t)c * ncoef];
+				for(uint32_t ch = cell.child;
+					ch < cell.child + cell.child_count; ch++)
+				{
+					double d[3] = {
+						(double)cells[ch].center[0] - cell.center[0],
+						(double)cells[ch].center[1] - cell.center[1],
+						(double)cells[ch].center[2] - cell.center[2]};
+					powers(d, pw.data());
+					const double *mc = &multipole[(size_t)ch * ncoef];
+					for(const term &t : m2m_terms)
+						m[t.out] += t.c * pw[t.t] * mc[t.in];
+				}
+			}
+		}, 16);
+	}
+}
+
+void fmm::downward()
+{
+	local.assign(cells.size() * ncoef, 0.0);
+
+	// M2L, each target cell only writes its own local expansion
+	pool->parallel_for(0, (uint32_t)cells.size(), [&](uint32_t begin,
+		uint32_t end)
+	{
+		std::vector<double> t(ncoef);
+		for(uint32_t c = begin; c < end; c++)
+		{
+			double *l = &local[(size_t)c * ncoef];
+			for(uint32_t s : m2l_list[c])
+			{
+				double r[3] = {(double)cells[c].center[0] - cells[s].center[0],
+					(double)cells[c].center[1] - cells[s].center[1],
+					(double)cells[c].center[2] - cells[s].center[2]};
+				derivatives(r, t.data());
+				const double *m = &multipole[(size_t)s * ncoef];
+				for(const term &tm : m2l_terms)
+					l[tm.out] += tm.c * t[tm.t] * m[tm.in];
+			}
+		}
+	}, 16);
+
+	// L2L, root first
+	for(uint32_t level = 1; level + 1 < level_start.size(); level++)
+	{
+		pool->parallel_for(level_start[level], level_start[level + 1],
+			[&](uint32_t begin, uint32_t end)
+		{
+			std::vector<double> pw(ncoef);
+			for(uint32_t c = begin; c < end; c++)
+			{
+				uint32_t parent = cells[c].parent;
+				double d[3] = {
+					(double)cells[c].center[0] - cells[parent].center[0],
+					(double)cells[c].center[1] - cells[parent].center[1],
+					(double)cells[c].center[2] - cells[parent].center[2]};
+				powers(d, pw.data());
+				double *l = &local[(size_t)c * ncoef];
+				const double *lp = &local[(size_t)parent * ncoef];
+				for(const term &t : l2l_terms)
+					l[t.out] += t.c * pw[t.t] * lp[t.in];
+			}
+		}, 16);
+	}
+}
+
+void fmm::accel(const vec3_soa &q, const uint32_t *ids, uint32_t count,
+	vec3_soa &a)
+{
+	const particle_soa &sorted = order.sorted;
+	const std::vector<uint32_t> &id = order.id;
+	// when the queries are the bodies themselves go in Morton order so
+	// consecutive queries share a leaf
+	const bool in_order = count == sorted.size();
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		std::vector<double> pw(ncoef);
+		uint64_t interactions = 0;
+		for(uint32_t k = begin; k < end; k++)
+		{
+			uint32_t i = in_order ? id[k] : k;
+			uint32_t body = ids[i];
+			uint32_t leaf = leaf_of[body];
+			const fmm_cell &cell = cells[leaf];
+			float px = q.x[i], py = q.y[i], pz = q.z[i];
+
+			// L2P, the gradient of the local expansion
+			double h[3] = {px - (double)cell.center[0],
+				py - (double)cell.center[1], pz - (double)cell.center[2]};
+			powers(h, pw.data());
+			const double *l = &local[(size_t)leaf * ncoef];
+			double far[3] = {0.0, 0.0, 0.0};
+			for(uint32_t n = 1; n < ncoef; n++)
+			{
+				for(int ax = 0; ax < 3; ax++)
+				{
+					if(mi[n][ax] != 0)
+						far[ax] += l[n] * mi[n][ax] * pw[minus1[ax][n]];
+				}
+			}
+
+			// P2P with the neighbouring leaves
+			float ax = 0.0f, ay = 0.0f, az = 0.0f;
+			for(uint32_t s : p2p_list[leaf])
+			{
+				// branch free so the compiler can vectorize it, the self
+				// term is selected away rather than skipped
+				for(uint32_t j = cells[s].first;
+					j < cells[s].first + cells[s].count; j++)
+				{
+					float dx = sorted.x[j] - px;
+					float dy = sorted.y[j] - py;
+					float dz = sorted.z[j] - pz;
+					float d2 = dx * dx + dy * dy + dz * dz;
+					float inv = 1.0f / std::sqrt(d2);
+					float s3 = id[j] == body ? 0.0f :
+						sorted.m[j] * inv * inv * inv;
+					ax += s3 * dx;
+					ay += s3 * dy;
+					az += s3 * dz;
+				}
+				interactions += cells[s].count;
+			}
+
+			a.set(i, Eigen::Vector3f(G * (ax + (float)far[0]),
+				G * (ay + (float)far[1]), G * (az + (float)far[2])));
+		}
+		pair_count += interactions;
+	}, 64);
+}
+
+void fmm_report(thread_pool *pool, const particle_soa &src, float G,
+	float theta, uint32_t max_order)
+{
+	const uint32_t n = src.size();
+	std::vector<uint32_t> ids(n);
+	for(uint32_t i = 0; i < n; i++)
+		ids[i] = i;
+
+	vec3_soa ref, a;
+	ref.resize(n);
+	a.resize(n);
+
+	direct_solver direct(pool, detect_simd());
+	auto t0 = std::chrono::steady_clock::now();
+	direct.prepare(src, G);
+	direct.accel(src, ids.data(), n, ref);
+	double direct_time = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - t0).count();
+
+	printf("FMM error vs all-pairs, %u bodies, theta %.2f\n", n, theta);
+	printf("all-pairs: %.4f s\n", direct_time);
+	printf("order   cells     time (s)  speedup   rms error   max error\n");
+	for(uint32_t order = 1; order <= max_order; order++)
+	{
+		fmm solver(pool, order, theta);
+		t0 = std::chrono::steady_clock::now();
+		solver.prepare(src, G);
+		solver.accel(src, ids.data(), n, a);
+		double time = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - t0).count();
+
+		// a body with no net force, a lone one or one at a symmetric centre,
+		// has no relative error to speak of
+		double rms = 0.0, max_err = 0.0;
+		uint32_t measured = 0;
+		for(uint32_t i = 0; i < n; i++)
+		{
+			double norm = ref.get(i).norm();
+			if(norm == 0.0)
+				continue;
+			double err = (a.get(i) - ref.get(i)).norm() / norm;
+			rms += err * err;
+			max_err = std::max(max_err, err);
+			measured++;
+		}
+		rms = measured > 0 ? std::sqrt(rms / measured) : 0.0;
+
+		printf("%5u %7u %12.4f %8.2f %11.3e %11.3e\n", order,
+			solver.cell_count(), time, direct_time / time, rms, max_err);
+	}
+}
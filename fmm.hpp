@@ -0,0 +1,130 @@
+#ifndef FMM_HPP
+#define FMM_HPP
+
+#include <vector>
+#include <array>
+
+#include "force_solver.hpp"
+#include "morton.hpp"
+
+/**
+ * @brief One adaptive octree cell, the children of a cell are contiguous
+ */
+struct fmm_cell
+{
+	float center[3];
+	float half;
+	/**
+	 * @brief Distance from the center to a corner, bounds every body
+	 */
+	float radius;
+	uint32_t level;
+	uint32_t parent;
+	/**
+	 * @brief First child and number of children, 0 children for a leaf
+	 */
+	uint32_t child, child_count;
+	/**
+	 * @brief Range of the cell's bodies in the sorted body arrays
+	 */
+	uint32_t first, count;
+};
+
+/**
+ * @brief O(N) fast multipole method using Cartesian Taylor expansions of 1/r
+ *
+ * prepare() builds an adaptive octree level by level, finds the interaction
+ * lists with a dual tree walk and then runs the P2M, M2M, M2L and L2L passes
+ * on the pool. accel() only does L2P and the near field P2P at the query
+ * points, so RK4's four force passes share one set of expansions.
+ *
+ * A query point is assumed to be near the body ids[i] it belongs to, it is
+ * evaluated against that body's leaf. Expansions are truncated at total degree
+ * order, higher orders cost roughly order^6 per M2L but converge quickly.
+ */
+class fmm : public force_solver
+{
+public:
+	fmm(thread_pool *pool, uint32_t order = 4, float theta = 0.5f,
+		uint32_t leaf_size = 32);
+
+	const char *name() const { return "fmm"; }
+	void prepare(const particle_soa &src, float G);
+	void accel(const vec3_soa &q, const uint32_t *ids, uint32_t count,
+		vec3_soa &a);
+
+	uint32_t expansion_order() const { return p; }
+	uint32_t cell_count() const { return (uint32_t)cells.size(); }
+
+private:
+	/**
+	 * @brief out[o] += c * in[i] * t[k] for every term, the same shape works
+	 * for M2M, M2L and L2L
+	 */
+	struct term
+	{
+		uint32_t out, in, t;
+		double c;
+	};
+
+	void make_tables();
+	void build_tree();
+	void build_lists();
+	void upward();
+	void downward();
+	/**
+	 * @brief pw[k] = d^k for every multi-index up to total degree p
+	 */
+	void powers(const double d[3], double *pw) const;
+	/**
+	 * @brief t[k] = (1 / k!) d^k (1 / |r|) / dr^k for total degree up to p
+	 */
+	void derivatives(const double r[3], double *t) const;
+
+	uint32_t p;
+	float theta;
+	uint32_t leaf_size;
+	float G;
+
+	morton_order order;
+	std::vector<fmm_cell> cells;
+	/**
+	 * @brief Cells of level l are level_start[l] to level_start[l + 1]
+	 */
+	std::vector<uint32_t> level_start;
+	/**
+	 * @brief Leaf cell holding each source body
+	 */
+	std::vector<uint32_t> leaf_of;
+	/**
+	 * @brief Per target cell, the well separated source cells and for leaves
+	 * the neighbouring leaves to sum directly
+	 */
+	std::vector<std::vector<uint32_t>> m2l_list, p2p_list;
+
+	/**
+	 * @brief ncoef multipole and local coefficients per cell
+	 */
+	std::vector<double> multipole, local;
+
+	// multi-index tables
+	uint32_t ncoef;
+	std::vector<std::array<uint8_t, 3>> mi;
+	std::vector<int32_t> index_of;
+	/**
+	 * @brief Index of k - e_axis and which axis, for building powers and the
+	 * derivative recurrence
+	 */
+	std::vector<int32_t> prev, prev_axis;
+	std::vector<int32_t> minus1[3], minus2[3];
+	std::vector<term> m2m_terms, m2l_terms, l2l_terms;
+};
+
+/**
+ * @brief Print the force error and time of each expansion order from 1 to
+ * max_order against the all-pairs sum over the same bodies
+ */
+void fmm_report(thread_pool *pool, const particle_soa &src, float G,
+	float theta, uint32_t max_order);
+
+#endif
@@ -0,0 +1,128 @@
+#include "force_solver.hpp"
+
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+direct_solver::direct_solver(thread_pool *pool, simd_level level) :
+	force_solver(pool)
+{
+	this->level = level;
+	kernel = select_pair_kernel(level);
+	src = nullptr;
+	G = 0.0f;
+}
+
+void direct_solver::prepare(const particle_soa &src, float G)
+{
+	this->src = &src;
+	this->G = G;
+}
+
+void direct_solver::accel(const vec3_soa &q, const uint32_t *ids,
+	uint32_t count, vec3_soa &a)
+{
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		kernel(q.x.data() + begin, q.y.data() + begin, q.z.data() + begin,
+			ids + begin, end - begin, *src, G,
+			a.x.data() + begin, a.y.data() + begin, a.z.data() + begin);
+	}, 64);
+
+	pair_count += (uint64_t)count * (src->size() - 1);
+}
+
+symmetric_solver::symmetric_solver(thread_pool *pool, simd_level level) :
+	direct_solver(pool, level)
+{
+	label = std::string(simd_name(level)) + " symmetric";
+	tile_kernel = select_sym_tile_kernel(level);
+}
+
+void symmetric_solver::prepare(const particle_soa &src, float G)
+{
+	direct_solver::prepare(src, G);
+
+	const uint32_t n = src.size();
+	const uint32_t tiles = (n + tile - 1) / tile;
+	if(padded.size() != tiles * tile)
+	{
+		padded.resize(tiles * tile, pool);
+		partial.resize(pool->size());
+		for(vec3_soa &p : partial)
+			p.resize(tiles * tile);
+
+		tile_pairs.clear();
+		for(uint32_t i = 0; i < tiles; i++)
+		{
+			for(uint32_t j = i; j < tiles; j++)
+				tile_pairs.push_back(std::make_pair(i, j));
+		}
+	}
+
+	std::copy(src.x.begin(), src.x.end(), padded.x.begin());
+	std::copy(src.y.begin(), src.y.end(), padded.y.begin());
+	std::copy(src.z.begin(), src.z.end(), padded.z.begin());
+	std::copy(src.m.begin(), src.m.end(), padded.m.begin());
+	// spread out so no two padding bodies share a position, their pull is
+	// zero and whatever they feel is never read
+	for(uint32_t i = n; i < padded.size(); i++)
+	{
+		padded.x[i] = 1.0e15f * (i - n + 1);
+		padded.y[i] = 0.0f;
+		padded.z[i] = 0.0f;
+		padded.m[i] = 0.0f;
+	}
+}
+
+void symmetric_solver::accel(const vec3_soa &q, const uint32_t *ids,
+	uint32_t count, vec3_soa &a)
+{
+	const uint32_t n = src->size();
+	if(&q != static_cast<const vec3_soa *>(src) || count != n)
+	{
+		direct_solver::accel(q, ids, count, a);
+		return;
+	}
+
+	const uint32_t slots = (uint32_t)partial.size();
+	pool->parallel_for(0, slots, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t s = begin; s < end; s++)
+		{
+			vec3_soa &p = partial[s];
+			std::fill(p.x.begin(), p.x.end(), 0.0f);
+			std::fill(p.y.begin(), p.y.end(), 0.0f);
+			std::fill(p.z.begin(), p.z.end(), 0.0f);
+
+			// the diagonal tiles are half the work, dealing the pairs out
+			// round robin spreads them evenly
+			for(size_t k = s; k < tile_pairs.size(); k += slots)
+			{
+				tile_kernel(padded, tile_pairs[k].first * tile,
+					tile_pairs[k].second * tile, tile, p.x.data(),
+					p.y.data(), p.z.data());
+			}
+		}
+	}, 1);
+
+	pool->parallel_for(0, n, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			float sx = 0.0f, sy = 0.0f, sz = 0.0f;
+			for(const vec3_soa &p : partial)
+			{
+				sx += p.x[i];
+				sy += p.y[i];
+				sz += p.z[i];
+			}
+			a.x[i] = G * sx;
+			a.y[i] = G * sy;
+			a.z[i] = G * sz;
+		}
+	}, 1024);
+
+	// counted both ways like the other solvers so the rates compare
+	pair_count += (uint64_t)n * (n - 1);
+}
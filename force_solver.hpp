@@ -0,0 +1,111 @@
+#ifndef FORCE_SOLVER_HPP
+#define FORCE_SOLVER_HPP
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "particle_soa.hpp"
+#include "pair_kernel.hpp"
+
+class thread_pool;
+
+/**
+ * @brief Interface for the CPU gravity solvers
+ *
+ * Each step cpu_physics calls prepare() once with the bodies at the start of
+ * the step, then accel() once per force evaluation the integrator needs. The
+ * query points do not have to be the source positions, RK4 asks for the force
+ * at its stage positions.
+ */
+class force_solver
+{
+public:
+	force_solver(thread_pool *pool) : pool(pool), pair_count(0) {}
+	virtual ~force_solver() {}
+
+	virtual const char *name() const = 0;
+	/**
+	 * @brief Take the source bodies for the following accel() calls, src has
+	 * to stay valid until the next prepare()
+	 */
+	virtual void prepare(const particle_soa &src, float G) = 0;
+	/**
+	 * @brief Acceleration at the count points in q, point i skips the source
+	 * body ids[i]
+	 */
+	virtual void accel(const vec3_soa &q, const uint32_t *ids, uint32_t count,
+		vec3_soa &a) = 0;
+
+	/**
+	 * @brief Body-body and body-cell interactions since the last reset
+	 */
+	uint64_t interactions() const { return pair_count; }
+	void reset_interactions() { pair_count = 0; }
+
+protected:
+	thread_pool *pool;
+	std::atomic<uint64_t> pair_count;
+};
+
+/**
+ * @brief The all-pairs sum from physics.comp using the SIMD pair kernels
+ */
+class direct_solver : public force_solver
+{
+public:
+	direct_solver(thread_pool *pool, simd_level level);
+
+	const char *name() const { return simd_name(level); }
+	void prepare(const particle_soa &src, float G);
+	void accel(const vec3_soa &q, const uint32_t *ids, uint32_t count,
+		vec3_soa &a);
+
+protected:
+	simd_level level;
+	pair_kernel kernel;
+	const particle_soa *src;
+	float G;
+};
+
+/**
+ * @brief All-pairs sum that evaluates each pair once and applies it to both
+ * bodies
+ *
+ * This only works when the query points are the source bodies themselves,
+ * which is every leapfrog force pass and the first RK4 stage, any other
+ * accel() goes to the one sided kernel. Like cpu_physics it expects query
+ * point i to skip body i. The bodies are split into tiles and each thread
+ * takes a fixed share of the tile pairs I <= J and sums into its own copy of
+ * the accelerations, which are added up at the end, so no two threads ever
+ * write the same value.
+ */
+class symmetric_solver : public direct_solver
+{
+public:
+	symmetric_solver(thread_pool *pool, simd_level level);
+
+	const char *name() const { return label.c_str(); }
+	void prepare(const particle_soa &src, float G);
+	void accel(const vec3_soa &q, const uint32_t *ids, uint32_t count,
+		vec3_soa &a);
+
+	/**
+	 * @brief Bodies per tile, a multiple of the widest SIMD register
+	 */
+	static const uint32_t tile = 128;
+
+private:
+	std::string label;
+	sym_tile_kernel tile_kernel;
+
+	// src rounded up to whole tiles with massless bodies far away
+	particle_soa padded;
+	// one set of accelerations per thread
+	std::vector<vec3_soa> partial;
+	std::vector<std::pair<uint32_t, uint32_t>> tile_pairs;
+};
+
+#endif
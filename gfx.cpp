@@ -1,86 +1,78 @@
 #include "gfx.hpp"
 
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 
 #include <GL/glu.h>
 
+#include "initial_conditions.hpp"
+#include "cpu_physics.hpp"
+#include "thread_pool.hpp"
+#include "gpu_timer.hpp"
+#include "shader_cache.hpp"
+#include "shader_watcher.hpp"
+#include "snapshot_ring.hpp"
+#include "scheduler.hpp"
 #include "fox/counter.hpp"
 #include "fox/gfx/eigen_opengl.hpp"
 
-#ifdef _WIN32
-std::string data_root = "C:/dev/gl_compute_shader1";
-#else // Linux
-std::string data_root = "/home/foxfire/dev/gl_compute_shader1";
-#endif
-
 #define print_opengl_error() print_opengl_error2((char *)__FILE__, __LINE__)
 int print_opengl_error2(char *file, int line);
 
+bool parse_render(const std::string &name, render_type &type)
+{
+	if(name == "points")
+		type = render_type::points;
+	else if(name == "density")
+		type = render_type::density;
+	else
+		return false;
+	return true;
+}
+
+bool parse_barrier(const std::string &name, barrier_type &type)
+{
+	if(name == "full")
+		type = barrier_type::full;
+	else if(name == "targeted")
+		type = barrier_type::targeted;
+	else
+		return false;
+	return true;
+}
+
 gfx::gfx()
 {
 	this->generator = std::mt19937_64(std::random_device{}());
 }
 
-void gfx::init()
+void gfx::init(const gfx_config &config)
 {
 	done = 0;
-	int ret;
-	std::string window_title = "OpenGL Compute Shader 1";
-	win_w = 768;
-	win_h = 768;
-	
-	ret = SDL_Init(SDL_INIT_VIDEO);
-	if(ret < 0)
-	{
-		printf("Unable to init SDL: %s\n", SDL_GetError());
-		exit(1);
-	}
-	
-	window = SDL_CreateWindow(
-		window_title.c_str(),
-		SDL_WINDOWPOS_UNDEFINED,
-		SDL_WINDOWPOS_UNDEFINED,
-		win_w,
-		win_h,
-		SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE
-		);
-	
-	if(!window)
-	{
-		printf("Couldn't create window: %s\n", SDL_GetError());
-		SDL_Quit();
-		exit(-1);
-	}
-	
-	SDL_ShowWindow(window);
-	
-	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
-	SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
-	SDL_GL_SetAttribute(SDL_GL_RETAINED_BACKING, 1);
-	
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 6);
-	
-	//SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
-	//					SDL_GL_CONTEXT_PROFILE_CORE);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
-		SDL_GL_CONTEXT_PROFILE_COMPATIBILITY);
-
-	context = SDL_GL_CreateContext(window);
-	
-	ret = SDL_GL_MakeCurrent(window, context);
-	if(ret)
-	{
-		printf("ERROR could not make GL context current after init!\n");
-		if(window)
-			SDL_DestroyWindow(window);
-		
-		SDL_Quit();
-		exit(1);
-	}
-	
-	// 0 = no vsync
-	SDL_GL_SetSwapInterval(0);
+	headless = config.headless;
+	work_group_size = config.work_group_size;
+	integrator = config.integrator;
+	leapfrog_primed = false;
+	render_mode = config.render;
+	exposure = config.exposure;
+	// headless only draws for dump_image() so there is nothing to cull, and
+	// the density splat skips what is off screen itself
+	cull = config.cull && !headless && render_mode == render_type::points;
+	lod_distance = config.lod_distance;
+	barrier_mode = config.barrier;
+	// nothing has been computed yet, so nothing needs a barrier
+	synced = GL_ALL_BARRIER_BITS;
+	step_fences.assign(std::max(config.steps_in_flight, 1u), (GLsync)0);
+	fence_index = 0;
+	step_count = 0;
+	sim_time = 0.0;
+	snapshot_every = config.snapshot_every;
+
+	if(headless)
+		init_egl();
+	else
+		init_sdl();
 	
 	std::cout << "Running on platform: " << SDL_GetPlatform() << std::endl;
 	std::cout << "Number of logical CPU cores: " << SDL_GetCPUCount() << std::endl;
@@ -92,7 +84,11 @@ void gfx::init()
 	// OpenGL init
 	// init glew first
 	glewExperimental = GL_TRUE; // Needed in core profile
-	if(glewInit() != GLEW_OK)
+	GLenum glew_ret = glewInit();
+	// GLEW built for GLX still loads the entry points under EGL but complains
+	// that there is no X display
+	if(glew_ret != GLEW_OK &&
+		!(headless && glew_ret == GLEW_ERROR_NO_GLX_DISPLAY))
 	{
 		printf("Failed to initialize GLEW\n");
 		exit(-1);
@@ -113,21 +109,24 @@ void gfx::init()
 
 	print_opengl_error();
 
-	// init basic OpenGL stuff
-	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	// init basic OpenGL stuff, headless never draws and has a core profile
+	if(!headless)
+	{
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-	// TODO: may want depth test off and blending off
-	glDisable(GL_DEPTH_TEST);
-	glEnable(GL_BLEND); // alpha channel
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		// TODO: may want depth test off and blending off
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND); // alpha channel
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	glEnable(GL_POLYGON_SMOOTH);
-	glHint(GL_POLYGON_SMOOTH_HINT, GL_NICEST);
-	// need compatability profile for these
-	glEnable(GL_POINT_SMOOTH);
-	glHint(GL_POINT_SMOOTH_HINT, GL_NICEST);
+		glEnable(GL_POLYGON_SMOOTH);
+		glHint(GL_POLYGON_SMOOTH_HINT, GL_NICEST);
+		// need compatability profile for these
+		glEnable(GL_POINT_SMOOTH);
+		glHint(GL_POINT_SMOOTH_HINT, GL_NICEST);
 
-	glPointSize(3.0f);
+		glPointSize(3.0f);
+	}
 
 	// OpenGL 3.2 core requires a VAO to be bound to use a VBO
 	// WARNING: GLES 2.0 does not support VAOs
@@ -145,83 +144,129 @@ void gfx::init()
 
 	print_opengl_error();
 
-	obj_count = 128;
-	x[0].resize(obj_count);
-	x[1].resize(obj_count);
-	v[0].resize(obj_count);
-	v[1].resize(obj_count);
-	a[0].resize(obj_count);
-	a[1].resize(obj_count);
-	m.resize(obj_count);
+	obj_count = config.obj_count;
+	a[0].assign(obj_count, Eigen::Vector3f::Zero());
+	a[1].assign(obj_count, Eigen::Vector3f::Zero());
 
 	current = 0;
 	next = 1;
 
-	float mass_range[2];
-	float distance_range[2] = {-1.0f, 1.0f};
-
-	// random init stuff
-	std::uniform_real_distribution<float> dist_m(mass_range[0],
-		mass_range[1]);
-	std::uniform_real_distribution<float> dist_d(distance_range[0],
-		distance_range[1]);
-
-	for(uint16_t i = 0; i < obj_count; i++)
-	{
-		m[i] = dist_m(generator);
-
-		x[0][i] = Eigen::Vector3f(dist_d(generator),
-			dist_d(generator),
-			dist_d(generator));
-
-		x[1][i] = Eigen::Vector3f(0.0, 0.0, 0.0);
-		v[0][i] = Eigen::Vector3f(0.0, 0.0, 0.0);
-		v[1][i] = Eigen::Vector3f(0.0, 0.0, 0.0);
-	}
-
-	glGenBuffers(1, &x_vbo_0);
-	glBindBuffer(GL_ARRAY_BUFFER, x_vbo_0);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * obj_count * 3,
-		x[0].data(), GL_STATIC_DRAW);
-	glGenBuffers(1, &x_vbo_1);
-	glBindBuffer(GL_ARRAY_BUFFER, x_vbo_1);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * obj_count * 3,
-		x[1].data(), GL_STATIC_DRAW);
-	glGenBuffers(1, &v_vbo_0);
-	glBindBuffer(GL_ARRAY_BUFFER, v_vbo_0);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * obj_count * 3,
-		v[0].data(), GL_STATIC_DRAW);
-	glGenBuffers(1, &v_vbo_1);
-	glBindBuffer(GL_ARRAY_BUFFER, v_vbo_1);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * obj_count * 3,
-		v[1].data(), GL_STATIC_DRAW);
-	glGenBuffers(1, &a_vbo_0);
-	glBindBuffer(GL_ARRAY_BUFFER, a_vbo_0);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * obj_count * 3,
-		a[0].data(), GL_STATIC_DRAW);
-	glGenBuffers(1, &a_vbo_1);
-	glBindBuffer(GL_ARRAY_BUFFER, a_vbo_1);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * obj_count * 3,
-		a[1].data(), GL_STATIC_DRAW);
-
-	glGenBuffers(1, &m_vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * obj_count,
-		m.data(), GL_STATIC_DRAW);
+	random_cube(generator, obj_count, x, v, m);
+
+	// the average body adds 256 to its pixel in the density renderer
+	double mass_sum = 0.0;
+	for(float mass : m)
+		mass_sum += mass;
+	mass_scale = obj_count > 0 ? (float)(256.0 * obj_count / mass_sum) : 1.0f;
+
+	// the GPU keeps every vector as a vec4 so a body is one 16 byte load,
+	// positions carry the mass in w and the other w are unused
+	std::vector<Eigen::Vector4f> staging;
+	GLuint *buffers[6] = {&x_vbo_0, &x_vbo_1, &v_vbo_0, &v_vbo_1, &a_vbo_0,
+		&a_vbo_1};
+	std::vector<Eigen::Vector3f> *sources[6] = {&x[0], &x[1], &v[0], &v[1],
+		&a[0], &a[1]};
+	// the GPU is the only writer after this, immutable storage with no flags
+	for(int i = 0; i < 6; i++)
+	{
+		pack_vec4(*sources[i], i < 2 ? &m : nullptr, staging);
+		glCreateBuffers(1, buffers[i]);
+		glNamedBufferStorage(*buffers[i], sizeof(Eigen::Vector4f) * obj_count,
+			staging.data(), 0);
+	}
+
+	block = config.block;
+	block_primed = false;
+	level_buf = active_buf = block_args_buf = 0;
+	if(integrator == integrator_type::block)
+	{
+		// levels, the active list and the indirect dispatch size and counters
+		glCreateBuffers(1, &level_buf);
+		glNamedBufferStorage(level_buf, sizeof(uint32_t) * obj_count, NULL, 0);
+		glCreateBuffers(1, &active_buf);
+		glNamedBufferStorage(active_buf, sizeof(uint32_t) * obj_count, NULL,
+			0);
+		uint32_t args[5] = {0, 1, 1, 0, 0};
+		glCreateBuffers(1, &block_args_buf);
+		glNamedBufferStorage(block_args_buf, sizeof(args), args, 0);
+		// nothing else dispatches indirectly
+		glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, block_args_buf);
+	}
+
+	cull_prog = cull_point_prog = 0;
+	visible_buf = draw_cmd_buf = 0;
+	splat_prog = density_prog = 0;
+	density_tex = 0;
+	if(cull)
+	{
+		// room for every body to be visible, the count starts each pass at 0
+		// and the rest of the command is one instance from vertex 0
+		glCreateBuffers(1, &visible_buf);
+		glNamedBufferStorage(visible_buf, sizeof(uint32_t) * obj_count, NULL,
+			0);
+		uint32_t draw_cmd[4] = {0, 1, 0, 0};
+		glCreateBuffers(1, &draw_cmd_buf);
+		glNamedBufferStorage(draw_cmd_buf, sizeof(draw_cmd), draw_cmd, 0);
+		// nothing else draws indirectly
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_cmd_buf);
+	}
+
+	build_binding_sets();
+
+	// the same block for every compute program, only delta_t and the
+	// leapfrog flags change once it is up
+	params.delta_t = config.delta_t;
+	params.point_count = obj_count;
+	params.G = (float)G;
+	params.softening2 = config.softening * config.softening;
+	params.kick = 0;
+	params.drift = 1;
+	params.max_level = block.max_level;
+	params.eta = block.eta;
+	uploaded_params = params;
+	glCreateBuffers(1, &params_buf);
+	glNamedBufferStorage(params_buf, sizeof(params), &params,
+		GL_DYNAMIC_STORAGE_BIT);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, params_buf);
 
 	print_opengl_error();
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+	GLint max_invocations;
+	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &max_invocations);
+	if(work_group_size == 0 || work_group_size > (uint32_t)max_invocations)
+	{
+		printf("ERROR work group size %u is not in 1 to %i\n", work_group_size,
+			max_invocations);
+		exit(-1);
+	}
+	// one invocation per body, the last group is partly empty
+	body_groups = (obj_count + work_group_size - 1) / work_group_size;
+
+	shaders = new shader_cache(config.shader_cache_dir, config.shader_dir);
 	load_shaders();
+	if(render_mode == render_type::density)
+		resize_density();
 
 	print_opengl_error();
 
-	glUseProgram(point_shader_id);
-	// TODO: just use an MVP matrix
-	GLint u;
 	MVP = P * (V * M);
-	u = glGetUniformLocation(point_shader_id, "MVP");
-	glUniformMatrix4fv(u, 1, GL_FALSE, MVP.data());
+	upload_uniforms();
+
+	snapshots = nullptr;
+	if(snapshot_every > 0 && config.on_snapshot)
+		snapshots = new snapshot_ring(obj_count,
+			std::max(config.snapshot_slots, 1u), config.on_snapshot);
+
+	// only the windowed loop reloads, nothing else runs long enough
+	watcher = nullptr;
+	reload_pending = false;
+	if(config.hot_reload && !headless)
+	{
+		watcher = new shader_watcher(config.shader_dir);
+		if(watcher->ok())
+			printf("Watching %s for shader changes\n",
+				config.shader_dir.c_str());
+	}
 
 	print_opengl_error();
 	fflush(stdout);
@@ -230,9 +275,206 @@ void gfx::init()
 	fps_counter = new fox::counter();
 	perf_counter = new fox::counter();
 
+	const char *section_names[mark_count - 1] = {"compute", "barrier",
+		"prepass", "draw", "swap"};
+	timer = new gpu_timer(mark_count, section_names);
+
+	sched = new scheduler(config.delta_t, config.steps_per_frame,
+		config.max_steps_per_frame, config.render_fps);
+	total_time = 0.0;
+	report_steps = 0;
+	report_frames = 0;
+
 	perf_index = 0;
 }
 
+void gfx::build_binding_sets()
+{
+	GLuint x_bufs[2] = {x_vbo_0, x_vbo_1};
+	GLuint v_bufs[2] = {v_vbo_0, v_vbo_1};
+	GLuint a_bufs[2] = {a_vbo_0, a_vbo_1};
+	for(uint32_t c = 0; c < 2; c++)
+	{
+		// the bindings of physics.comp, cull.comp and splat.comp, 0 leaves a
+		// binding empty
+		uint32_t n = 1 - c;
+		GLuint ssbo[ssbo_binding_count] = {x_bufs[c], v_bufs[c], 0, x_bufs[n],
+			v_bufs[n], a_bufs[c], a_bufs[n], level_buf, active_buf,
+			block_args_buf, visible_buf, draw_cmd_buf};
+		std::copy(ssbo, ssbo + ssbo_binding_count, sets[c].ssbo);
+
+		// xyz of the vec4 position and mass the compute shader writes
+		glCreateVertexArrays(1, &sets[c].vao);
+		glVertexArrayVertexBuffer(sets[c].vao, 0, x_bufs[c], 0,
+			sizeof(Eigen::Vector4f));
+		glEnableVertexArrayAttrib(sets[c].vao, 0);
+		glVertexArrayAttribFormat(sets[c].vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+		glVertexArrayAttribBinding(sets[c].vao, 0, 0);
+	}
+}
+
+void gfx::upload_params()
+{
+	if(memcmp(&params, &uploaded_params, sizeof(params)) == 0)
+		return;
+	glNamedBufferSubData(params_buf, 0, sizeof(params), &params);
+	uploaded_params = params;
+}
+
+void gfx::init_sdl()
+{
+	int ret;
+	std::string window_title = "OpenGL Compute Shader 1";
+	win_w = 768;
+	win_h = 768;
+	
+	ret = SDL_Init(SDL_INIT_VIDEO);
+	if(ret < 0)
+	{
+		printf("Unable to init SDL: %s\n", SDL_GetError());
+		exit(1);
+	}
+	
+	window = SDL_CreateWindow(
+		window_title.c_str(),
+		SDL_WINDOWPOS_UNDEFINED,
+		SDL_WINDOWPOS_UNDEFINED,
+		win_w,
+		win_h,
+		SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE
+		);
+	
+	if(!window)
+	{
+		printf("Couldn't create window: %s\n", SDL_GetError());
+		SDL_Quit();
+		exit(-1);
+	}
+	
+	SDL_ShowWindow(window);
+	
+	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+	SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
+	SDL_GL_SetAttribute(SDL_GL_RETAINED_BACKING, 1);
+	
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 6);
+	
+	//SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
+	//					SDL_GL_CONTEXT_PROFILE_CORE);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
+		SDL_GL_CONTEXT_PROFILE_COMPATIBILITY);
+
+	context = SDL_GL_CreateContext(window);
+	
+	ret = SDL_GL_MakeCurrent(window, context);
+	if(ret)
+	{
+		printf("ERROR could not make GL context current after init!\n");
+		if(window)
+			SDL_DestroyWindow(window);
+		
+		SDL_Quit();
+		exit(1);
+	}
+	
+	// 0 = no vsync
+	SDL_GL_SetSwapInterval(0);
+}
+
+void gfx::init_egl()
+{
+	// nothing is shown, this is only the size dump_image() draws at
+	win_w = 768;
+	win_h = 768;
+
+#ifdef HAVE_EGL
+	// prefer Mesa's surfaceless platform, it needs no X or Wayland server
+	egl_display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+			"eglGetPlatformDisplayEXT");
+	if(get_platform_display)
+		egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+			EGL_DEFAULT_DISPLAY, NULL);
+	if(egl_display == EGL_NO_DISPLAY)
+		egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if(egl_display == EGL_NO_DISPLAY ||
+		!eglInitialize(egl_display, &major, &minor))
+	{
+		printf("Unable to init EGL: 0x%x\n", eglGetError());
+		exit(1);
+	}
+	printf("EGL version %d.%d\n", major, minor);
+
+	const char *extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
+	if(!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+	{
+		printf("ERROR EGL_KHR_surfaceless_context is not supported\n");
+		eglTerminate(egl_display);
+		exit(1);
+	}
+
+	if(!eglBindAPI(EGL_OPENGL_API))
+	{
+		printf("ERROR eglBindAPI(EGL_OPENGL_API) failed: 0x%x\n",
+			eglGetError());
+		eglTerminate(egl_display);
+		exit(1);
+	}
+
+	EGLConfig egl_config = EGL_NO_CONFIG_KHR;
+	if(!strstr(extensions, "EGL_KHR_no_config_context"))
+	{
+		EGLint config_attribs[] = {
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_NONE
+		};
+		EGLint count = 0;
+		eglChooseConfig(egl_display, config_attribs, &egl_config, 1, &count);
+		if(count == 0)
+		{
+			printf("ERROR no EGL config supports OpenGL\n");
+			eglTerminate(egl_display);
+			exit(1);
+		}
+	}
+
+	// compute shaders and #version 450 need 4.5, nothing headless draws so
+	// a core profile is enough
+	EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT,
+		context_attribs);
+	if(egl_context == EGL_NO_CONTEXT)
+	{
+		printf("ERROR could not create an OpenGL 4.5 EGL context: 0x%x\n",
+			eglGetError());
+		eglTerminate(egl_display);
+		exit(1);
+	}
+
+	if(!eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		egl_context))
+	{
+		printf("ERROR could not make EGL context current: 0x%x\n",
+			eglGetError());
+		eglDestroyContext(egl_display, egl_context);
+		eglTerminate(egl_display);
+		exit(1);
+	}
+#else
+	printf("ERROR headless mode needs EGL and this build does not have it\n");
+	exit(1);
+#endif
+}
+
 void gfx::deinit()
 {
 	// TODO: should we really use swap to force a deallocation and is this the
@@ -260,19 +502,33 @@ void gfx::deinit()
 	m.clear();
 	m.swap(n7);
 
-	// TODO: can this be freed earlier?
-	if(shader_vert_id != 0)
-		glDeleteShader(shader_vert_id);
-	// TODO: can this be freed earlier?
-	if(shader_frag_id != 0)
-		glDeleteShader(shader_frag_id);
-	if(point_shader_id != 0)
-		glDeleteProgram(point_shader_id);
-	// TODO: can this be freed earlier?
-	if(comp_shader_id != 0)
-		glDeleteShader(comp_shader_id);
-	if(comp_prog != 0)
-		glDeleteProgram(comp_prog);
+	if(snapshots)
+	{
+		// the consumer gets every snapshot already taken
+		snapshots->flush();
+		printf("Snapshots: %llu taken, %llu dropped with every slot busy\n",
+			(unsigned long long)snapshots->captured(),
+			(unsigned long long)snapshots->dropped());
+		delete snapshots;
+	}
+
+	delete_programs(installed_programs());
+	if(reload_pending)
+		delete_programs(pending);
+	delete watcher;
+	if(integrator == integrator_type::block)
+	{
+		glDeleteBuffers(1, &level_buf);
+		glDeleteBuffers(1, &active_buf);
+		glDeleteBuffers(1, &block_args_buf);
+	}
+	if(cull)
+	{
+		glDeleteBuffers(1, &visible_buf);
+		glDeleteBuffers(1, &draw_cmd_buf);
+	}
+	if(render_mode == render_type::density)
+		glDeleteTextures(1, &density_tex);
 
 	glDeleteBuffers(1, &x_vbo_0);
 	glDeleteBuffers(1, &x_vbo_1);
@@ -280,13 +536,37 @@ void gfx::deinit()
 	glDeleteBuffers(1, &v_vbo_1);
 	glDeleteBuffers(1, &a_vbo_0);
 	glDeleteBuffers(1, &a_vbo_1);
-	glDeleteBuffers(1, &m_vbo);
+	glDeleteBuffers(1, &params_buf);
+	for(GLsync fence : step_fences)
+	{
+		if(fence != 0)
+			glDeleteSync(fence);
+	}
+	for(binding_set &set : sets)
+		glDeleteVertexArrays(1, &set.vao);
 
-	SDL_GL_DeleteContext(context);
-	SDL_DestroyWindow(window);
-	
-	SDL_Quit();
+	// the queries need the context
+	delete timer;
 
+	if(headless)
+	{
+#ifdef HAVE_EGL
+		eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			EGL_NO_CONTEXT);
+		eglDestroyContext(egl_display, egl_context);
+		eglTerminate(egl_display);
+#endif
+	}
+	else
+	{
+		SDL_GL_DeleteContext(context);
+		SDL_DestroyWindow(window);
+
+		SDL_Quit();
+	}
+
+	delete sched;
+	delete shaders;
 	delete update_counter;
 	delete fps_counter;
 	delete perf_counter;
@@ -308,47 +588,23 @@ void gfx::render()
 		exit(1);
 	}
 
-	float delta_t = update_counter->update();
-
-	if(comp_prog != 0)
-	{
-		glUseProgram(comp_prog);
-		GLuint u;
-		u = glGetUniformLocation(comp_prog, "delta_t");
-		glUniform1f(u, delta_t);
-		// TODO: set this once
-		u = glGetUniformLocation(comp_prog, "point_count");
-		glUniform1ui(u, obj_count);
-
-		if(current == 0)
-		{
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x_vbo_0);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, v_vbo_0);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_vbo);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, x_vbo_1);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, v_vbo_1);
-		}
-		else
-		{
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, x_vbo_1);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, v_vbo_1);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_vbo);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, x_vbo_0);
-			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, v_vbo_0);
-		}
+	if(watcher)
+		reload_shaders();
 
-		glDispatchCompute((GLuint)128, 1, 1);
+	uint32_t steps = sched->begin_pass(update_counter->update_double());
 
-		glMemoryBarrier(GL_ALL_BARRIER_BITS);
+	timer->begin_frame();
+	timer->mark(mark_start);
 
-		if(print_opengl_error())
-		{
-			fflush(stdout);
-			exit(-1);
-		}
-	}
+	// fixed size steps, each one's compute and barrier marks add to the
+	// frame's sections
+	for(uint32_t i = 0; i < steps; i++)
+		dispatch(sched->step_size());
 
 	phys_times[perf_index] = perf_counter->update_double();
+	report_steps += steps;
+	if(sched->render_due())
+		report_frames++;
 
 	perf_index++;
 	if(perf_index >= perf_array_size)
@@ -363,351 +619,773 @@ void gfx::render()
 			phys_time += phys_times[i];
 			render_time += render_times[i];
 		}
+		// these are CPU side, the GPU may still be working on the frame
 		printf("Physics time:    %.9f\n", phys_time);
 		printf("Render time:     %.9f\n", render_time);
+		printf("Steps/s:         %.3f\n", report_steps / total_time);
+		printf("Frames/s:        %.3f\n", report_frames / total_time);
+		timer->report();
 		printf("----------------------------\n");
 		//fflush(stdout);
 		total_time = 0.0;
+		report_steps = 0;
+		report_frames = 0;
 	}
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glUseProgram(point_shader_id);
-	GLint vertex_loc = glGetAttribLocation(point_shader_id, "vertex");
-	if(current == 0)
+	if(!sched->render_due())
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, x_vbo_0);
-	}
-	else
-	{
-		glBindBuffer(GL_ARRAY_BUFFER, x_vbo_1);
+		// keep the queue moving without a swap to do it
+		timer->end_frame();
+		glFlush();
+		if(print_opengl_error())
+		{
+			fflush(stdout);
+			exit(-1);
+		}
+		return;
 	}
-	glEnableVertexAttribArray(vertex_loc);
-	glVertexAttribPointer(vertex_loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
-	glDrawArrays(GL_POINTS, 0, obj_count);
-
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	draw_frame();
 
 	SDL_GL_SwapWindow(window);
+	timer->mark(mark_swap);
+	timer->end_frame();
 
 	if(print_opengl_error())
 	{
 		fflush(stdout);
 		exit(-1);
 	}
+}
 
-	if(current == 0)
+void gfx::draw_frame()
+{
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// the cull and splat passes read the positions as storage, the plain
+	// point draw fetches them as a vertex attribute
+	sync_compute(render_mode == render_type::density || cull ?
+		GL_SHADER_STORAGE_BARRIER_BIT : GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	// the last step left the set of the state before it bound
+	glBindBuffersBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo_binding_count,
+		sets[current].ssbo);
+	if(render_mode == render_type::density)
 	{
-		current = 1;
-		next = 0;
+		splat_density();
+		timer->mark(mark_prepass);
+
+		glUseProgram(density_prog);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		timer->mark(mark_draw);
+	}
+	else if(cull)
+	{
+		cull_bodies();
+		timer->mark(mark_prepass);
+
+		// the vertex count never leaves the GPU
+		glUseProgram(cull_point_prog);
+		glDrawArraysIndirect(GL_POINTS, 0);
+		timer->mark(mark_draw);
 	}
 	else
 	{
-		current = 0;
-		next = 1;
+		// an empty pre-pass section so the draw is still timed
+		timer->mark(mark_prepass);
+
+		glUseProgram(point_shader_id);
+		glBindVertexArray(sets[current].vao);
+		glDrawArrays(GL_POINTS, 0, obj_count);
+		timer->mark(mark_draw);
 	}
 }
 
-void gfx::resize(int w, int h)
+void gfx::cull_bodies()
 {
-	win_w = w;
-	win_h = h;
-	
-	glViewport(0, 0, win_w, win_h);
-	fox::gfx::perspective(65.0f, (float)win_w / (float)win_h, 0.01f, 40.0f, P);
-	MVP = P * (V * M);
-	if(point_shader_id != 0)
-	{
-		GLuint u;
-		glUseProgram(point_shader_id);
-		u = glGetUniformLocation(point_shader_id, "MVP");
-		glUniformMatrix4fv(u, 1, GL_FALSE, MVP.data());
-	}
+	// zero only the count, the GPU reads the command while the CPU never
+	// touches it again
+	uint32_t zero = 0;
+	glClearNamedBufferSubData(draw_cmd_buf, GL_R32UI, 0, sizeof(uint32_t),
+		GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+	glUseProgram(cull_prog);
+	glDispatchCompute(body_groups, 1, 1);
+
+	// the draw reads the list in the vertex shader and the count as its
+	// command, and the next frame clears the count with a buffer update
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT |
+		GL_BUFFER_UPDATE_BARRIER_BIT);
 }
 
-void gfx::load_shaders()
+void gfx::splat_density()
 {
-	print_opengl_error();
+	uint32_t zero = 0;
+	glClearTexImage(density_tex, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
 
-	std::string fname = data_root + "/point_render_v330.vert";
-	FILE *f;
-	uint8_t *vert_data, *frag_data, *phys_data;
-	long fsize, vsize, phsize;
-	long ret, result;
-	f = fopen(fname.c_str(), "rt");
-	if(f == NULL)
+	glUseProgram(splat_prog);
+	glDispatchCompute(body_groups, 1, 1);
+
+	// the tone map reads the sums with texelFetch and the next frame clears
+	// them with glClearTexImage
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+		GL_TEXTURE_UPDATE_BARRIER_BIT);
+}
+
+void gfx::resize_density()
+{
+	// immutable storage can not change size, make a new texture
+	if(density_tex != 0)
+		glDeleteTextures(1, &density_tex);
+	glCreateTextures(GL_TEXTURE_2D, 1, &density_tex);
+	glTextureStorage2D(density_tex, 1, GL_R32UI, std::max(win_w, 1),
+		std::max(win_h, 1));
+	glTextureParameteri(density_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(density_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// splat.comp writes image unit 0 and the tone map reads texture unit 0,
+	// nothing else uses either
+	glBindImageTexture(0, density_tex, 0, GL_FALSE, 0, GL_READ_WRITE,
+		GL_R32UI);
+	glBindTextureUnit(0, density_tex);
+}
+
+int gfx::dump_image(const std::string &fname)
+{
+	// the window may have no back buffer to read, headless has none at all
+	GLuint color_tex, fbo;
+	glCreateTextures(GL_TEXTURE_2D, 1, &color_tex);
+	glTextureStorage2D(color_tex, 1, GL_RGBA8, win_w, win_h);
+	glCreateFramebuffers(1, &fbo);
+	glNamedFramebufferTexture(fbo, GL_COLOR_ATTACHMENT0, color_tex, 0);
+	if(glCheckNamedFramebufferStatus(fbo, GL_FRAMEBUFFER) !=
+		GL_FRAMEBUFFER_COMPLETE)
 	{
-		printf("ERROR couldn't open shader file %s\n", fname.c_str());
+		printf("ERROR offscreen framebuffer is not complete\n");
 		exit(-1);
 	}
-	// find the file size
-	fseek(f, 0, SEEK_END);
-	vsize = ftell(f);
-	rewind(f);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+	glViewport(0, 0, win_w, win_h);
+	draw_frame();
+
+	std::vector<uint8_t> pixels((size_t)win_w * win_h * 3);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, win_w, win_h, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
 
-	vert_data = (uint8_t *)malloc(sizeof(uint8_t) * vsize);
-	if(vert_data == nullptr)
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &color_tex);
+	print_opengl_error();
+
+	FILE *f = fopen(fname.c_str(), "wb");
+	if(f == NULL)
 	{
-		printf("Failed to allocate vertex shader memory\n");
-		exit(-1);
+		printf("ERROR couldn't open %s for writing\n", fname.c_str());
+		return 1;
 	}
-	result = fread(vert_data, sizeof(uint8_t), vsize, f);
-	if(result != vsize)
+	fprintf(f, "P6\n%d %d\n255\n", win_w, win_h);
+	// GL rows start at the bottom, PPM rows at the top
+	bool ok = true;
+	for(int y = win_h - 1; y >= 0 && ok; y--)
+		ok = fwrite(&pixels[(size_t)y * win_w * 3], 3, win_w, f) ==
+			(size_t)win_w;
+	ok = fclose(f) == 0 && ok;
+	if(!ok)
 	{
-		printf("ERROR: loading shader: %s\n", fname.c_str());
-		printf("Expected %d bytes but only read %d\n", vsize, result);
-
-		fclose(f);
-		free(vert_data);
-		exit(-1);
+		printf("ERROR writing %s\n", fname.c_str());
+		return 1;
 	}
-	// TODO: is this really a good idea?
-	vert_data[vsize - 1] = '\0';
-	fclose(f);
+	printf("Wrote %dx%d %s image to %s\n", win_w, win_h,
+		render_mode == render_type::density ? "density" : "points",
+		fname.c_str());
 
-	fname = data_root + "/point_render_v330.frag";
-	f = fopen(fname.c_str(), "rt");
-	if(f == NULL)
+	return 0;
+}
+
+void gfx::dispatch(float delta_t, bool drift)
+{
+	// the step before wrote what this one reads
+	sync_compute(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	if(integrator == integrator_type::block)
+		dispatch_block(delta_t);
+	else if(comp_prog != 0)
 	{
-		printf("ERROR couldn't open shader file %s\n", fname.c_str());
-		exit(-1);
+		params.delta_t = delta_t;
+		if(integrator == integrator_type::leapfrog)
+		{
+			params.kick = leapfrog_primed ? 1 : 0;
+			params.drift = drift ? 1 : 0;
+			// the acceleration in next is only the last step's if it drifted
+			leapfrog_primed = drift;
+		}
+		upload_params();
+
+		glUseProgram(comp_prog);
+		glBindBuffersBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo_binding_count,
+			sets[current].ssbo);
+
+		// one invocation per body, the last group is partly empty
+		glDispatchCompute(body_groups, 1, 1);
+		timer->mark(mark_compute);
+
+		// block updates current in place, the others write next
+		if(current == 0)
+		{
+			current = 1;
+			next = 0;
+		}
+		else
+		{
+			current = 0;
+			next = 1;
+		}
 	}
-	// find the file size
-	fseek(f, 0, SEEK_END);
-	fsize = ftell(f);
-	rewind(f);
 
-	frag_data = (uint8_t *)malloc(sizeof(uint8_t) * fsize);
-	if(frag_data == nullptr)
+	// targeted leaves the barrier to whatever reads the step next, so the
+	// section only has time in it in full mode
+	if(barrier_mode == barrier_type::full)
+		glMemoryBarrier(GL_ALL_BARRIER_BITS);
+	synced = barrier_mode == barrier_type::full ? GL_ALL_BARRIER_BITS : 0;
+	timer->mark(mark_barrier);
+
+	if(drift)
 	{
-		printf("Failed to allocate frag shader memory\n");
-		exit(-1);
+		step_count++;
+		sim_time += delta_t;
 	}
-	result = fread(frag_data, sizeof(uint8_t), fsize, f);
-	if(result != fsize)
+	if(snapshots)
 	{
-		printf("ERROR: loading shader: %s\n", fname.c_str());
-		printf("Expected %d bytes but only read %d\n", fsize, result);
+		snapshots->poll();
+		if(drift && step_count % snapshot_every == 0)
+		{
+			// the copies read what the step wrote
+			sync_compute(GL_BUFFER_UPDATE_BARRIER_BIT);
+			snapshots->capture(sets[current].ssbo[0], sets[current].ssbo[1],
+				step_count, sim_time);
+		}
+	}
 
-		fclose(f);
-		free(frag_data);
+	fence_step();
+
+	if(print_opengl_error())
+	{
+		fflush(stdout);
 		exit(-1);
 	}
-	// TODO: is this really a good idea?
-	frag_data[fsize - 1] = '\0';
-	fclose(f);
+}
 
-	fname = data_root + "/physics.comp";
-	f = fopen(fname.c_str(), "rt");
-	if(f == NULL)
+void gfx::dispatch_block(float delta_t)
+{
+	// in place on current, every body finishes its step on the last substep
+	// so nothing needs swapping
+	params.delta_t = delta_t;
+	upload_params();
+	glBindBuffersBase(GL_SHADER_STORAGE_BUFFER, 0, ssbo_binding_count,
+		sets[current].ssbo);
+
+	// the first step needs every acceleration for the opening kicks
+	if(!block_primed)
 	{
-		printf("ERROR couldn't open shader file %s\n", fname.c_str());
-		exit(-1);
+		glUseProgram(block_force_prog);
+		glProgramUniform1ui(block_force_prog, block_prime_loc, 1);
+		glDispatchCompute(body_groups, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		glProgramUniform1ui(block_force_prog, block_prime_loc, 0);
+		block_primed = true;
 	}
-	// find the file size
-	fseek(f, 0, SEEK_END);
-	phsize = ftell(f);
-	rewind(f);
 
-	phys_data = (uint8_t *)malloc(sizeof(uint8_t) * phsize);
-	if(phys_data == nullptr)
+	GLuint progs[3] = {block_drift_prog, block_select_prog, block_force_prog};
+	uint32_t substeps = 1u << block.max_level;
+	for(uint32_t s = 0; s < substeps; s++)
 	{
-		printf("Failed to allocate comp shader memory\n");
-		exit(-1);
+		for(int i = 0; i < 3; i++)
+			glProgramUniform1ui(progs[i], block_substep_loc[i], s);
+
+		glUseProgram(block_drift_prog);
+		glDispatchCompute(body_groups, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		glUseProgram(block_select_prog);
+		glDispatchCompute(body_groups, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+			GL_COMMAND_BARRIER_BIT);
+
+		glUseProgram(block_force_prog);
+		glDispatchComputeIndirect(0);
+		// the last force pass is left to dispatch() like any other step
+		if(s + 1 < substeps)
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	}
-	result = fread(phys_data, sizeof(uint8_t), phsize, f);
-	if(result != phsize)
+	timer->mark(mark_compute);
+}
+
+void gfx::sync_compute(GLbitfield bits)
+{
+	GLbitfield missing = bits & ~synced;
+	if(missing == 0)
+		return;
+	glMemoryBarrier(missing);
+	synced |= missing;
+}
+
+void gfx::fence_step()
+{
+	// the fence in this slot was waited for when it was the oldest
+	GLsync &slot = step_fences[fence_index];
+	if(slot != 0)
+		glDeleteSync(slot);
+	slot = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	fence_index = (fence_index + 1) % step_fences.size();
+
+	// the oldest step still queued, this one again with one step in flight
+	GLsync &oldest = step_fences[fence_index];
+	if(oldest == 0)
+		return;
+	GLenum result;
+	do
 	{
-		printf("ERROR: loading shader: %s\n", fname.c_str());
-		printf("Expected %d bytes but only read %d\n", phsize, result);
+		// flush so the fence gets to the GPU and the wait can end
+		result = glClientWaitSync(oldest, GL_SYNC_FLUSH_COMMANDS_BIT,
+			1000000000);
+	} while(result == GL_TIMEOUT_EXPIRED);
+	if(result == GL_WAIT_FAILED)
+		print_opengl_error();
+	glDeleteSync(oldest);
+	oldest = 0;
+}
 
-		fclose(f);
-		free(phys_data);
-		exit(-1);
-	}
-	// TODO: is this really a good idea?
-	phys_data[phsize - 1] = '\0';
-	fclose(f);
+void gfx::sync_velocities(float delta_t)
+{
+	if(integrator == integrator_type::leapfrog && leapfrog_primed)
+		dispatch(delta_t, false);
+}
 
-	// actually create the shader
-		shader_vert_id = glCreateShader(GL_VERTEX_SHADER);
-	if(shader_vert_id == 0)
+double gfx::interactions_per_step() const
+{
+	if(integrator == integrator_type::block)
 	{
-		printf("Failed to create GL_VERTEX_SHADER!\n");
-		exit(-1);
+		// total_active from the last step, this waits for it
+		uint32_t total_active = 0;
+		// read straight after a step, dispatch() left no barrier for it in
+		// targeted mode
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glGetNamedBufferSubData(block_args_buf, 4 * sizeof(uint32_t),
+			sizeof(uint32_t), &total_active);
+		return (double)total_active * (obj_count - 1.0);
 	}
-	glShaderSource(shader_vert_id, 1, (GLchar **)&vert_data, NULL);
-	glCompileShader(shader_vert_id);
-	free(vert_data);
+	return (double)force_passes(integrator) * obj_count * (obj_count - 1.0);
+}
 
-	// print shader info log
-	int length = 0, chars_written = 0;
-	char *info_log;
-	glGetShaderiv(shader_vert_id, GL_INFO_LOG_LENGTH, &length);
-	// WTF? so why was 4 used?
-	// use 2 for the length because NVidia cards return a line feed always
-	if(length > 4)
-	{
-		info_log = (char *)malloc(sizeof(char) * length);
-		if(info_log == NULL)
-		{
-			printf("ERROR couldn't allocate %d bytes for shader info log!\n",
-				length);
-			exit(-1);
-		}
+void gfx::step(float delta_t)
+{
+	// dispatch() waits on the fences
+	dispatch(delta_t);
+}
 
-		glGetShaderInfoLog(shader_vert_id, length, &chars_written, info_log);
+void gfx::set_print_gpu_frames(bool print)
+{
+	timer->set_print_frames(print);
+}
 
-		printf("Shader info log: %s\n", info_log);
+void gfx::read_buffer(GLuint buffer, std::vector<Eigen::Vector3f> &out)
+{
+	sync_compute(GL_BUFFER_UPDATE_BARRIER_BIT);
+	std::vector<Eigen::Vector4f> staging(obj_count);
+	glGetNamedBufferSubData(buffer, 0, sizeof(Eigen::Vector4f) * obj_count,
+		staging.data());
+
+	out.resize(obj_count);
+	for(uint32_t i = 0; i < obj_count; i++)
+		out[i] = staging[i].head<3>();
+}
 
-		free(info_log);
-	}
+void gfx::pack_vec4(const std::vector<Eigen::Vector3f> &xyz,
+	const std::vector<float> *w, std::vector<Eigen::Vector4f> &out)
+{
+	out.resize(xyz.size());
+	for(size_t i = 0; i < xyz.size(); i++)
+		out[i] << xyz[i], w ? (*w)[i] : 0.0f;
+}
 
-	// actually create the shader
-	shader_frag_id = glCreateShader(GL_FRAGMENT_SHADER);
-	if(shader_frag_id == 0)
+int gfx::verify(uint32_t steps, float delta_t)
+{
+	// x[0], v[0] and m still hold what init() uploaded
+	thread_pool pool;
+	cpu_physics reference(&pool);
+	reference.set_integrator(integrator);
+	reference.set_block_params(block);
+	reference.init(x[0], v[0], m);
+
+	printf("Verifying %u %s steps of %u bodies against the CPU\n", steps,
+		integrator_name(integrator), obj_count);
+	if(params.softening2 != 0.0f)
+		printf("The GPU is softened and the CPU is not, expect them to "
+			"differ\n");
+
+	for(uint32_t i = 0; i < steps; i++)
 	{
-		printf("Failed to create GL_VERTEX_SHADER!\n");
-		exit(-1);
+		dispatch(delta_t);
+		reference.step(delta_t);
 	}
-	glShaderSource(shader_frag_id, 1, (GLchar **)&frag_data, NULL);
-	glCompileShader(shader_frag_id);
-	free(frag_data);
+	sync_velocities(delta_t);
+
+	std::vector<Eigen::Vector3f> gpu_x, gpu_v, cpu_x, cpu_v;
+	read_buffer(current == 0 ? x_vbo_0 : x_vbo_1, gpu_x);
+	read_buffer(current == 0 ? v_vbo_0 : v_vbo_1, gpu_v);
+	reference.state_by_id(cpu_x, cpu_v);
 
-	// print shader info log
-	length = 0;
-	chars_written = 0;
-	glGetShaderiv(shader_frag_id, GL_INFO_LOG_LENGTH, &length);
-	// WTF? so why was 4 used?
-	// use 2 for the length because NVidia cards return a line feed always
-	if(length > 4)
+	// errors relative to the largest velocity and displacement so bodies
+	// that barely moved do not dominate
+	float max_v = 0.0f, max_dx = 0.0f, err_v = 0.0f, err_x = 0.0f;
+	for(uint32_t i = 0; i < obj_count; i++)
 	{
-		info_log = (char *)malloc(sizeof(char) * length);
-		if(info_log == NULL)
-		{
-			printf("ERROR couldn't allocate %d bytes for shader info log!\n",
-				length);
-			exit(-1);
-		}
+		max_v = std::max(max_v, cpu_v[i].norm());
+		max_dx = std::max(max_dx, (cpu_x[i] - x[0][i]).norm());
+		err_v = std::max(err_v, (gpu_v[i] - cpu_v[i]).norm());
+		err_x = std::max(err_x, (gpu_x[i] - cpu_x[i]).norm());
+	}
+	err_v /= max_v;
+	err_x /= max_dx;
 
-		glGetShaderInfoLog(shader_frag_id, length, &chars_written, info_log);
+	const float tolerance = 1.0e-3f;
+	bool pass = err_v < tolerance && err_x < tolerance;
+	printf("Max velocity error:     %.3e\n", err_v);
+	printf("Max displacement error: %.3e\n", err_x);
+	printf("%s\n", pass ? "PASS" : "FAIL");
 
-		printf("Shader info log: %s\n", info_log);
+	return pass ? 0 : 1;
+}
 
-		free(info_log);
-	}
+int gfx::run_headless(uint32_t steps, float delta_t)
+{
+	printf("Headless: %u bodies, %u %s steps\n", obj_count, steps,
+		integrator_name(integrator));
 
-	// create the shader program
-	point_shader_id = glCreateProgram();
-	if(point_shader_id == 0)
+	fox::counter run_counter;
+	fox::counter rate_counter;
+	double total_time = 0.0;
+	double run_time = 0.0;
+	uint32_t frames = 0;
+
+	for(uint32_t i = 0; i < steps; i++)
 	{
-		printf("Failed at glCreateProgram()!\n");
-		exit(-1);
+		timer->begin_frame();
+		timer->mark(mark_start);
+		dispatch(delta_t);
+		timer->end_frame();
+		frames++;
+
+		total_time += rate_counter.update_double();
+		if(total_time >= 1.0)
+		{
+			// the queue may be far ahead of what has finished, wait for it so
+			// the rate is for work the GPU actually did
+			glFinish();
+			total_time += rate_counter.update_double();
+			printf("Steps/s:         %.3f\n", frames / total_time);
+			timer->report();
+			printf("----------------------------\n");
+			total_time = 0.0;
+			frames = 0;
+		}
 	}
+	glFinish();
+	run_time = run_counter.update_double();
 
-	glAttachShader(point_shader_id, shader_vert_id);
-	glAttachShader(point_shader_id, shader_frag_id);
+	printf("%u steps in %.3f s (%.3f steps/s, %.4g interactions/s)\n", steps,
+		run_time, steps / run_time,
+		interactions_per_step() * steps / run_time);
 
-	glLinkProgram(point_shader_id);
+	return 0;
+}
 
-	glGetProgramiv(point_shader_id, GL_INFO_LOG_LENGTH, &length);
+void gfx::resize(int w, int h)
+{
+	win_w = w;
+	win_h = h;
+	
+	glViewport(0, 0, win_w, win_h);
+	fox::gfx::perspective(65.0f, (float)win_w / (float)win_h, 0.01f, 40.0f, P);
+	MVP = P * (V * M);
+	upload_uniforms();
+	if(render_mode == render_type::density)
+		resize_density();
+}
 
-	// use 2 for the length because NVidia cards return a line feed always
-	if(length > 4)
+void gfx::upload_uniforms()
+{
+	// only the view and the window change these, none of them are set per
+	// frame
+	GLuint progs[4] = {point_shader_id, cull_prog, cull_point_prog,
+		splat_prog};
+	for(GLuint prog : progs)
 	{
-		info_log = (char *)malloc(sizeof(char) * length);
-		if(info_log == NULL)
-		{
-			printf("ERROR couldn't allocate %d bytes for shader program info log!\n",
-				length);
-			exit(-1);
-		}
-		else
-		{
-			printf("Shader program info log:\n");
-		}
+		if(prog != 0)
+			glProgramUniformMatrix4fv(prog,
+				glGetUniformLocation(prog, "MVP"), 1, GL_FALSE, MVP.data());
+	}
 
-		glGetProgramInfoLog(point_shader_id, length, &chars_written, info_log);
+	if(cull_prog != 0)
+	{
+		glProgramUniform3fv(cull_prog, glGetUniformLocation(cull_prog, "eye"),
+			1, eye.data());
+		glProgramUniform1f(cull_prog,
+			glGetUniformLocation(cull_prog, "lod_distance"), lod_distance);
+		// half a point past the edge of the smaller side of the window, in NDC
+		float point_size = 3.0f;
+		glProgramUniform1f(cull_prog, glGetUniformLocation(cull_prog, "margin"),
+			point_size / (float)std::max(std::min(win_w, win_h), 1));
+	}
 
-		printf("%s\n", info_log);
+	if(splat_prog != 0)
+		glProgramUniform1f(splat_prog,
+			glGetUniformLocation(splat_prog, "mass_scale"), mass_scale);
 
-		free(info_log);
+	if(density_prog != 0)
+	{
+		glProgramUniform1i(density_prog,
+			glGetUniformLocation(density_prog, "density"), 0);
+		glProgramUniform1f(density_prog,
+			glGetUniformLocation(density_prog, "exposure"), exposure);
 	}
+}
 
+void gfx::load_shaders()
+{
 	print_opengl_error();
 
-	comp_shader_id = glCreateShader(GL_COMPUTE_SHADER);
-	if(comp_shader_id == 0)
+	program_set set;
+	if(!build_programs(set, false))
 	{
-		printf("Failed to create GL_COMPUTE_SHADER!\n");
+		printf("ERROR couldn't build the shader programs\n");
 		exit(-1);
 	}
-	glShaderSource(comp_shader_id, 1, (GLchar **)&phys_data, NULL);
-	glCompileShader(comp_shader_id);
-	free(phys_data);
+	install_programs(set);
+
+	printf("Shader programs: %u from the binary cache, %u compiled\n",
+		shaders->hit_count(), shaders->miss_count());
+}
 
-	// print shader info log
-	length = 0;
-	chars_written = 0;
-	glGetShaderiv(comp_shader_id, GL_INFO_LOG_LENGTH, &length);
-	// WTF? so why was 4 used?
-	// use 2 for the length because NVidia cards return a line feed always
-	if(length > 4)
+bool gfx::build_programs(program_set &set, bool async)
+{
+	set = program_set();
+
+	// read every stage first, a file that is missing half way through a save
+	// builds nothing
+	std::string params, point_vert, point_frag, phys_base;
+	std::string cull_base, cull_vert, splat_base, density_vert, density_frag;
+	bool ok = shaders->source("params.glsl", params) &&
+		shaders->source("point_render_v330.vert", point_vert) &&
+		shaders->source("point_render_v330.frag", point_frag) &&
+		shaders->source("physics.comp", phys_base);
+	if(ok && cull)
+	{
+		ok = shaders->source("cull.comp", cull_base) &&
+			shaders->source("point_render_v450.vert", cull_vert);
+	}
+	if(ok && render_mode == render_type::density)
 	{
-		info_log = (char *)malloc(sizeof(char) * length);
-		if(info_log == NULL)
+		ok = shaders->source("splat.comp", splat_base) &&
+			shaders->source("density.vert", density_vert) &&
+			shaders->source("density.frag", density_frag);
+	}
+	if(!ok)
+		return false;
+
+	bool created = true;
+	auto compute = [&](const std::string &source)
+	{
+		GLuint prog = build_compute(source, async);
+		created = created && prog != 0;
+		return prog;
+	};
+	auto render = [&](const std::string &vert, const std::string &frag)
+	{
+		GLuint prog = build_render(vert, frag, async);
+		created = created && prog != 0;
+		return prog;
+	};
+
+	// the work group size is picked at runtime, define it straight after the
+	// #version line which has to come first,
+	// along with the params block every compute program reads
+	std::string defines = "#define TILE_SIZE " +
+		std::to_string(work_group_size) + "\n" + params;
+
+	set.point = render(point_vert, point_frag);
+
+	size_t version_end = phys_base.find('\n') + 1;
+	std::string phys_source = phys_base;
+	phys_source.insert(version_end, defines +
+		(integrator == integrator_type::leapfrog ? "#define LEAPFROG\n" : ""));
+	set.physics = compute(phys_source);
+
+	// the three passes of a block substep are the same file again
+	if(integrator == integrator_type::block)
+	{
+		const char *passes[3] = {"BLOCK_DRIFT", "BLOCK_SELECT", "BLOCK_FORCE"};
+		GLuint *progs[3] = {&set.block_drift, &set.block_select,
+			&set.block_force};
+		for(int i = 0; i < 3; i++)
 		{
-			printf("ERROR couldn't allocate %d bytes for shader info log!\n",
-				length);
-			exit(-1);
+			std::string source = phys_base;
+			source.insert(version_end, defines + "#define BLOCK\n#define " +
+				passes[i] + "\n");
+			*progs[i] = compute(source);
 		}
+	}
 
-		glGetShaderInfoLog(comp_shader_id, length, &chars_written, info_log);
-
-		printf("Shader info log: %s\n", info_log);
-
-		free(info_log);
+	// the cull and splat passes use the same work group size as the physics
+	if(cull)
+	{
+		cull_base.insert(cull_base.find('\n') + 1, defines);
+		set.cull = compute(cull_base);
+		set.cull_point = render(cull_vert, point_frag);
 	}
 
-	print_opengl_error();
+	if(render_mode == render_type::density)
+	{
+		splat_base.insert(splat_base.find('\n') + 1, defines);
+		set.splat = compute(splat_base);
+		set.density = render(density_vert, density_frag);
+	}
 
-	// create the shader program
-	comp_prog = glCreateProgram();
-	if(comp_prog == 0)
+	if(!created)
 	{
-		printf("Failed at glCreateProgram()!\n");
-		exit(-1);
+		delete_programs(set);
+		set = program_set();
+		return false;
 	}
+	return true;
+}
 
-	glAttachShader(comp_prog, comp_shader_id);
+void gfx::install_programs(const program_set &set)
+{
+	point_shader_id = set.point;
+	comp_prog = set.physics;
+	block_drift_prog = set.block_drift;
+	block_select_prog = set.block_select;
+	block_force_prog = set.block_force;
+	cull_prog = set.cull;
+	cull_point_prog = set.cull_point;
+	splat_prog = set.splat;
+	density_prog = set.density;
+
+	// the block passes set these every substep, look them up once
+	GLuint block_progs[3] = {block_drift_prog, block_select_prog,
+		block_force_prog};
+	for(int i = 0; i < 3; i++)
+		block_substep_loc[i] = block_progs[i] != 0 ?
+			glGetUniformLocation(block_progs[i], "substep") : -1;
+	block_prime_loc = block_force_prog != 0 ?
+		glGetUniformLocation(block_force_prog, "prime") : -1;
+}
 
-	glLinkProgram(comp_prog);
+gfx::program_set gfx::installed_programs() const
+{
+	program_set set;
+	set.point = point_shader_id;
+	set.physics = comp_prog;
+	set.block_drift = block_drift_prog;
+	set.block_select = block_select_prog;
+	set.block_force = block_force_prog;
+	set.cull = cull_prog;
+	set.cull_point = cull_point_prog;
+	set.splat = splat_prog;
+	set.density = density_prog;
+	return set;
+}
 
-	glGetProgramiv(comp_prog, GL_INFO_LOG_LENGTH, &length);
+void gfx::delete_programs(const program_set &set)
+{
+	for(GLuint prog : set.all())
+	{
+		if(prog != 0)
+			glDeleteProgram(prog);
+	}
+}
 
-	// use 2 for the length because NVidia cards return a line feed always
-	if(length > 4)
+void gfx::reload_shaders()
+{
+	// only the GLSL, not editor swap files or anything else in the directory
+	std::vector<std::string> names;
+	for(const std::string &name : watcher->changed())
 	{
-		info_log = (char *)malloc(sizeof(char) * length);
-		if(info_log == NULL)
-		{
-			printf("ERROR couldn't allocate %d bytes for shader program info log!\n",
-				length);
-			exit(-1);
-		}
-		else
+		size_t dot = name.rfind('.');
+		std::string ext = dot == std::string::npos ? "" : name.substr(dot);
+		if(ext == ".comp" || ext == ".vert" || ext == ".frag" ||
+			ext == ".glsl")
+			names.push_back(name);
+	}
+	if(!names.empty())
+	{
+		printf("Shader change:");
+		for(const std::string &name : names)
+			printf(" %s", name.c_str());
+		printf(", recompiling\n");
+
+		// a save while the last one is still compiling starts over
+		if(reload_pending)
+			delete_programs(pending);
+		reload_pending = build_programs(pending, true);
+		if(!reload_pending)
 		{
-			printf("Shader program info log:\n");
+			// the next change, the file landing say, tries again
+			printf("Shader reload failed, still running the old programs\n");
+			print_opengl_error();
+			return;
 		}
+	}
 
-		glGetProgramInfoLog(comp_prog, length, &chars_written, info_log);
-
-		printf("%s\n", info_log);
+	if(!reload_pending)
+		return;
+	for(GLuint prog : pending.all())
+	{
+		if(prog != 0 && !shaders->ready(prog))
+			return;
+	}
+	reload_pending = false;
 
-		free(info_log);
+	bool ok = true;
+	for(GLuint prog : pending.all())
+	{
+		if(prog != 0)
+			ok = shaders->finish(prog) && ok;
+	}
+	if(!ok)
+	{
+		printf("Shader reload failed, still running the old programs\n");
+		delete_programs(pending);
+		print_opengl_error();
+		return;
 	}
 
+	// every program or none, the buffers and the state in them stay put
+	program_set old = installed_programs();
+	install_programs(pending);
+	delete_programs(old);
+	upload_uniforms();
+	printf("Shaders reloaded\n");
+	print_opengl_error();
+}
+
+GLuint gfx::build_compute(const std::string &source, bool async)
+{
+	std::vector<std::pair<GLenum, std::string>> stages = {
+		{GL_COMPUTE_SHADER, source}};
+	GLuint prog = async ? shaders->start(stages) : shaders->program(stages);
+	print_opengl_error();
+	return prog;
+}
+
+GLuint gfx::build_render(const std::string &vert, const std::string &frag,
+	bool async)
+{
+	std::vector<std::pair<GLenum, std::string>> stages = {
+		{GL_VERTEX_SHADER, vert}, {GL_FRAGMENT_SHADER, frag}};
+	GLuint prog = async ? shaders->start(stages) : shaders->program(stages);
 	print_opengl_error();
+	return prog;
 }
 
 int gfx::main_loop()
@@ -3,16 +3,165 @@
 
 #define _USE_MATH_DEFINES
 #include <vector>
+#include <string>
 #include <random>
+#include <functional>
 #include <SDL2/SDL.h>
 #include <GL/glew.h>
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
+#include "integrator.hpp"
+
 namespace fox
 {
 	class counter;
 }
+class gpu_timer;
+class scheduler;
+class shader_cache;
+class shader_watcher;
+class snapshot_ring;
+struct snapshot;
+
+/**
+ * @brief How the window draws the bodies
+ */
+enum class render_type
+{
+	/**
+	 * @brief One 3 pixel point per body
+	 */
+	points,
+	/**
+	 * @brief Mass summed per pixel by a compute pass, then tone mapped
+	 */
+	density
+};
+
+/**
+ * @brief Parse "points" or "density", returns false if the name is unknown
+ */
+bool parse_render(const std::string &name, render_type &type);
+
+/**
+ * @brief How the output of a compute pass is made visible to what reads it
+ */
+enum class barrier_type
+{
+	/**
+	 * @brief glMemoryBarrier(GL_ALL_BARRIER_BITS) straight after every step
+	 */
+	full,
+	/**
+	 * @brief Only the bits the next reader needs, issued just before it
+	 */
+	targeted
+};
+
+/**
+ * @brief Parse "full" or "targeted", returns false if the name is unknown
+ */
+bool parse_barrier(const std::string &name, barrier_type &type);
+
+/**
+ * @brief Everything gfx::init() needs to know up front
+ */
+struct gfx_config
+{
+	uint32_t obj_count = 128;
+	/**
+	 * @brief Use a surfaceless EGL context with no window instead of SDL,
+	 * only step(), verify() and run_headless() work then
+	 */
+	bool headless = false;
+	/**
+	 * @brief local_size_x of the compute shader, also the number of bodies
+	 * staged through shared memory at a time
+	 */
+	uint32_t work_group_size = 128;
+	integrator_type integrator = integrator_type::rk4;
+	block_params block;
+	/**
+	 * @brief Fixed step size of the windowed loop in seconds
+	 */
+	float delta_t = 1.0f / 60.0f;
+	/**
+	 * @brief Steps per pass of the windowed loop, 0 to keep pace with the
+	 * wall clock
+	 */
+	uint32_t steps_per_frame = 0;
+	/**
+	 * @brief Most steps a pass runs to catch up with the wall clock
+	 */
+	uint32_t max_steps_per_frame = 8;
+	/**
+	 * @brief Most frames drawn a second, 0 to draw on every pass
+	 */
+	float render_fps = 0.0f;
+	/**
+	 * @brief Cull the bodies outside the view on the GPU and draw only the
+	 * rest with an indirect draw, false draws every body
+	 */
+	bool cull = true;
+	/**
+	 * @brief Beyond this distance from the eye culling also thins the bodies
+	 * out with distance, 0 draws every visible body
+	 */
+	float lod_distance = 0.0f;
+	/**
+	 * @brief Softening length of the GPU force, added in quadrature to every
+	 * distance, the CPU solvers have none so --verify needs it at 0
+	 */
+	float softening = 0.0f;
+	render_type render = render_type::points;
+	/**
+	 * @brief Density renderer brightness, a pixel holding one average body
+	 * is 1 - exp(-exposure) of white
+	 */
+	float exposure = 0.5f;
+	barrier_type barrier = barrier_type::targeted;
+	/**
+	 * @brief Most steps queued on the GPU before the CPU waits for the oldest
+	 * with a fence, 1 waits for every step
+	 */
+	uint32_t steps_in_flight = 3;
+	/**
+	 * @brief Copy the positions and velocities out every this many steps
+	 * without stalling and pass them to on_snapshot on a thread of their own,
+	 * 0 never
+	 */
+	uint32_t snapshot_every = 0;
+	/**
+	 * @brief Snapshots that can be in flight at once, more are dropped
+	 */
+	uint32_t snapshot_slots = 3;
+	/**
+	 * @brief Called on the snapshot thread, must not use GL. Leapfrog
+	 * velocities are a full step behind the positions, each dispatch stores
+	 * x(n + 1) next to v(n), so energies from them lag by a step.
+	 */
+	std::function<void(const snapshot &)> on_snapshot;
+	/**
+	 * @brief Read the GLSL from this directory instead of the copies built
+	 * into the program, empty for the built in ones
+	 */
+	std::string shader_dir;
+	/**
+	 * @brief Keep linked program binaries here so later runs skip compiling,
+	 * empty to compile every run
+	 */
+	std::string shader_cache_dir;
+	/**
+	 * @brief Recompile the shaders in shader_dir when they are saved and swap
+	 * them in if they build, the simulation carries on from where it was
+	 */
+	bool hot_reload = false;
+};
 
 class gfx
 {
@@ -20,21 +169,205 @@ public:
 
 	gfx();
 	
-	void init();
+	/**
+	 * @brief Create the GL context, upload obj_count random bodies and load
+	 * the shaders
+	 */
+	void init(const gfx_config &config);
 	void deinit();
 	void render();
 	void resize(int w, int h);
 	int main_loop();
+	/**
+	 * @brief Run steps compute dispatches and the same steps on the CPU from
+	 * the same starting state, then compare the two. Call it straight after
+	 * init() so the starting state is still the one that was uploaded.
+	 * @return 0 if the GPU matches the CPU reference, 1 if it does not
+	 */
+	int verify(uint32_t steps, float delta_t);
+	/**
+	 * @brief Run steps compute dispatches back to back with nothing drawn or
+	 * swapped and print the step rate
+	 * @return 0
+	 */
+	int run_headless(uint32_t steps, float delta_t);
+	/**
+	 * @brief Run one physics step, returning once at most steps_in_flight - 1
+	 * steps are still running on the GPU, so with 1 it waits for this one
+	 */
+	void step(float delta_t);
+	/**
+	 * @brief Print the GPU time of every stage of every frame as well as the
+	 * once a second min/avg/p99
+	 */
+	void set_print_gpu_frames(bool print);
+	/**
+	 * @brief Draw the current state into an offscreen framebuffer the size of
+	 * the window and write it out as a binary PPM, works headless too
+	 * @return 0 on success, 1 if the file could not be written
+	 */
+	int dump_image(const std::string &fname);
+	/**
+	 * @brief Pair interactions in one step, 4 per pair for RK4 and 1 for
+	 * leapfrog, block reads back how many bodies the last step updated
+	 */
+	double interactions_per_step() const;
+	/**
+	 * @brief The gravitational constant the shaders use
+	 */
+	double gravity() const { return G; }
 	
 private:
+	void init_sdl();
+	void init_egl();
 	void print_info();
 	void load_shaders();
+	/**
+	 * @brief Link a vertex and fragment program through the shader cache
+	 */
+	GLuint build_render(const std::string &vert, const std::string &frag,
+		bool async = false);
+	/**
+	 * @brief Set the uniforms that only change on a resize or a reload, MVP
+	 * of every program that draws or culls and the tone map's
+	 */
+	void upload_uniforms();
+	/**
+	 * @brief List the visible bodies of current into visible_buf and their
+	 * count into the indirect draw command
+	 */
+	void cull_bodies();
+	/**
+	 * @brief Clear and draw one frame into the bound framebuffer with the
+	 * configured renderer
+	 */
+	void draw_frame();
+	/**
+	 * @brief Sum the mass of current per pixel into density_tex
+	 */
+	void splat_density();
+	/**
+	 * @brief Make density_tex the size of the window
+	 */
+	void resize_density();
+	/**
+	 * @brief Run one physics step on the GPU from current into next, then
+	 * swap current and next
+	 * @param drift false to only finish the leapfrog velocities so they line
+	 * up with the positions, the positions are copied unchanged
+	 */
+	void dispatch(float delta_t, bool drift = true);
+	/**
+	 * @brief Bring the leapfrog velocities level with the positions before
+	 * they are read back, does nothing for RK4
+	 */
+	void sync_velocities(float delta_t);
+	/**
+	 * @brief One block time step, 2^max_level substeps of drift, select and
+	 * force passes on current in place
+	 */
+	void dispatch_block(float delta_t);
+	/**
+	 * @brief Make what the last compute pass wrote visible to a reader that
+	 * needs these barrier bits, issuing only the ones not issued since
+	 */
+	void sync_compute(GLbitfield bits);
+	/**
+	 * @brief Fence the step just queued and wait for the one steps_in_flight
+	 * - 1 before it
+	 */
+	void fence_step();
+	/**
+	 * @brief Copy params to params_buf if it changed since the last upload
+	 */
+	void upload_params();
+	/**
+	 * @brief Create sets[0] and sets[1] once every buffer exists
+	 */
+	void build_binding_sets();
+	/**
+	 * @brief Every program gfx runs, 0 for the ones it does not need
+	 */
+	struct program_set
+	{
+		GLuint point = 0;
+		GLuint physics = 0;
+		GLuint block_drift = 0, block_select = 0, block_force = 0;
+		GLuint cull = 0, cull_point = 0;
+		GLuint splat = 0, density = 0;
+
+		std::vector<GLuint> all() const
+		{
+			return {point, physics, block_drift, block_select, block_force,
+				cull, cull_point, splat, density};
+		}
+	};
+	/**
+	 * @brief Build every program this configuration needs
+	 * @param async only start the compiles, see shader_cache::start()
+	 * @return false with set empty if a stage could not be read or GL could
+	 * not create a program, link errors only show once they finish
+	 */
+	bool build_programs(program_set &set, bool async);
+	void install_programs(const program_set &set);
+	program_set installed_programs() const;
+	void delete_programs(const program_set &set);
+	/**
+	 * @brief Start recompiling when the watcher saw a shader change and swap
+	 * the new programs in once they have all linked, keeping the old ones if
+	 * a stage can not be read or any program fails
+	 */
+	void reload_shaders();
+	/**
+	 * @brief Link a compute program through the shader cache
+	 */
+	GLuint build_compute(const std::string &source, bool async = false);
+	/**
+	 * @brief Copy the xyz of obj_count vec4s out of a GL buffer
+	 */
+	void read_buffer(GLuint buffer, std::vector<Eigen::Vector3f> &out);
+	/**
+	 * @brief Build the vec4 layout the GPU buffers use, w from w or 0
+	 */
+	static void pack_vec4(const std::vector<Eigen::Vector3f> &xyz,
+		const std::vector<float> *w, std::vector<Eigen::Vector4f> &out);
 
 	fox::counter *fps_counter;
 	fox::counter *update_counter;
 	fox::counter *perf_counter;
+	/**
+	 * @brief The GPU timestamps taken in a frame, in order
+	 */
+	enum frame_mark
+	{
+		mark_start,
+		mark_compute,
+		mark_barrier,
+		mark_prepass,
+		mark_draw,
+		mark_swap,
+		mark_count
+	};
+	/**
+	 * @brief GPU time of each stage between the frame_marks
+	 */
+	gpu_timer *timer;
+	/**
+	 * @brief Steps and draws of the windowed loop
+	 */
+	scheduler *sched;
+	uint64_t report_steps;
+	uint64_t report_frames;
 	SDL_Window *window;
 	SDL_GLContext context;
+#ifdef HAVE_EGL
+	EGLDisplay egl_display;
+	EGLContext egl_context;
+#endif
+	/**
+	 * @brief True when there is no window, only an EGL context
+	 */
+	bool headless;
 	int done;
 	int win_w;
 	int win_h;
@@ -47,9 +380,9 @@ private:
 	 * @brief Velocity, two vectors for new and old
 	 */
 	std::vector<Eigen::Vector3f> v[2];
-	// TODO: delete a[]
 	/**
-	 * @brief Acceleration, two vectors for new and old
+	 * @brief Acceleration, two vectors for new and old, only the leapfrog
+	 * integrator uses them
 	 */
 	std::vector<Eigen::Vector3f> a[2];
 	/**
@@ -63,7 +396,88 @@ private:
 	std::mt19937_64 generator;
 
 	double G = 6.67408e-11;
-	uint16_t obj_count;
+	uint32_t obj_count;
+	/**
+	 * @brief local_size_x and TILE_SIZE of physics.comp, set at init
+	 */
+	uint32_t work_group_size;
+	integrator_type integrator;
+	/**
+	 * @brief True when the a buffer of current holds the acceleration from the
+	 * last leapfrog step and the velocities lag the positions by one step
+	 */
+	bool leapfrog_primed;
+	block_params block;
+	/**
+	 * @brief True once the a buffer and levels hold the block state
+	 */
+	bool block_primed;
+	GLuint block_drift_prog, block_select_prog, block_force_prog;
+	GLuint level_buf, active_buf, block_args_buf;
+	/**
+	 * @brief substep of the three block programs and prime of the force one,
+	 * looked up whenever programs are installed
+	 */
+	GLint block_substep_loc[3], block_prime_loc;
+
+	/**
+	 * @brief The std140 params block of params.glsl, every compute shader
+	 * reads it from uniform buffer binding 0
+	 */
+	struct step_params
+	{
+		float delta_t;
+		uint32_t point_count;
+		float G;
+		float softening2;
+		uint32_t kick;
+		uint32_t drift;
+		uint32_t max_level;
+		float eta;
+	};
+	step_params params;
+	/**
+	 * @brief What params_buf holds, uploads are skipped when nothing changed
+	 */
+	step_params uploaded_params;
+	GLuint params_buf;
+
+	/**
+	 * @brief Every SSBO binding the shaders use, in binding order, and a VAO
+	 * that feeds the positions to the point shader, one set per value of
+	 * current so a step binds everything with a single call
+	 */
+	static const uint32_t ssbo_binding_count = 12;
+	struct binding_set
+	{
+		GLuint ssbo[ssbo_binding_count];
+		GLuint vao;
+	};
+	binding_set sets[2];
+	/**
+	 * @brief Work groups of one invocation per body
+	 */
+	GLuint body_groups;
+
+	barrier_type barrier_mode;
+	/**
+	 * @brief Barrier bits issued since the last compute pass, all of them in
+	 * full mode
+	 */
+	GLbitfield synced;
+	/**
+	 * @brief One fence per step in flight, a ring indexed by fence_index
+	 */
+	std::vector<GLsync> step_fences;
+	uint32_t fence_index;
+
+	/**
+	 * @brief Steps that drifted and the simulated time they cover
+	 */
+	uint64_t step_count;
+	double sim_time;
+	snapshot_ring *snapshots;
+	uint32_t snapshot_every;
 
 	// an empty vertex array object to bind to
 	uint32_t default_vao;
@@ -72,8 +486,49 @@ private:
 	Eigen::Affine3f M;
 	Eigen::Projective3f P, MVP;
 
-	GLuint point_shader_id, shader_vert_id, shader_frag_id, comp_shader_id, comp_prog;
-	GLuint x_vbo_0, x_vbo_1, v_vbo_0, v_vbo_1, a_vbo_0, a_vbo_1, m_vbo;
+	/**
+	 * @brief Where every program comes from
+	 */
+	shader_cache *shaders;
+	/**
+	 * @brief Set with --hot-reload in a window, otherwise null
+	 */
+	shader_watcher *watcher;
+	/**
+	 * @brief Programs still compiling after a shader change
+	 */
+	program_set pending;
+	bool reload_pending;
+	GLuint point_shader_id, comp_prog;
+	bool cull;
+	float lod_distance;
+	/**
+	 * @brief cull.comp and the point program that draws what it listed
+	 */
+	GLuint cull_prog, cull_point_prog;
+	/**
+	 * @brief Index of every visible body, then the DrawArraysIndirectCommand
+	 * whose count cull.comp fills in
+	 */
+	GLuint visible_buf, draw_cmd_buf;
+	render_type render_mode;
+	float exposure;
+	/**
+	 * @brief Fixed point units per unit of mass in density_tex
+	 */
+	float mass_scale;
+	/**
+	 * @brief splat.comp and the fullscreen tone map of density_tex
+	 */
+	GLuint splat_prog, density_prog;
+	/**
+	 * @brief r32ui, window sized
+	 */
+	GLuint density_tex;
+	/**
+	 * @brief vec4 per body, x holds the mass in w
+	 */
+	GLuint x_vbo_0, x_vbo_1, v_vbo_0, v_vbo_1, a_vbo_0, a_vbo_1;
 
 	uint32_t current, next;
 
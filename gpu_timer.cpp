@@ -0,0 +1,156 @@
+#include "gpu_timer.hpp"
+
+#include <cstdio>
+#include <algorithm>
+
+gpu_timer::gpu_timer(uint32_t mark_count, const char *const *section_names,
+	uint32_t frames_in_flight)
+{
+	this->mark_count = mark_count;
+	names.assign(section_names, section_names + mark_count - 1);
+	names.push_back("frame");
+
+	ring.resize(frames_in_flight);
+	for(slot &s : ring)
+	{
+		s.queries.resize(mark_count);
+		glGenQueries(mark_count, s.queries.data());
+		s.pending = false;
+		s.frame = 0;
+	}
+
+	head = 0;
+	in_frame = false;
+	print_frames = false;
+	frame_count = 0;
+	dropped = 0;
+	samples.resize(mark_count);
+}
+
+gpu_timer::~gpu_timer()
+{
+	for(slot &s : ring)
+		glDeleteQueries((GLsizei)s.queries.size(), s.queries.data());
+}
+
+void gpu_timer::begin_frame()
+{
+	// read back every finished frame, oldest first
+	for(uint32_t i = 1; i <= ring.size(); i++)
+	{
+		slot &s = ring[(head + i) % ring.size()];
+		if(s.pending)
+			collect(s);
+	}
+
+	frame_count++;
+	head = (head + 1) % ring.size();
+	if(ring[head].pending)
+	{
+		// still waiting on this slot from frames_in_flight frames ago
+		dropped++;
+		in_frame = false;
+		return;
+	}
+
+	ring[head].marks.clear();
+	ring[head].frame = frame_count;
+	in_frame = true;
+}
+
+void gpu_timer::mark(uint32_t index)
+{
+	if(!in_frame)
+		return;
+
+	slot &s = ring[head];
+	if(s.marks.size() == s.queries.size())
+	{
+		GLuint query;
+		glGenQueries(1, &query);
+		s.queries.push_back(query);
+	}
+	glQueryCounter(s.queries[s.marks.size()], GL_TIMESTAMP);
+	s.marks.push_back(index);
+}
+
+void gpu_timer::end_frame()
+{
+	if(!in_frame)
+		return;
+
+	ring[head].pending = !ring[head].marks.empty();
+	in_frame = false;
+}
+
+void gpu_timer::collect(slot &s)
+{
+	const size_t n = s.marks.size();
+
+	// the results of a frame arrive in order so the last mark is enough
+	GLint available = 0;
+	glGetQueryObjectiv(s.queries[n - 1], GL_QUERY_RESULT_AVAILABLE,
+		&available);
+	if(!available)
+		return;
+
+	std::vector<GLuint64> t(n, 0);
+	for(size_t k = 0; k < n; k++)
+		glGetQueryObjectui64v(s.queries[k], GL_QUERY_RESULT, &t[k]);
+	s.pending = false;
+
+	std::vector<double> ms(mark_count, -1.0);
+	for(size_t k = 1; k < n; k++)
+	{
+		uint32_t from = s.marks[k - 1], to = s.marks[k];
+		// the next mark, or the start of another round of them, ends the
+		// section before it, a mark that skips ahead times nothing
+		if(to == 0 || to > from + 1)
+			continue;
+		uint32_t section = to - 1;
+		ms[section] = std::max(ms[section], 0.0) + (t[k] - t[k - 1]) * 1.0e-6;
+	}
+	for(uint32_t i = 0; i + 1 < mark_count; i++)
+	{
+		if(ms[i] >= 0.0)
+			samples[i].push_back(ms[i]);
+	}
+	ms[mark_count - 1] = (t[n - 1] - t[0]) * 1.0e-6;
+	samples[mark_count - 1].push_back(ms[mark_count - 1]);
+
+	if(print_frames)
+	{
+		printf("GPU frame %llu:", (unsigned long long)s.frame);
+		for(uint32_t i = 0; i < mark_count; i++)
+		{
+			if(ms[i] >= 0.0)
+				printf(" %s %.3f ms", names[i], ms[i]);
+		}
+		printf("\n");
+	}
+}
+
+void gpu_timer::report()
+{
+	for(uint32_t i = 0; i < mark_count; i++)
+	{
+		std::vector<double> &v = samples[i];
+		if(v.empty())
+			continue;
+
+		std::sort(v.begin(), v.end());
+		double sum = 0.0;
+		for(double x : v)
+			sum += x;
+		size_t p99 = (v.size() * 99 + 99) / 100 - 1;
+		printf("GPU %-8s min %.3f avg %.3f p99 %.3f ms\n", names[i], v.front(),
+			sum / v.size(), v[std::min(p99, v.size() - 1)]);
+		v.clear();
+	}
+	if(dropped > 0)
+	{
+		printf("GPU timer skipped %llu frames waiting on queries\n",
+			(unsigned long long)dropped);
+		dropped = 0;
+	}
+}
@@ -0,0 +1,82 @@
+#ifndef GPU_TIMER_HPP
+#define GPU_TIMER_HPP
+
+#include <cstdint>
+#include <vector>
+#include <GL/glew.h>
+
+/**
+ * @brief GPU side timing of the stages of a frame with GL_TIMESTAMP queries
+ *
+ * Each frame records a timestamp at up to mark_count marks and section i is
+ * the GPU time from mark i to mark i + 1. A mark may come round again in the
+ * same frame, one per step when a frame runs several, and a mark at or before
+ * the one recorded last starts the next round: the time since is added to the
+ * section that ends at it. The queries of a frame live in one
+ * slot of a ring that is frames_in_flight deep and a slot is only read back
+ * once GL says its results are available, so the timer never stalls the
+ * pipeline. If the GPU falls so far behind that the next slot is still in
+ * use that frame is not timed.
+ */
+class gpu_timer
+{
+public:
+	/**
+	 * @param section_names mark_count - 1 names used when printing
+	 */
+	gpu_timer(uint32_t mark_count, const char *const *section_names,
+		uint32_t frames_in_flight = 4);
+	~gpu_timer();
+
+	/**
+	 * @brief Collect any finished frames and start timing a new one
+	 */
+	void begin_frame();
+	/**
+	 * @brief Record a timestamp once everything submitted so far is done,
+	 * does nothing outside begin_frame() and end_frame(). A mark may be
+	 * recorded any number of times in a frame.
+	 */
+	void mark(uint32_t index);
+	void end_frame();
+
+	/**
+	 * @brief Print every frame's section times as soon as they are read back
+	 */
+	void set_print_frames(bool print) { print_frames = print; }
+	/**
+	 * @brief Print min/avg/p99 of each section and of the whole frame over
+	 * the frames collected since the last report, then start a new report
+	 */
+	void report();
+
+private:
+	struct slot
+	{
+		// grows to the most marks any frame has recorded
+		std::vector<GLuint> queries;
+		// the mark of each query used this frame, in the order recorded
+		std::vector<uint32_t> marks;
+		bool pending;
+		uint64_t frame;
+	};
+
+	void collect(slot &s);
+
+	uint32_t mark_count;
+	std::vector<const char *> names;
+	std::vector<slot> ring;
+	uint32_t head;
+	bool in_frame;
+	bool print_frames;
+	uint64_t frame_count;
+	uint64_t dropped;
+
+	/**
+	 * @brief Section times in ms since the last report, the last one is the
+	 * whole frame from the first mark to the last
+	 */
+	std::vector<std::vector<double>> samples;
+};
+
+#endif
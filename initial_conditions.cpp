@@ -0,0 +1,33 @@
+#include "initial_conditions.hpp"
+
+void random_cube(std::mt19937_64 &generator, uint32_t count,
+	std::vector<Eigen::Vector3f> x[2], std::vector<Eigen::Vector3f> v[2],
+	std::vector<float> &m)
+{
+	float mass_range[2] = {1.0e6f, 1.0e8f};
+	float distance_range[2] = {-1.0f, 1.0f};
+
+	std::uniform_real_distribution<float> dist_m(mass_range[0],
+		mass_range[1]);
+	std::uniform_real_distribution<float> dist_d(distance_range[0],
+		distance_range[1]);
+
+	x[0].resize(count);
+	x[1].resize(count);
+	v[0].resize(count);
+	v[1].resize(count);
+	m.resize(count);
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		m[i] = dist_m(generator);
+
+		x[0][i] = Eigen::Vector3f(dist_d(generator),
+			dist_d(generator),
+			dist_d(generator));
+
+		x[1][i] = Eigen::Vector3f(0.0, 0.0, 0.0);
+		v[0][i] = Eigen::Vector3f(0.0, 0.0, 0.0);
+		v[1][i] = Eigen::Vector3f(0.0, 0.0, 0.0);
+	}
+}
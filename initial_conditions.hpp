@@ -0,0 +1,19 @@
+#ifndef INITIAL_CONDITIONS_HPP
+#define INITIAL_CONDITIONS_HPP
+
+#include <vector>
+#include <random>
+#include <Eigen/Core>
+
+/**
+ * @brief Resize the ping-pong state to count bodies and fill x[0], v[0] and m
+ * with bodies at rest scattered uniformly through a cube from -1 to 1
+ *
+ * x[1] and v[1] are zeroed. Both the GPU and CPU backends start from this so a
+ * given seed gives the same run on either.
+ */
+void random_cube(std::mt19937_64 &generator, uint32_t count,
+	std::vector<Eigen::Vector3f> x[2], std::vector<Eigen::Vector3f> v[2],
+	std::vector<float> &m);
+
+#endif
@@ -0,0 +1,58 @@
+#include "integrator.hpp"
+
+#include <cmath>
+
+const char *integrator_name(integrator_type type)
+{
+	switch(type)
+	{
+		case integrator_type::leapfrog:
+			return "leapfrog";
+		case integrator_type::block:
+			return "block";
+		default:
+			return "rk4";
+	}
+}
+
+bool parse_integrator(const std::string &name, integrator_type &type)
+{
+	if(name == "rk4")
+		type = integrator_type::rk4;
+	else if(name == "leapfrog")
+		type = integrator_type::leapfrog;
+	else if(name == "block")
+		type = integrator_type::block;
+	else
+		return false;
+	return true;
+}
+
+unsigned force_passes(integrator_type type)
+{
+	return type == integrator_type::rk4 ? 4 : 1;
+}
+
+uint32_t block_next_level(const float a0[3], const float a1[3],
+	float delta_t, uint32_t level, uint32_t substep, const block_params &p)
+{
+	float dt = delta_t / (float)(1u << level);
+	float da[3] = {a1[0] - a0[0], a1[1] - a0[1], a1[2] - a0[2]};
+	float jerk = std::sqrt(da[0] * da[0] + da[1] * da[1] + da[2] * da[2]) / dt;
+	float a = std::sqrt(a1[0] * a1[0] + a1[1] * a1[1] + a1[2] * a1[2]);
+	float t = jerk > 0.0f ? p.eta * a / jerk : delta_t;
+
+	// halve rather than take a log2 so the GPU lands on the same level
+	uint32_t want = 0;
+	float step = delta_t;
+	while(step > t && want < p.max_level)
+	{
+		step *= 0.5f;
+		want++;
+	}
+
+	if(want >= level)
+		return want;
+	uint32_t stride = 1u << (p.max_level - (level - 1));
+	return (substep + 1) % stride == 0 ? level - 1 : level;
+}
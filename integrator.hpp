@@ -0,0 +1,66 @@
+#ifndef INTEGRATOR_HPP
+#define INTEGRATOR_HPP
+
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief How a step advances the bodies, both backends support both
+ *
+ * rk4 is the original classic Runge-Kutta step with four force passes.
+ * leapfrog is kick-drift-kick velocity Verlet: it keeps the acceleration from
+ * the end of the last step so each step needs one force pass, and being
+ * symplectic its energy error stays bounded over long runs.
+ * block is leapfrog with hierarchical block time steps: each body steps by
+ * delta_t / 2^level with its level picked from how fast its acceleration
+ * changes, and forces are only summed for the bodies finishing a step.
+ */
+enum class integrator_type
+{
+	rk4,
+	leapfrog,
+	block
+};
+
+/**
+ * @brief Settings of the block integrator
+ */
+struct block_params
+{
+	/**
+	 * @brief The finest level, a step is split into 2^max_level substeps
+	 */
+	uint32_t max_level = 6;
+	/**
+	 * @brief Accuracy, a body's step is eta times the time its acceleration
+	 * takes to change by its own size
+	 */
+	float eta = 0.02f;
+};
+
+/**
+ * @brief The level a body moves to after finishing a step at level
+ *
+ * Shared by the CPU and physics.comp so both make the same choice. A body
+ * can move to any finer level but only one level coarser at a time, and only
+ * when the coarser step lines up with the substep it finishes on.
+ * @param a0 acceleration at the start of the step
+ * @param a1 acceleration at the end of the step
+ * @param substep the substep the body finishes on
+ */
+uint32_t block_next_level(const float a0[3], const float a1[3],
+	float delta_t, uint32_t level, uint32_t substep, const block_params &p);
+
+const char *integrator_name(integrator_type type);
+/**
+ * @brief Parse "rk4", "leapfrog" or "block", returns false if the name is
+ * unknown
+ */
+bool parse_integrator(const std::string &name, integrator_type &type);
+/**
+ * @brief Force passes per step, each is one interaction per pair of bodies,
+ * for block it is per body finishing a substep
+ */
+unsigned force_passes(integrator_type type);
+
+#endif
@@ -1,18 +1,472 @@
 
+#include <iostream>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <boost/program_options.hpp>
+
 #include "gfx.hpp"
+#include "shader_cache.hpp"
+#include "snapshot_ring.hpp"
+#include "trajectory.hpp"
+#include "cpu_physics.hpp"
+#include "thread_pool.hpp"
+#include "force_solver.hpp"
+#include "barnes_hut.hpp"
+#include "fmm.hpp"
+#include "fox/counter.hpp"
+
+namespace po = boost::program_options;
+
+block_params parse_block(const po::variables_map &vm)
+{
+	block_params p;
+	p.max_level = std::min(vm["max-level"].as<uint32_t>(), 16u);
+	p.eta = vm["eta"].as<float>();
+	return p;
+}
+
+/**
+ * @brief Print the header of a trajectory file and the summary of one frame,
+ * or of every frame
+ */
+int read_trajectory(const po::variables_map &vm)
+{
+	trajectory_reader reader(vm["read-trajectory"].as<std::string>());
+	if(!reader.ok())
+		return 1;
+
+	const trajectory_header &h = reader.info();
+	printf("%u bodies, dt %g, G %g, softening %g, %llu frames\n", h.count,
+		h.delta_t, h.G, h.softening, (unsigned long long)reader.frame_count());
+	if(h.block_size > 0)
+		printf("Quantized to %g in position and %g in velocity, a keyframe "
+			"every %u frames\n", h.position_error, h.velocity_error,
+			h.keyframe_every);
+
+	uint64_t first = 0, last = reader.frame_count();
+	if(vm.count("frame"))
+	{
+		first = vm["frame"].as<uint64_t>();
+		last = first + 1;
+	}
+	for(uint64_t i = first; i < last; i++)
+	{
+		snapshot s;
+		if(!reader.frame(i, s))
+		{
+			printf("ERROR there is no frame %llu\n", (unsigned long long)i);
+			return 1;
+		}
+		print_snapshot_summary(s);
+	}
+	return 0;
+}
+
+/**
+ * @brief Run the simulation on the CPU with no window or GL context
+ */
+int run_cpu(const po::variables_map &vm, const std::string &backend)
+{
+	uint32_t obj_count = vm["count"].as<uint32_t>();
+	uint32_t steps = vm["steps"].as<uint32_t>();
+	float delta_t = vm["dt"].as<float>();
+
+	thread_pool pool(vm["threads"].as<uint32_t>(), vm.count("pin") > 0);
+	std::mt19937_64 generator(std::random_device{}());
+
+	integrator_type integrator;
+	if(!parse_integrator(vm["integrator"].as<std::string>(), integrator))
+	{
+		std::cout << "ERROR: unknown integrator "
+			<< vm["integrator"].as<std::string>() << std::endl;
+		return 1;
+	}
+
+	cpu_physics physics(&pool);
+	physics.set_integrator(integrator);
+	physics.set_block_params(parse_block(vm));
+	physics.set_sort_interval(vm["sort-every"].as<uint32_t>());
+	if(backend == "bh")
+	{
+		physics.set_solver(new barnes_hut(&pool, vm["theta"].as<float>()));
+	}
+	else if(backend == "fmm")
+	{
+		physics.set_solver(new fmm(&pool, vm["order"].as<uint32_t>(),
+			vm["theta"].as<float>()));
+	}
+	else
+	{
+		simd_level level;
+		if(!parse_simd(vm["kernel"].as<std::string>(), level))
+		{
+			std::cout << "ERROR: unknown kernel "
+				<< vm["kernel"].as<std::string>() << std::endl;
+			return 1;
+		}
+		if(vm.count("symmetric"))
+			physics.set_solver(new symmetric_solver(&pool, level));
+		else
+			physics.set_solver(new direct_solver(&pool, level));
+	}
+	physics.init(obj_count, generator);
+
+	if(vm.count("fmm-report"))
+	{
+		fmm_report(&pool, physics.positions(), physics.gravity(),
+			vm["theta"].as<float>(), vm["order"].as<uint32_t>());
+		return 0;
+	}
+
+	printf("CPU backend: %u bodies, %u %s steps, %u threads, %s solver\n",
+		obj_count, steps, integrator_name(integrator), pool.size(),
+		physics.get_solver()->name());
+
+	fox::counter perf_counter;
+	fox::counter fps_counter;
+	double total_time = 0.0;
+	double phys_time = 0.0;
+	double run_time = 0.0;
+	uint32_t frames = 0;
+
+	for(uint32_t i = 0; i < steps; i++)
+	{
+		perf_counter.update_double();
+		physics.step(delta_t);
+		phys_time += perf_counter.update_double();
+		frames++;
+
+		total_time += fps_counter.update_double();
+		if(total_time >= 1.0)
+		{
+			printf("Physics time:    %.9f\n", phys_time / frames);
+			printf("Steps/s:         %.3f\n", frames / total_time);
+			printf("Interactions/s:  %.4g\n",
+				physics.interactions_per_step() * frames / total_time);
+			printf("----------------------------\n");
+			run_time += total_time;
+			total_time = 0.0;
+			phys_time = 0.0;
+			frames = 0;
+		}
+	}
+	run_time += total_time;
+
+	// no steps, or too few for the clock to see, have no rate
+	if(steps == 0 || run_time <= 0.0)
+	{
+		printf("%u steps in %.3f s\n", steps, run_time);
+	}
+	else
+	{
+		printf("%u steps in %.3f s (%.3f steps/s, %.4g interactions/s)\n",
+			steps, run_time, steps / run_time,
+			physics.interactions_per_step() * steps / run_time);
+	}
+
+	physics.deinit();
+
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
+	po::options_description desc("Options");
+	desc.add_options()
+		("help,h", "print this help")
+		("backend", po::value<std::string>()->default_value("gpu"),
+			"physics backend: gpu, or on the CPU cpu (all pairs), bh "
+			"(Barnes-Hut) or fmm (fast multipole)")
+		("count,n", po::value<uint32_t>()->default_value(128),
+			"number of bodies")
+		("steps,s", po::value<uint32_t>()->default_value(1000),
+			"number of steps to run (CPU backends and --headless)")
+		("threads,t", po::value<uint32_t>()->default_value(0),
+			"worker threads, 0 for one per logical core (CPU backends)")
+		("pin", "pin each worker thread to its own CPU (CPU backends, Linux)")
+		("sort-every", po::value<uint32_t>()->default_value(0),
+			"reorder the bodies in memory along a Morton curve every this "
+			"many steps, 0 never (CPU backends)")
+		("integrator", po::value<std::string>()->default_value("rk4"),
+			"rk4 (4 force passes per step), leapfrog (1 force pass per "
+			"step, symplectic) or block (leapfrog with per body power of two "
+			"time steps)")
+		("max-level", po::value<uint32_t>()->default_value(6),
+			"block integrator: the shortest step is --dt / 2^max-level")
+		("eta", po::value<float>()->default_value(0.02f),
+			"block integrator: accuracy, smaller gives shorter steps")
+		("dt", po::value<float>()->default_value(1.0f / 60.0f),
+			"fixed time step in seconds")
+		("kernel", po::value<std::string>()->default_value("auto"),
+			"pair kernel: auto, scalar, avx2 or avx512 (cpu backend)")
+		("symmetric", "evaluate each pair once and apply it to both bodies "
+			"when the force is wanted at the bodies themselves (cpu backend)")
+		("theta", po::value<float>()->default_value(0.5f),
+			"tree opening angle, smaller is more accurate (bh and fmm "
+			"backends)")
+		("order", po::value<uint32_t>()->default_value(4),
+			"expansion order (fmm backend)")
+		("fmm-report", "print FMM force error and time for orders 1 to "
+			"--order against all-pairs on --count bodies and exit")
+		("verify", "run --verify-steps GPU steps and the same steps on the "
+			"CPU, compare them and exit")
+		("verify-steps", po::value<uint32_t>()->default_value(5),
+			"steps --verify runs, keep it to a few: the GPU sums in a "
+			"different order and over longer runs the rounding grows "
+			"chaotically past the 1e-3 tolerance")
+		("headless", "no window, run --steps GPU steps on a surfaceless EGL "
+			"context, print the step rate and exit")
+		("steps-per-frame", po::value<uint32_t>()->default_value(0),
+			"GPU window: run this many --dt steps per pass as fast as "
+			"possible, 0 to run as many as the wall clock covers")
+		("max-substeps", po::value<uint32_t>()->default_value(8),
+			"GPU window: most steps per pass when following the wall clock")
+		("barrier", po::value<std::string>()->default_value("targeted"),
+			"GPU: memory barriers after a step, full (every bit straight "
+			"after it) or targeted (only what the next pass reads, just "
+			"before it)")
+		("steps-in-flight", po::value<uint32_t>()->default_value(3),
+			"GPU: most steps queued before the CPU waits on a fence for the "
+			"oldest, 1 waits for every step")
+		("snapshot-every", po::value<uint32_t>()->default_value(0),
+			"GPU: copy the state out every this many steps without stalling "
+			"and print its kinetic energy, momentum and centre of mass from a "
+			"background thread, 0 never")
+		("snapshot-slots", po::value<uint32_t>()->default_value(3),
+			"GPU: snapshots in flight at once, more are dropped rather than "
+			"waited for")
+		("trajectory", po::value<std::string>(),
+			"GPU: write every snapshot to this trajectory file from a thread "
+			"of its own instead of printing it, needs --snapshot-every")
+		("trajectory-direct", "GPU: write the trajectory with O_DIRECT, "
+			"bypassing the page cache where the file system allows it")
+		("trajectory-buffers", po::value<uint32_t>()->default_value(4),
+			"GPU: frames queued for the trajectory writer at once, more are "
+			"dropped rather than waited for")
+		("trajectory-error", po::value<double>()->default_value(0.0),
+			"GPU: compress the trajectory, storing positions to within this "
+			"much as deltas from the frame before, 0 writes them raw")
+		("trajectory-velocity-error", po::value<double>(),
+			"GPU: the same for velocities, --trajectory-error if not given")
+		("keyframe-every", po::value<uint32_t>()->default_value(16),
+			"GPU: with --trajectory-error store every this many frames whole, "
+			"so a reader can start there")
+		("trajectory-threads", po::value<uint32_t>()->default_value(0),
+			"GPU: threads compressing each frame, 0 for one per logical core")
+		("read-trajectory", po::value<std::string>(),
+			"print the header of this trajectory file and a summary of every "
+			"frame, or of --frame, then exit")
+		("frame", po::value<uint64_t>(),
+			"the frame --read-trajectory prints, from 0")
+		("render-fps", po::value<float>()->default_value(0.0f),
+			"GPU window: most frames to draw a second, 0 to draw every pass")
+		("no-cull", "GPU window: draw every body instead of culling the ones "
+			"outside the view on the GPU first")
+		("lod-distance", po::value<float>()->default_value(0.0f),
+			"GPU window: beyond this distance from the eye draw a fraction of "
+			"the bodies that falls with the square of the distance, 0 draws "
+			"them all")
+		("softening", po::value<float>()->default_value(0.0f),
+			"GPU: softening length added to every pair distance, the CPU "
+			"solvers have none so --verify only matches at 0")
+		("render", po::value<std::string>()->default_value("points"),
+			"GPU: points (one point per body) or density (mass summed per "
+			"pixel on the GPU and tone mapped, for very large counts)")
+		("exposure", po::value<float>()->default_value(0.5f),
+			"GPU density renderer: brightness, a pixel holding one average "
+			"body is 1 - exp(-exposure) of white")
+		("dump", po::value<std::string>(),
+			"GPU: when the run ends draw the bodies offscreen and write the "
+			"image to this PPM file, works with --headless")
+		("shader-dir", po::value<std::string>(),
+			"GPU: read the GLSL from this directory instead of the copies "
+			"built into the program")
+		("shader-cache", po::value<std::string>()->default_value(
+			shader_cache::default_dir()),
+			"GPU: directory for linked shader program binaries, so later runs "
+			"skip compiling")
+		("no-shader-cache", "GPU: compile every shader program every run")
+		("hot-reload", "GPU window: recompile the shaders in --shader-dir "
+			"whenever one is saved and swap them in if they build, without "
+			"losing the simulation state (Linux)")
+		("gpu-frame-times", "print the GPU time of the compute, barrier, "
+			"pre-pass (cull or splat), draw and swap stages of every frame");
+
+	po::variables_map vm;
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	}
+	catch(const po::error &e)
+	{
+		std::cout << "ERROR: " << e.what() << "\n" << desc << std::endl;
+		return 1;
+	}
+
+	if(vm.count("help"))
+	{
+		std::cout << desc << std::endl;
+		return 0;
+	}
+
+	if(vm.count("read-trajectory"))
+		return read_trajectory(vm);
+
+	std::string backend = vm["backend"].as<std::string>();
+	if(backend == "cpu" || backend == "bh" || backend == "fmm" ||
+		vm.count("fmm-report"))
+		return run_cpu(vm, backend);
+	if(backend != "gpu")
+	{
+		std::cout << "ERROR: unknown backend " << backend << "\n" << desc
+			<< std::endl;
+		return 1;
+	}
+
+	gfx_config config;
+	config.obj_count = vm["count"].as<uint32_t>();
+	config.headless = vm.count("headless") > 0;
+	config.delta_t = vm["dt"].as<float>();
+	config.steps_per_frame = vm["steps-per-frame"].as<uint32_t>();
+	config.max_steps_per_frame = vm["max-substeps"].as<uint32_t>();
+	config.render_fps = vm["render-fps"].as<float>();
+	config.steps_in_flight = vm["steps-in-flight"].as<uint32_t>();
+	config.snapshot_every = vm["snapshot-every"].as<uint32_t>();
+	config.snapshot_slots = vm["snapshot-slots"].as<uint32_t>();
+	// the writer needs the G gfx uses so it is made after init(), no step runs
+	// before then
+	trajectory_writer *writer = nullptr;
+	if(vm.count("trajectory"))
+	{
+		if(config.snapshot_every == 0)
+		{
+			std::cout << "ERROR: --trajectory needs --snapshot-every"
+				<< std::endl;
+			return 1;
+		}
+		if(vm["trajectory-error"].as<double>() < 0.0 ||
+			(vm["trajectory-error"].as<double>() > 0.0 &&
+			vm.count("trajectory-velocity-error") &&
+			vm["trajectory-velocity-error"].as<double>() <= 0.0))
+		{
+			std::cout << "ERROR: --trajectory-error can not be negative and "
+				"--trajectory-velocity-error must be positive" << std::endl;
+			return 1;
+		}
+		config.on_snapshot = [&writer](const snapshot &s)
+		{
+			writer->write(s);
+		};
+	}
+	else
+		config.on_snapshot = print_snapshot_summary;
+	if(config.steps_in_flight == 0)
+	{
+		std::cout << "ERROR: --steps-in-flight must be at least 1" << std::endl;
+		return 1;
+	}
+	if(!parse_barrier(vm["barrier"].as<std::string>(), config.barrier))
+	{
+		std::cout << "ERROR: unknown barrier "
+			<< vm["barrier"].as<std::string>() << std::endl;
+		return 1;
+	}
+	config.cull = vm.count("no-cull") == 0;
+	config.lod_distance = vm["lod-distance"].as<float>();
+	config.exposure = vm["exposure"].as<float>();
+	config.softening = vm["softening"].as<float>();
+	if(vm.count("shader-dir"))
+		config.shader_dir = vm["shader-dir"].as<std::string>();
+	config.hot_reload = vm.count("hot-reload") > 0;
+	if(config.hot_reload && config.shader_dir.empty())
+	{
+		std::cout << "ERROR: --hot-reload needs --shader-dir" << std::endl;
+		return 1;
+	}
+	if(!vm.count("no-shader-cache"))
+		config.shader_cache_dir = vm["shader-cache"].as<std::string>();
+	if(!parse_render(vm["render"].as<std::string>(), config.render))
+	{
+		std::cout << "ERROR: unknown renderer "
+			<< vm["render"].as<std::string>() << std::endl;
+		return 1;
+	}
+	config.block = parse_block(vm);
+	if(!parse_integrator(vm["integrator"].as<std::string>(),
+		config.integrator))
+	{
+		std::cout << "ERROR: unknown integrator "
+			<< vm["integrator"].as<std::string>() << std::endl;
+		return 1;
+	}
+
 	gfx *g = new gfx();
-	
-	g->init();
-	
-	while(!g->main_loop())
-		g->render();
-	
+
+	g->init(config);
+	g->set_print_gpu_frames(vm.count("gpu-frame-times") > 0);
+	if(vm.count("trajectory"))
+	{
+		trajectory_quantization quant;
+		quant.position_error = vm["trajectory-error"].as<double>();
+		quant.velocity_error = vm.count("trajectory-velocity-error") ?
+			vm["trajectory-velocity-error"].as<double>() :
+			quant.position_error;
+		quant.keyframe_every = vm["keyframe-every"].as<uint32_t>();
+		bool compress = quant.position_error > 0.0;
+		writer = new trajectory_writer(vm["trajectory"].as<std::string>(),
+			config.obj_count, config.delta_t, g->gravity(), config.softening,
+			vm["trajectory-buffers"].as<uint32_t>(),
+			vm.count("trajectory-direct") > 0, compress ? &quant : NULL,
+			vm["trajectory-threads"].as<uint32_t>());
+		if(!writer->ok())
+		{
+			g->deinit();
+			delete g;
+			delete writer;
+			return 1;
+		}
+	}
+
+	int ret = 0;
+	if(vm.count("verify"))
+	{
+		ret = g->verify(vm["verify-steps"].as<uint32_t>(),
+			vm["dt"].as<float>());
+	}
+	else if(config.headless)
+	{
+		ret = g->run_headless(vm["steps"].as<uint32_t>(), vm["dt"].as<float>());
+	}
+	else
+	{
+		while(!g->main_loop())
+			g->render();
+	}
+
+	if(vm.count("dump") && g->dump_image(vm["dump"].as<std::string>()))
+		ret = 1;
+
+	// deinit() hands the last snapshots to the writer
 	g->deinit();
-	
+
 	delete g;
-	
-	return 0;
+
+	if(writer)
+	{
+		if(!writer->close())
+			ret = 1;
+		printf("Trajectory: %llu frames written, %llu dropped with every "
+			"buffer queued\n", (unsigned long long)writer->written(),
+			(unsigned long long)writer->dropped());
+		if(vm["trajectory-error"].as<double>() > 0.0 &&
+			writer->stored_bytes() > 0)
+			printf("Trajectory bodies: %.3f MB, %.2fx smaller than raw\n",
+				writer->stored_bytes() * 1.0e-6,
+				(double)writer->raw_bytes() / writer->stored_bytes());
+		delete writer;
+	}
+
+	return ret;
 }
@@ -0,0 +1,162 @@
+#include "morton.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <mutex>
+
+#include "thread_pool.hpp"
+
+typedef std::pair<uint64_t, uint32_t> key_pair;
+
+/**
+ * @brief Stable LSD radix sort of keys by their 63 bit Morton key, 11 bits a
+ * pass
+ *
+ * The keys are cut into one block per chunk of work. Each pass counts the
+ * digits of every block in parallel, turns the counts into where each block's
+ * run of each digit starts and then scatters the blocks in parallel. A pass
+ * where every key has the same digit is skipped, which for bodies that fill
+ * only part of the cube is often the top one or two.
+ */
+static void radix_sort(thread_pool *pool, std::vector<key_pair> &keys,
+	std::vector<key_pair> &tmp)
+{
+	const uint32_t n = (uint32_t)keys.size();
+	if(n < 2048)
+	{
+		std::sort(keys.begin(), keys.end());
+		return;
+	}
+
+	const uint32_t bits = 11;
+	const uint32_t digits = 1u << bits;
+	const uint32_t blocks = std::max(1u, std::min(pool->size() * 4, n / 4096));
+	tmp.resize(n);
+	std::vector<uint32_t> counts((size_t)blocks * digits);
+
+	for(uint32_t shift = 0; shift < 63; shift += bits)
+	{
+		std::fill(counts.begin(), counts.end(), 0);
+		pool->parallel_for(0, blocks, [&](uint32_t begin, uint32_t end)
+		{
+			for(uint32_t b = begin; b < end; b++)
+			{
+				uint32_t *c = counts.data() + (size_t)b * digits;
+				uint32_t e = (uint32_t)((uint64_t)n * (b + 1) / blocks);
+				for(uint32_t i = (uint32_t)((uint64_t)n * b / blocks); i < e;
+					i++)
+					c[(keys[i].first >> shift) & (digits - 1)]++;
+			}
+		}, 1);
+
+		// exclusive prefix sum digit by digit, block by block within a
+		// digit so the scatter keeps the order of equal digits
+		uint32_t sum = 0;
+		bool skip = false;
+		for(uint32_t d = 0; d < digits && !skip; d++)
+		{
+			uint32_t digit_start = sum;
+			for(uint32_t b = 0; b < blocks; b++)
+			{
+				uint32_t &c = counts[(size_t)b * digits + d];
+				uint32_t t = c;
+				c = sum;
+				sum += t;
+			}
+			skip = digit_start == 0 && sum == n;
+		}
+		if(skip)
+			continue;
+
+		pool->parallel_for(0, blocks, [&](uint32_t begin, uint32_t end)
+		{
+			for(uint32_t b = begin; b < end; b++)
+			{
+				uint32_t *c = counts.data() + (size_t)b * digits;
+				uint32_t e = (uint32_t)((uint64_t)n * (b + 1) / blocks);
+				for(uint32_t i = (uint32_t)((uint64_t)n * b / blocks); i < e;
+					i++)
+					tmp[c[(keys[i].first >> shift) & (digits - 1)]++] = keys[i];
+			}
+		}, 1);
+		keys.swap(tmp);
+	}
+}
+
+void morton_order::sort(thread_pool *pool, const particle_soa &src)
+{
+	const uint32_t n = src.size();
+
+	// bounding cube
+	float lo[3] = {INFINITY, INFINITY, INFINITY};
+	float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+	std::mutex bounds_mutex;
+	pool->parallel_for(0, n, [&](uint32_t begin, uint32_t end)
+	{
+		float l[3] = {INFINITY, INFINITY, INFINITY};
+		float h[3] = {-INFINITY, -INFINITY, -INFINITY};
+		for(uint32_t i = begin; i < end; i++)
+		{
+			l[0] = std::min(l[0], src.x[i]);
+			l[1] = std::min(l[1], src.y[i]);
+			l[2] = std::min(l[2], src.z[i]);
+			h[0] = std::max(h[0], src.x[i]);
+			h[1] = std::max(h[1], src.y[i]);
+			h[2] = std::max(h[2], src.z[i]);
+		}
+		std::lock_guard<std::mutex> lock(bounds_mutex);
+		for(int k = 0; k < 3; k++)
+		{
+			lo[k] = std::min(lo[k], l[k]);
+			hi[k] = std::max(hi[k], h[k]);
+		}
+	}, 4096);
+
+	size = std::max(std::max(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+	// pad a little so the furthest body is not on the edge of the cube
+	size = size * 1.0001f + 1.0e-6f;
+	for(int k = 0; k < 3; k++)
+		min_corner[k] = lo[k];
+
+	keys.resize(n);
+	pool->parallel_for(0, n, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+			keys[i] = std::make_pair(morton_key(src.x[i], src.y[i], src.z[i],
+				min_corner[0], min_corner[1], min_corner[2], size), i);
+	}, 4096);
+
+	radix_sort(pool, keys, keys_tmp);
+
+	sorted.resize(n, pool);
+	id.resize(n);
+	pool->parallel_for(0, n, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t k = begin; k < end; k++)
+		{
+			uint32_t i = keys[k].second;
+			id[k] = i;
+			sorted.x[k] = src.x[i];
+			sorted.y[k] = src.y[i];
+			sorted.z[k] = src.z[i];
+			sorted.m[k] = src.m[i];
+		}
+	}, 4096);
+}
+
+void morton_order::split(uint32_t first, uint32_t count, uint32_t level,
+	uint32_t bounds[9]) const
+{
+	const uint32_t shift = 3 * (20 - level);
+	const uint32_t end = first + count;
+	bounds[0] = first;
+	for(uint32_t oct = 0; oct < 8; oct++)
+	{
+		bounds[oct + 1] = (uint32_t)(std::partition_point(
+			keys.begin() + bounds[oct], keys.begin() + end,
+			[&](const std::pair<uint64_t, uint32_t> &k)
+			{
+				return ((k.first >> shift) & 7) <= oct;
+			}) - keys.begin());
+	}
+}
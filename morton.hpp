@@ -0,0 +1,93 @@
+#ifndef MORTON_HPP
+#define MORTON_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "particle_soa.hpp"
+
+class thread_pool;
+
+/**
+ * @brief Spread the low 21 bits of v so there are two zero bits between each
+ */
+inline uint64_t morton_expand(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8) & 0x100f00f00f00f00fULL;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2) & 0x1249249249249249ULL;
+	return v;
+}
+
+/**
+ * @brief 63 bit Z-order key from three 21 bit cell coordinates, x is the
+ * most significant of each bit triple
+ */
+inline uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z)
+{
+	return morton_expand(x) << 2 | morton_expand(y) << 1 | morton_expand(z);
+}
+
+/**
+ * @brief Key of a point inside the cube at (min_x, min_y, min_z) with side
+ * length size
+ */
+inline uint64_t morton_key(float x, float y, float z, float min_x,
+	float min_y, float min_z, float size)
+{
+	const float scale = 2097152.0f / size; // 2^21 cells per axis
+	float fx = (x - min_x) * scale;
+	float fy = (y - min_y) * scale;
+	float fz = (z - min_z) * scale;
+	uint32_t ix = fx <= 0.0f ? 0 : fx >= 2097151.0f ? 2097151 : (uint32_t)fx;
+	uint32_t iy = fy <= 0.0f ? 0 : fy >= 2097151.0f ? 2097151 : (uint32_t)fy;
+	uint32_t iz = fz <= 0.0f ? 0 : fz >= 2097151.0f ? 2097151 : (uint32_t)fz;
+	return morton_encode(ix, iy, iz);
+}
+
+/**
+ * @brief Bodies sorted along a Morton curve through their bounding cube
+ *
+ * The tree codes build their octrees from this, every octree cell is a
+ * contiguous run of the sorted keys.
+ */
+struct morton_order
+{
+	/**
+	 * @brief Cube that holds every body
+	 */
+	float min_corner[3];
+	float size;
+
+	/**
+	 * @brief Sorted keys, second is the body's index in the source arrays
+	 */
+	std::vector<std::pair<uint64_t, uint32_t>> keys;
+	/**
+	 * @brief Scratch space for the radix sort
+	 */
+	std::vector<std::pair<uint64_t, uint32_t>> keys_tmp;
+	/**
+	 * @brief The bodies in key order, id[k] is the source index of sorted
+	 * body k
+	 */
+	particle_soa sorted;
+	std::vector<uint32_t> id;
+
+	/**
+	 * @brief Compute keys for src and radix sort them on the pool, bodies with
+	 * the same key stay in source order
+	 */
+	void sort(thread_pool *pool, const particle_soa &src);
+	/**
+	 * @brief Split the cell of first..first + count at level into its 8
+	 * octants, octant o is bounds[o] to bounds[o + 1]
+	 */
+	void split(uint32_t first, uint32_t count, uint32_t level,
+		uint32_t bounds[9]) const;
+};
+
+#endif
@@ -0,0 +1,667 @@
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <mpi.h>
+#include <boost/program_options.hpp>
+
+#include "cpu_physics.hpp"
+#include "thread_pool.hpp"
+#include "particle_soa.hpp"
+#include "pair_kernel.hpp"
+#include "force_solver.hpp"
+#include "integrator.hpp"
+#include "initial_conditions.hpp"
+
+namespace po = boost::program_options;
+
+/**
+ * @brief The same G as cpu_physics and physics.comp
+ */
+const float G = 6.67408e-11f;
+
+/**
+ * @brief The contiguous range of bodies one rank owns, the first n % ranks
+ * ranks get one extra
+ */
+struct slice
+{
+	uint32_t begin;
+	uint32_t count;
+};
+
+slice slice_of(uint32_t n, int ranks, int rank)
+{
+	uint32_t base = n / ranks, extra = n % ranks;
+	slice s;
+	s.begin = rank * base + std::min((uint32_t)rank, extra);
+	s.count = base + ((uint32_t)rank < extra ? 1 : 0);
+	return s;
+}
+
+/**
+ * @brief The all-pairs RK4 or leapfrog step of cpu_physics with the bodies
+ * split across MPI ranks
+ *
+ * Each rank owns one slice of x, v and m. A force pass is a systolic ring:
+ * every rank starts with its own positions and masses, and for ranks - 1
+ * rounds hands the block it holds to the next rank while summing the forces
+ * of that block on its own bodies. The block for the next round is received
+ * into a second buffer while the current one is being summed, so the
+ * transfer hides behind the pair kernel as long as a block takes longer to
+ * sum than to send.
+ *
+ * Like cpu_physics every RK4 stage sums forces from the positions at the
+ * start of the step, so each stage is one trip round the ring.
+ */
+class ring_physics
+{
+public:
+	ring_physics(thread_pool *pool, simd_level level, MPI_Comm comm);
+
+	/**
+	 * @brief Take this rank's slice of the bodies rank 0 has in x0, v0 and m,
+	 * the arguments are only read on rank 0
+	 */
+	void init(uint32_t obj_count, const std::vector<Eigen::Vector3f> &x0,
+		const std::vector<Eigen::Vector3f> &v0, const std::vector<float> &m);
+	void set_integrator(integrator_type type) { integrator = type; }
+	void step(float delta_t);
+	/**
+	 * @brief One force pass round the ring at the current positions, a is
+	 * this rank's slice
+	 */
+	void accel(vec3_soa &a);
+
+	/**
+	 * @brief Collect every rank's positions and velocities on rank 0
+	 */
+	void gather(std::vector<Eigen::Vector3f> &x_all,
+		std::vector<Eigen::Vector3f> &v_all) const;
+	/**
+	 * @brief Collect every rank's slice of part on rank 0
+	 */
+	void gather(const vec3_soa &part, std::vector<Eigen::Vector3f> &all) const;
+
+	/**
+	 * @brief Interactions summed by this rank in the last step
+	 */
+	uint64_t interactions_per_step() const { return last_interactions; }
+	/**
+	 * @brief Seconds spent waiting for blocks that were not there yet since
+	 * the last call
+	 */
+	double take_wait_time();
+
+private:
+	/**
+	 * @brief Acceleration at this rank's count points in q from every body on
+	 * every rank at the positions in x
+	 */
+	void ring_accel(const particle_soa &x, const vec3_soa &q, vec3_soa &a);
+	/**
+	 * @brief Add the pull of block on the points in q to a, call MPI_Testall
+	 * on the reqs between chunks so the transfers keep moving
+	 */
+	void sum_block(const particle_soa &block, const vec3_soa &q,
+		const uint32_t *skip, vec3_soa &a, MPI_Request *reqs, int req_count);
+	void step_rk4(float delta_t);
+	void step_leapfrog(float delta_t);
+
+	thread_pool *pool;
+	pair_kernel kernel;
+	MPI_Comm comm;
+	int rank, ranks;
+	std::vector<slice> slices;
+
+	integrator_type integrator;
+	uint32_t count;
+	particle_soa x;
+	vec3_soa v;
+	bool accel_valid;
+
+	// the block being summed and the one arriving
+	particle_soa blocks[2];
+	vec3_soa xk, ak[4], partial;
+	// body i of the own block skips i, a foreign block skips nothing
+	std::vector<uint32_t> own_ids, no_ids;
+
+	uint64_t last_interactions;
+	double wait_time;
+};
+
+ring_physics::ring_physics(thread_pool *pool, simd_level level,
+	MPI_Comm comm)
+{
+	this->pool = pool;
+	this->comm = comm;
+	kernel = select_pair_kernel(level);
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &ranks);
+	integrator = integrator_type::rk4;
+	count = 0;
+	accel_valid = false;
+	last_interactions = 0;
+	wait_time = 0.0;
+}
+
+void ring_physics::init(uint32_t obj_count,
+	const std::vector<Eigen::Vector3f> &x0,
+	const std::vector<Eigen::Vector3f> &v0, const std::vector<float> &m)
+{
+	slices.resize(ranks);
+	std::vector<int> counts(ranks), displs(ranks);
+	uint32_t max_count = 0;
+	for(int r = 0; r < ranks; r++)
+	{
+		slices[r] = slice_of(obj_count, ranks, r);
+		counts[r] = (int)slices[r].count;
+		displs[r] = (int)slices[r].begin;
+		max_count = std::max(max_count, slices[r].count);
+	}
+	count = slices[rank].count;
+
+	// rank 0 splits its AoS arrays into one SoA array per component
+	particle_soa x_all;
+	vec3_soa v_all;
+	if(rank == 0)
+	{
+		x_all.resize(obj_count);
+		x_all.from_aos(x0);
+		x_all.m.assign(m.begin(), m.end());
+		v_all.resize(obj_count);
+		v_all.from_aos(v0);
+	}
+
+	x.resize(count, pool);
+	v.resize(count, pool);
+	float *const send[] = {x_all.x.data(), x_all.y.data(), x_all.z.data(),
+		x_all.m.data(), v_all.x.data(), v_all.y.data(), v_all.z.data()};
+	float *const recv[] = {x.x.data(), x.y.data(), x.z.data(), x.m.data(),
+		v.x.data(), v.y.data(), v.z.data()};
+	for(int i = 0; i < 7; i++)
+	{
+		MPI_Scatterv(send[i], counts.data(), displs.data(), MPI_FLOAT,
+			recv[i], (int)count, MPI_FLOAT, 0, comm);
+	}
+
+	// reserve the largest slice so the blocks never reallocate under a
+	// pending receive
+	for(particle_soa &b : blocks)
+	{
+		b.resize(max_count, pool);
+		b.resize(count);
+	}
+	xk.resize(count, pool);
+	for(vec3_soa &a : ak)
+		a.resize(count, pool);
+	partial.resize(count, pool);
+
+	own_ids.resize(count);
+	for(uint32_t i = 0; i < count; i++)
+		own_ids[i] = i;
+	no_ids.assign(count, 0xffffffffu);
+	accel_valid = false;
+}
+
+void ring_physics::step(float delta_t)
+{
+	if(integrator == integrator_type::leapfrog)
+		step_leapfrog(delta_t);
+	else
+		step_rk4(delta_t);
+}
+
+void ring_physics::sum_block(const particle_soa &block, const vec3_soa &q,
+	const uint32_t *skip, vec3_soa &a, MPI_Request *reqs, int req_count)
+{
+	// small enough that the transfers get poked often, MPI only moves data
+	// on this thread from inside MPI calls
+	const uint32_t chunk = 4096;
+	for(uint32_t c = 0; c < count; c += chunk)
+	{
+		uint32_t c_end = std::min(count, c + chunk);
+		pool->parallel_for(c, c_end, [&](uint32_t begin, uint32_t end)
+		{
+			kernel(q.x.data() + begin, q.y.data() + begin, q.z.data() + begin,
+				skip + begin, end - begin, block, G, partial.x.data() + begin,
+				partial.y.data() + begin, partial.z.data() + begin);
+			for(uint32_t i = begin; i < end; i++)
+			{
+				a.x[i] += partial.x[i];
+				a.y[i] += partial.y[i];
+				a.z[i] += partial.z[i];
+			}
+		}, 64);
+
+		if(req_count > 0)
+		{
+			int done;
+			MPI_Testall(req_count, reqs, &done, MPI_STATUSES_IGNORE);
+		}
+	}
+}
+
+void ring_physics::ring_accel(const particle_soa &x, const vec3_soa &q,
+	vec3_soa &a)
+{
+	const int right = (rank + 1) % ranks;
+	const int left = (rank + ranks - 1) % ranks;
+
+	std::fill(a.x.begin(), a.x.end(), 0.0f);
+	std::fill(a.y.begin(), a.y.end(), 0.0f);
+	std::fill(a.z.begin(), a.z.end(), 0.0f);
+
+	// round 0 is this rank's own block, which skips the self term
+	particle_soa *cur = &blocks[0], *nxt = &blocks[1];
+	cur->resize(count);
+	std::copy(x.x.begin(), x.x.end(), cur->x.begin());
+	std::copy(x.y.begin(), x.y.end(), cur->y.begin());
+	std::copy(x.z.begin(), x.z.end(), cur->z.begin());
+	std::copy(x.m.begin(), x.m.end(), cur->m.begin());
+
+	for(int round = 0; round < ranks; round++)
+	{
+		MPI_Request reqs[8];
+		int req_count = 0;
+		if(round + 1 < ranks)
+		{
+			// the block after this one started on the rank round + 1 to the
+			// left
+			int owner = (rank + ranks - round - 1) % ranks;
+			uint32_t n_in = slices[owner].count;
+			uint32_t n_out = cur->size();
+			nxt->resize(n_in);
+			float *const in[] = {nxt->x.data(), nxt->y.data(), nxt->z.data(),
+				nxt->m.data()};
+			const float *const out[] = {cur->x.data(), cur->y.data(),
+				cur->z.data(), cur->m.data()};
+			for(int i = 0; i < 4; i++)
+			{
+				MPI_Irecv(in[i], (int)n_in, MPI_FLOAT, left, i, comm,
+					&reqs[req_count++]);
+				MPI_Isend(out[i], (int)n_out, MPI_FLOAT, right, i, comm,
+					&reqs[req_count++]);
+			}
+		}
+
+		sum_block(*cur, q, round == 0 ? own_ids.data() : no_ids.data(), a,
+			reqs, req_count);
+		last_interactions += (uint64_t)count * cur->size() -
+			(round == 0 ? count : 0);
+
+		if(req_count > 0)
+		{
+			double t = MPI_Wtime();
+			MPI_Waitall(req_count, reqs, MPI_STATUSES_IGNORE);
+			wait_time += MPI_Wtime() - t;
+		}
+		std::swap(cur, nxt);
+	}
+}
+
+void ring_physics::step_leapfrog(float delta_t)
+{
+	vec3_soa &a = ak[0];
+	const float h = 0.5f * delta_t;
+
+	last_interactions = 0;
+
+	// only the first step after init needs the acceleration at x0
+	if(!accel_valid)
+	{
+		ring_accel(x, x, a);
+		accel_valid = true;
+	}
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f v_half = v.get(i) + h * a.get(i);
+			v.set(i, v_half);
+			x.set(i, x.get(i) + delta_t * v_half);
+		}
+	}, 1024);
+
+	ring_accel(x, x, a);
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+			v.set(i, v.get(i) + h * a.get(i));
+	}, 1024);
+}
+
+void ring_physics::step_rk4(float delta_t)
+{
+	const float h = 0.5f * delta_t;
+
+	last_interactions = 0;
+
+	ring_accel(x, x, ak[0]);
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+			xk.set(i, x.get(i) + h * v.get(i));
+	}, 1024);
+	ring_accel(x, xk, ak[1]);
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f vk2 = v.get(i) + h * ak[0].get(i);
+			xk.set(i, x.get(i) + h * vk2);
+		}
+	}, 1024);
+	ring_accel(x, xk, ak[2]);
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f vk3 = v.get(i) + h * ak[1].get(i);
+			xk.set(i, x.get(i) + delta_t * vk3);
+		}
+	}, 1024);
+	ring_accel(x, xk, ak[3]);
+
+	pool->parallel_for(0, count, [&](uint32_t begin, uint32_t end)
+	{
+		for(uint32_t i = begin; i < end; i++)
+		{
+			Eigen::Vector3f vk1 = v.get(i);
+			Eigen::Vector3f vk2 = vk1 + h * ak[0].get(i);
+			Eigen::Vector3f vk3 = vk1 + h * ak[1].get(i);
+			Eigen::Vector3f vk4 = vk1 + delta_t * ak[2].get(i);
+
+			v.set(i, vk1 + (delta_t / 6.0f) * (ak[0].get(i) +
+				2 * ak[1].get(i) + 2 * ak[2].get(i) + ak[3].get(i)));
+			x.set(i, x.get(i) + (delta_t / 6.0f) *
+				(vk1 + 2 * vk2 + 2 * vk3 + vk4));
+		}
+	}, 1024);
+}
+
+void ring_physics::accel(vec3_soa &a)
+{
+	a.resize(count, pool);
+	ring_accel(x, x, a);
+}
+
+void ring_physics::gather(std::vector<Eigen::Vector3f> &x_all,
+	std::vector<Eigen::Vector3f> &v_all) const
+{
+	gather(x, x_all);
+	gather(v, v_all);
+}
+
+void ring_physics::gather(const vec3_soa &part,
+	std::vector<Eigen::Vector3f> &all) const
+{
+	std::vector<int> counts(ranks), displs(ranks);
+	uint32_t total = 0;
+	for(int r = 0; r < ranks; r++)
+	{
+		counts[r] = (int)slices[r].count;
+		displs[r] = (int)slices[r].begin;
+		total += slices[r].count;
+	}
+
+	vec3_soa out;
+	if(rank == 0)
+		out.resize(total);
+	const float *const send[] = {part.x.data(), part.y.data(), part.z.data()};
+	float *const recv[] = {out.x.data(), out.y.data(), out.z.data()};
+	for(int i = 0; i < 3; i++)
+	{
+		MPI_Gatherv(send[i], (int)count, MPI_FLOAT, recv[i], counts.data(),
+			displs.data(), MPI_FLOAT, 0, comm);
+	}
+
+	if(rank == 0)
+		out.to_aos(all);
+}
+
+double ring_physics::take_wait_time()
+{
+	double t = wait_time;
+	wait_time = 0.0;
+	return t;
+}
+
+/**
+ * @brief Compare the ring's first force pass with an all-pairs sum on one
+ * rank, then the ring's steps with the same steps run by cpu_physics, the
+ * same check and tolerance as gfx::verify()
+ *
+ * The force pass only differs by the order the blocks are summed in, so it is
+ * held to a much tighter tolerance. Over more than a few steps a close pair
+ * grows that rounding chaotically, which is why the steps are kept short.
+ */
+bool verify(const std::vector<Eigen::Vector3f> &x0,
+	const std::vector<Eigen::Vector3f> &v0, const std::vector<float> &m,
+	const std::vector<Eigen::Vector3f> &ring_a,
+	const std::vector<Eigen::Vector3f> &ring_x,
+	const std::vector<Eigen::Vector3f> &ring_v, integrator_type integrator,
+	uint32_t steps, float delta_t, simd_level level, thread_pool *pool)
+{
+	const uint32_t n = (uint32_t)x0.size();
+	particle_soa src;
+	src.resize(n);
+	src.from_aos(x0);
+	src.m.assign(m.begin(), m.end());
+	std::vector<uint32_t> ids(n);
+	for(uint32_t i = 0; i < n; i++)
+		ids[i] = i;
+	vec3_soa ref;
+	ref.resize(n);
+	direct_solver direct(pool, level);
+	direct.prepare(src, G);
+	direct.accel(src, ids.data(), n, ref);
+
+	float max_a = 0.0f, err_a = 0.0f;
+	for(uint32_t i = 0; i < n; i++)
+	{
+		max_a = std::max(max_a, ref.get(i).norm());
+		err_a = std::max(err_a, (ring_a[i] - ref.get(i)).norm());
+	}
+	if(max_a > 0.0f)
+		err_a /= max_a;
+
+	cpu_physics reference(pool);
+	reference.set_integrator(integrator);
+	reference.init(x0, v0, m);
+	for(uint32_t i = 0; i < steps; i++)
+		reference.step(delta_t);
+
+	std::vector<Eigen::Vector3f> cpu_x, cpu_v;
+	reference.state_by_id(cpu_x, cpu_v);
+
+	float max_v = 0.0f, max_dx = 0.0f, err_v = 0.0f, err_x = 0.0f;
+	for(size_t i = 0; i < x0.size(); i++)
+	{
+		max_v = std::max(max_v, cpu_v[i].norm());
+		max_dx = std::max(max_dx, (cpu_x[i] - x0[i]).norm());
+		err_v = std::max(err_v, (ring_v[i] - cpu_v[i]).norm());
+		err_x = std::max(err_x, (ring_x[i] - cpu_x[i]).norm());
+	}
+	// nothing moved with --verify-steps=0, and then nothing can be off
+	if(max_v > 0.0f)
+		err_v /= max_v;
+	if(max_dx > 0.0f)
+		err_x /= max_dx;
+
+	const float force_tolerance = 1.0e-5f;
+	const float tolerance = 1.0e-3f;
+	bool pass = err_a < force_tolerance && err_v < tolerance &&
+		err_x < tolerance;
+	printf("Max force error:        %.3e\n", err_a);
+	printf("Max velocity error:     %.3e\n", err_v);
+	printf("Max displacement error: %.3e\n", err_x);
+	printf("%s\n", pass ? "PASS" : "FAIL");
+	return pass;
+}
+
+int run(int argc, char **argv, int rank, int ranks)
+{
+	po::options_description desc("Options");
+	desc.add_options()
+		("help,h", "print this help")
+		("count,n", po::value<uint32_t>()->default_value(4096),
+			"number of bodies across all ranks")
+		("steps,s", po::value<uint32_t>()->default_value(100),
+			"number of steps to run")
+		("threads,t", po::value<uint32_t>()->default_value(0),
+			"worker threads per rank, 0 for one per logical core")
+		("pin", "pin each worker thread to its own CPU out of the ones the "
+			"rank may use, give every rank its own CPUs first (Linux)")
+		("integrator", po::value<std::string>()->default_value("rk4"),
+			"rk4 or leapfrog")
+		("dt", po::value<float>()->default_value(1.0f / 60.0f),
+			"time step in seconds")
+		("kernel", po::value<std::string>()->default_value("auto"),
+			"pair kernel: auto, scalar, avx2 or avx512")
+		("seed", po::value<uint64_t>()->default_value(1),
+			"random seed for the initial conditions")
+		("verify", "after the timed run, compare the ring's first force "
+			"pass from the same bodies with an all-pairs sum on rank 0 alone, "
+			"then --verify-steps steps with cpu_physics")
+		("verify-steps", po::value<uint32_t>()->default_value(1),
+			"steps --verify runs, keep it to a few: the ring sums in a "
+			"different order and over longer runs a close pair grows the "
+			"rounding chaotically past the 1e-3 tolerance");
+
+	po::variables_map vm;
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	}
+	catch(const po::error &e)
+	{
+		if(rank == 0)
+			std::cout << "ERROR: " << e.what() << "\n" << desc << std::endl;
+		return 1;
+	}
+
+	if(vm.count("help"))
+	{
+		if(rank == 0)
+			std::cout << desc << std::endl;
+		return 0;
+	}
+
+	integrator_type integrator;
+	simd_level level;
+	if(!parse_integrator(vm["integrator"].as<std::string>(), integrator) ||
+		integrator == integrator_type::block)
+	{
+		if(rank == 0)
+			std::cout << "ERROR: --integrator has to be rk4 or leapfrog"
+				<< std::endl;
+		return 1;
+	}
+	if(!parse_simd(vm["kernel"].as<std::string>(), level))
+	{
+		if(rank == 0)
+			std::cout << "ERROR: unknown kernel "
+				<< vm["kernel"].as<std::string>() << std::endl;
+		return 1;
+	}
+
+	uint32_t obj_count = vm["count"].as<uint32_t>();
+	uint32_t steps = vm["steps"].as<uint32_t>();
+	float delta_t = vm["dt"].as<float>();
+
+	thread_pool pool(vm["threads"].as<uint32_t>(), vm.count("pin") > 0);
+
+	// only rank 0 ever holds every body, the rest only see their slice and
+	// the block passing through
+	std::vector<Eigen::Vector3f> x_aos[2], v_aos[2];
+	std::vector<float> m;
+	if(rank == 0)
+	{
+		std::mt19937_64 generator(vm["seed"].as<uint64_t>());
+		random_cube(generator, obj_count, x_aos, v_aos, m);
+	}
+
+	ring_physics physics(&pool, level, MPI_COMM_WORLD);
+	physics.set_integrator(integrator);
+	physics.init(obj_count, x_aos[0], v_aos[0], m);
+
+	if(rank == 0)
+	{
+		printf("MPI ring: %u bodies, %u %s steps, %d ranks, %u threads per "
+			"rank, %s kernel\n", obj_count, steps, integrator_name(integrator),
+			ranks, pool.size(), simd_name(level));
+	}
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	double start = MPI_Wtime();
+	for(uint32_t i = 0; i < steps; i++)
+		physics.step(delta_t);
+	MPI_Barrier(MPI_COMM_WORLD);
+	double run_time = MPI_Wtime() - start;
+
+	uint64_t local = physics.interactions_per_step(), total = 0;
+	MPI_Reduce(&local, &total, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	double wait = physics.take_wait_time(), max_wait = 0.0;
+	MPI_Reduce(&wait, &max_wait, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+	if(rank == 0)
+	{
+		printf("%u steps in %.3f s (%.3f steps/s, %.4g interactions/s)\n",
+			steps, run_time, steps / run_time, (double)total * steps / run_time);
+		// time the pair kernel did not cover, 0 when the ring is fully
+		// overlapped
+		printf("Most time a rank waited on the ring: %.3f s (%.1f%%)\n",
+			max_wait, 100.0 * max_wait / run_time);
+	}
+
+	int ret = 0;
+	if(vm.count("verify"))
+	{
+		// from the start again, the timed run may be far too long to compare
+		uint32_t verify_steps = vm["verify-steps"].as<uint32_t>();
+		physics.init(obj_count, x_aos[0], v_aos[0], m);
+		vec3_soa a;
+		std::vector<Eigen::Vector3f> ring_a, ring_x, ring_v;
+		physics.accel(a);
+		physics.gather(a, ring_a);
+		for(uint32_t i = 0; i < verify_steps; i++)
+			physics.step(delta_t);
+		physics.gather(ring_x, ring_v);
+		if(rank == 0)
+		{
+			printf("Verifying the first force pass and %u steps against one "
+				"rank\n", verify_steps);
+			ret = verify(x_aos[0], v_aos[0], m, ring_a, ring_x, ring_v,
+				integrator, verify_steps, delta_t, level, &pool) ? 0 : 1;
+		}
+		MPI_Bcast(&ret, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	// only the main thread calls MPI, the thread_pool workers never do
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+
+	int rank, ranks;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+	int ret = run(argc, argv, rank, ranks);
+
+	MPI_Finalize();
+	return ret;
+}
@@ -0,0 +1,185 @@
+#include "pair_kernel.hpp"
+
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+#include "particle_soa.hpp"
+
+#if defined(HAVE_X86_SIMD) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+void accel_scalar(const float *qx, const float *qy, const float *qz,
+	const uint32_t *ids, uint32_t count, const particle_soa &src, float G,
+	float *ax, float *ay, float *az)
+{
+	const uint32_t n = src.size();
+	const float *sx = src.x.data();
+	const float *sy = src.y.data();
+	const float *sz = src.z.data();
+	const float *sm = src.m.data();
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		float px = qx[i], py = qy[i], pz = qz[i];
+		float a_x = 0.0f, a_y = 0.0f, a_z = 0.0f;
+		uint32_t skip = ids[i];
+
+		for(uint32_t j = 0; j < n; j++)
+		{
+			if(j == skip)
+				continue;
+
+			float dx = sx[j] - px;
+			float dy = sy[j] - py;
+			float dz = sz[j] - pz;
+			float d2 = dx * dx + dy * dy + dz * dz;
+			float inv = 1.0f / std::sqrt(d2);
+			float s = sm[j] * inv * inv * inv;
+
+			a_x += dx * s;
+			a_y += dy * s;
+			a_z += dz * s;
+		}
+
+		ax[i] = G * a_x;
+		ay[i] = G * a_y;
+		az[i] = G * a_z;
+	}
+}
+
+void sym_tile_scalar(const particle_soa &src, uint32_t i_begin,
+	uint32_t j_begin, uint32_t tile, float *ax, float *ay, float *az)
+{
+	const float *sx = src.x.data();
+	const float *sy = src.y.data();
+	const float *sz = src.z.data();
+	const float *sm = src.m.data();
+	const bool same = i_begin == j_begin;
+
+	for(uint32_t i = i_begin; i < i_begin + tile; i++)
+	{
+		float px = sx[i], py = sy[i], pz = sz[i], pm = sm[i];
+		float a_x = 0.0f, a_y = 0.0f, a_z = 0.0f;
+
+		for(uint32_t j = same ? i + 1 : j_begin; j < j_begin + tile; j++)
+		{
+			float dx = sx[j] - px;
+			float dy = sy[j] - py;
+			float dz = sz[j] - pz;
+			float d2 = dx * dx + dy * dy + dz * dz;
+			float inv = 1.0f / std::sqrt(d2);
+			float inv3 = inv * inv * inv;
+			float sj = sm[j] * inv3;
+			float si = pm * inv3;
+
+			a_x += dx * sj;
+			a_y += dy * sj;
+			a_z += dz * sj;
+			ax[j] -= dx * si;
+			ay[j] -= dy * si;
+			az[j] -= dz * si;
+		}
+
+		ax[i] += a_x;
+		ay[i] += a_y;
+		az[i] += a_z;
+	}
+}
+
+simd_level detect_simd()
+{
+#ifdef HAVE_X86_SIMD
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	if(!osxsave || max_leaf < 7)
+		return simd_level::scalar;
+	// the OS has to save the ymm (and for AVX-512 the zmm and mask) state
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+	bool avx512 = (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+	if(avx512)
+		return simd_level::avx512;
+	if(avx2)
+		return simd_level::avx2;
+#else
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		return simd_level::avx512;
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return simd_level::avx2;
+#endif
+#endif
+	return simd_level::scalar;
+}
+
+const char *simd_name(simd_level level)
+{
+	switch(level)
+	{
+		case simd_level::avx2:
+			return "avx2";
+		case simd_level::avx512:
+			return "avx512";
+		default:
+			return "scalar";
+	}
+}
+
+bool parse_simd(const std::string &name, simd_level &level)
+{
+	if(name == "auto")
+		level = detect_simd();
+	else if(name == "scalar")
+		level = simd_level::scalar;
+	else if(name == "avx2")
+		level = simd_level::avx2;
+	else if(name == "avx512")
+		level = simd_level::avx512;
+	else
+		return false;
+
+	simd_level supported = detect_simd();
+	if(level > supported)
+	{
+		printf("%s is not supported by this CPU or build, using %s\n",
+			simd_name(level), simd_name(supported));
+		level = supported;
+	}
+	return true;
+}
+
+pair_kernel select_pair_kernel(simd_level level)
+{
+	// a kernel the CPU lacks dies on its first instruction
+	level = std::min(level, detect_simd());
+#ifdef HAVE_X86_SIMD
+	if(level == simd_level::avx512)
+		return accel_avx512;
+	if(level == simd_level::avx2)
+		return accel_avx2;
+#else
+	(void)level;
+#endif
+	return accel_scalar;
+}
+
+sym_tile_kernel select_sym_tile_kernel(simd_level level)
+{
+	level = std::min(level, detect_simd());
+#ifdef HAVE_X86_SIMD
+	if(level == simd_level::avx512)
+		return sym_tile_avx512;
+	if(level == simd_level::avx2)
+		return sym_tile_avx2;
+#else
+	(void)level;
+#endif
+	return sym_tile_scalar;
+}
@@ -0,0 +1,78 @@
+#ifndef PAIR_KERNEL_HPP
+#define PAIR_KERNEL_HPP
+
+#include <cstdint>
+#include <string>
+
+struct particle_soa;
+
+/**
+ * @brief All-pairs acceleration kernel
+ *
+ * Writes the acceleration at each of the count query points (qx, qy, qz) due
+ * to every body in src into ax, ay and az. Query point i skips the body at
+ * index ids[i] in src so a body never pulls on itself.
+ */
+typedef void (*pair_kernel)(const float *qx, const float *qy, const float *qz,
+	const uint32_t *ids, uint32_t count, const particle_soa &src, float G,
+	float *ax, float *ay, float *az);
+
+/**
+ * @brief Symmetric all-pairs kernel over one pair of tiles
+ *
+ * Adds the acceleration without the factor G that the tile bodies from
+ * j_begin put on the tile bodies from i_begin to ax, ay and az, and the equal
+ * and opposite pull back on the j tile, so each pair is only evaluated once.
+ * When i_begin == j_begin only the pairs i < j inside the tile are evaluated.
+ * tile has to be a multiple of 32 and no two bodies in src can be at the
+ * same position.
+ */
+typedef void (*sym_tile_kernel)(const particle_soa &src, uint32_t i_begin,
+	uint32_t j_begin, uint32_t tile, float *ax, float *ay, float *az);
+
+enum class simd_level
+{
+	scalar,
+	avx2,
+	avx512
+};
+
+/**
+ * @brief The widest instruction set both the CPU and this build support
+ */
+simd_level detect_simd();
+const char *simd_name(simd_level level);
+/**
+ * @brief Parse "auto", "scalar", "avx2" or "avx512", returns false if the name
+ * is unknown. A level detect_simd() does not reach is lowered to it with a
+ * note.
+ */
+bool parse_simd(const std::string &name, simd_level &level);
+
+/**
+ * @brief The kernel for level, falls back to the next narrower one both this
+ * build and the CPU have
+ */
+pair_kernel select_pair_kernel(simd_level level);
+sym_tile_kernel select_sym_tile_kernel(simd_level level);
+
+void accel_scalar(const float *qx, const float *qy, const float *qz,
+	const uint32_t *ids, uint32_t count, const particle_soa &src, float G,
+	float *ax, float *ay, float *az);
+void sym_tile_scalar(const particle_soa &src, uint32_t i_begin,
+	uint32_t j_begin, uint32_t tile, float *ax, float *ay, float *az);
+
+#ifdef HAVE_X86_SIMD
+void accel_avx2(const float *qx, const float *qy, const float *qz,
+	const uint32_t *ids, uint32_t count, const particle_soa &src, float G,
+	float *ax, float *ay, float *az);
+void accel_avx512(const float *qx, const float *qy, const float *qz,
+	const uint32_t *ids, uint32_t count, const particle_soa &src, float G,
+	float *ax, float *ay, float *az);
+void sym_tile_avx2(const particle_soa &src, uint32_t i_begin,
+	uint32_t j_begin, uint32_t tile, float *ax, float *ay, float *az);
+void sym_tile_avx512(const particle_soa &src, uint32_t i_begin,
+	uint32_t j_begin, uint32_t tile, float *ax, float *ay, float *az);
+#endif
+
+#endif
@@ -0,0 +1,183 @@
+#include "pair_kernel.hpp"
+
+#ifdef HAVE_X86_SIMD
+
+#include <immintrin.h>
+
+#include "particle_soa.hpp"
+
+// 1/sqrt(d2) from the 12 bit estimate plus one Newton-Raphson step
+static inline __m256 rsqrt_nr(__m256 d2)
+{
+	__m256 y = _mm256_rsqrt_ps(d2);
+	__m256 yy = _mm256_mul_ps(y, y);
+	__m256 t = _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), d2), yy,
+		_mm256_set1_ps(1.5f));
+	return _mm256_mul_ps(y, t);
+}
+
+void accel_avx2(const float *qx, const float *qy, const float *qz,
+	const uint32_t *ids, uint32_t count, const particle_soa &src, float G,
+	float *ax, float *ay, float *az)
+{
+	const uint32_t n = src.size();
+	const float *sx = src.x.data();
+	const float *sy = src.y.data();
+	const float *sz = src.z.data();
+	const float *sm = src.m.data();
+	const __m256 g = _mm256_set1_ps(G);
+
+	// 16 query points per pass, two independent accumulator chains hide the
+	// FMA latency
+	uint32_t i = 0;
+	for(; i + 16 <= count; i += 16)
+	{
+		__m256 px0 = _mm256_loadu_ps(qx + i);
+		__m256 py0 = _mm256_loadu_ps(qy + i);
+		__m256 pz0 = _mm256_loadu_ps(qz + i);
+		__m256 px1 = _mm256_loadu_ps(qx + i + 8);
+		__m256 py1 = _mm256_loadu_ps(qy + i + 8);
+		__m256 pz1 = _mm256_loadu_ps(qz + i + 8);
+		__m256i id0 = _mm256_loadu_si256((const __m256i *)(ids + i));
+		__m256i id1 = _mm256_loadu_si256((const __m256i *)(ids + i + 8));
+
+		__m256 ax0 = _mm256_setzero_ps(), ay0 = _mm256_setzero_ps();
+		__m256 az0 = _mm256_setzero_ps(), ax1 = _mm256_setzero_ps();
+		__m256 ay1 = _mm256_setzero_ps(), az1 = _mm256_setzero_ps();
+
+		for(uint32_t j = 0; j < n; j++)
+		{
+			__m256 bx = _mm256_set1_ps(sx[j]);
+			__m256 by = _mm256_set1_ps(sy[j]);
+			__m256 bz = _mm256_set1_ps(sz[j]);
+			__m256 bm = _mm256_set1_ps(sm[j]);
+			__m256i bj = _mm256_set1_epi32((int)j);
+
+			__m256 dx0 = _mm256_sub_ps(bx, px0);
+			__m256 dy0 = _mm256_sub_ps(by, py0);
+			__m256 dz0 = _mm256_sub_ps(bz, pz0);
+			__m256 dx1 = _mm256_sub_ps(bx, px1);
+			__m256 dy1 = _mm256_sub_ps(by, py1);
+			__m256 dz1 = _mm256_sub_ps(bz, pz1);
+
+			__m256 d20 = _mm256_fmadd_ps(dx0, dx0,
+				_mm256_fmadd_ps(dy0, dy0, _mm256_mul_ps(dz0, dz0)));
+			__m256 d21 = _mm256_fmadd_ps(dx1, dx1,
+				_mm256_fmadd_ps(dy1, dy1, _mm256_mul_ps(dz1, dz1)));
+
+			__m256 inv0 = rsqrt_nr(d20);
+			__m256 inv1 = rsqrt_nr(d21);
+			__m256 s0 = _mm256_mul_ps(_mm256_mul_ps(inv0, inv0),
+				_mm256_mul_ps(inv0, bm));
+			__m256 s1 = _mm256_mul_ps(_mm256_mul_ps(inv1, inv1),
+				_mm256_mul_ps(inv1, bm));
+
+			// the self term is inf or nan, clear it with a mask
+			s0 = _mm256_andnot_ps(
+				_mm256_castsi256_ps(_mm256_cmpeq_epi32(id0, bj)), s0);
+			s1 = _mm256_andnot_ps(
+				_mm256_castsi256_ps(_mm256_cmpeq_epi32(id1, bj)), s1);
+
+			ax0 = _mm256_fmadd_ps(dx0, s0, ax0);
+			ay0 = _mm256_fmadd_ps(dy0, s0, ay0);
+			az0 = _mm256_fmadd_ps(dz0, s0, az0);
+			ax1 = _mm256_fmadd_ps(dx1, s1, ax1);
+			ay1 = _mm256_fmadd_ps(dy1, s1, ay1);
+			az1 = _mm256_fmadd_ps(dz1, s1, az1);
+		}
+
+		_mm256_storeu_ps(ax + i, _mm256_mul_ps(g, ax0));
+		_mm256_storeu_ps(ay + i, _mm256_mul_ps(g, ay0));
+		_mm256_storeu_ps(az + i, _mm256_mul_ps(g, az0));
+		_mm256_storeu_ps(ax + i + 8, _mm256_mul_ps(g, ax1));
+		_mm256_storeu_ps(ay + i + 8, _mm256_mul_ps(g, ay1));
+		_mm256_storeu_ps(az + i + 8, _mm256_mul_ps(g, az1));
+	}
+
+	if(i < count)
+		accel_scalar(qx + i, qy + i, qz + i, ids + i, count - i, src, G,
+			ax + i, ay + i, az + i);
+}
+
+// one block of 8 j bodies against the block of 8 i bodies from i, the j block
+// turns one lane at a time so after 8 turns every i has met every j once and
+// the j lanes are back where they started. Unlike the AVX-512 kernel there
+// are too few registers to share a turn between two i blocks.
+static inline void sym_block(const particle_soa &src, uint32_t i, uint32_t j,
+	float *ax, float *ay, float *az)
+{
+	// lane k takes lane k + 1, the j accumulators travel with their bodies
+	const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+
+	__m256 px = _mm256_loadu_ps(src.x.data() + i);
+	__m256 py = _mm256_loadu_ps(src.y.data() + i);
+	__m256 pz = _mm256_loadu_ps(src.z.data() + i);
+	__m256 pm = _mm256_loadu_ps(src.m.data() + i);
+	__m256 a_x = _mm256_setzero_ps(), a_y = _mm256_setzero_ps();
+	__m256 a_z = _mm256_setzero_ps();
+
+	__m256 bx = _mm256_loadu_ps(src.x.data() + j);
+	__m256 by = _mm256_loadu_ps(src.y.data() + j);
+	__m256 bz = _mm256_loadu_ps(src.z.data() + j);
+	__m256 bm = _mm256_loadu_ps(src.m.data() + j);
+	__m256 bax = _mm256_loadu_ps(ax + j);
+	__m256 bay = _mm256_loadu_ps(ay + j);
+	__m256 baz = _mm256_loadu_ps(az + j);
+
+	for(uint32_t r = 0; r < 8; r++)
+	{
+		__m256 dx = _mm256_sub_ps(bx, px);
+		__m256 dy = _mm256_sub_ps(by, py);
+		__m256 dz = _mm256_sub_ps(bz, pz);
+		__m256 d2 = _mm256_fmadd_ps(dx, dx,
+			_mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+		__m256 inv = rsqrt_nr(d2);
+		__m256 inv3 = _mm256_mul_ps(_mm256_mul_ps(inv, inv), inv);
+		__m256 sj = _mm256_mul_ps(bm, inv3);
+		__m256 si = _mm256_mul_ps(pm, inv3);
+
+		a_x = _mm256_fmadd_ps(dx, sj, a_x);
+		a_y = _mm256_fmadd_ps(dy, sj, a_y);
+		a_z = _mm256_fmadd_ps(dz, sj, a_z);
+		bax = _mm256_fnmadd_ps(dx, si, bax);
+		bay = _mm256_fnmadd_ps(dy, si, bay);
+		baz = _mm256_fnmadd_ps(dz, si, baz);
+
+		bx = _mm256_permutevar8x32_ps(bx, rot);
+		by = _mm256_permutevar8x32_ps(by, rot);
+		bz = _mm256_permutevar8x32_ps(bz, rot);
+		bm = _mm256_permutevar8x32_ps(bm, rot);
+		bax = _mm256_permutevar8x32_ps(bax, rot);
+		bay = _mm256_permutevar8x32_ps(bay, rot);
+		baz = _mm256_permutevar8x32_ps(baz, rot);
+	}
+
+	_mm256_storeu_ps(ax + j, bax);
+	_mm256_storeu_ps(ay + j, bay);
+	_mm256_storeu_ps(az + j, baz);
+	_mm256_storeu_ps(ax + i, _mm256_add_ps(_mm256_loadu_ps(ax + i), a_x));
+	_mm256_storeu_ps(ay + i, _mm256_add_ps(_mm256_loadu_ps(ay + i), a_y));
+	_mm256_storeu_ps(az + i, _mm256_add_ps(_mm256_loadu_ps(az + i), a_z));
+}
+
+void sym_tile_avx2(const particle_soa &src, uint32_t i_begin,
+	uint32_t j_begin, uint32_t tile, float *ax, float *ay, float *az)
+{
+	const bool same = i_begin == j_begin;
+
+	for(uint32_t i = i_begin; i < i_begin + tile; i += 8)
+	{
+		uint32_t j = j_begin;
+		if(same)
+		{
+			// the pairs inside a block of 8 are not a full turn
+			sym_tile_scalar(src, i, i, 8, ax, ay, az);
+			j = i + 8;
+		}
+
+		for(; j < j_begin + tile; j += 8)
+			sym_block(src, i, j, ax, ay, az);
+	}
+}
+
+#endif
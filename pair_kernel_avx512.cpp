@@ -0,0 +1,197 @@
+#include "pair_kernel.hpp"
+
+#ifdef HAVE_X86_SIMD
+
+#include <immintrin.h>
+
+#include "particle_soa.hpp"
+
+// 1/sqrt(d2) from the 14 bit estimate plus one Newton-Raphson step
+static inline __m512 rsqrt_nr(__m512 d2)
+{
+	__m512 y = _mm512_rsqrt14_ps(d2);
+	__m512 yy = _mm512_mul_ps(y, y);
+	__m512 t = _mm512_fnmadd_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), d2), yy,
+		_mm512_set1_ps(1.5f));
+	return _mm512_mul_ps(y, t);
+}
+
+void accel_avx512(const float *qx, const float *qy, const float *qz,
+	const uint32_t *ids, uint32_t count, const particle_soa &src, float G,
+	float *ax, float *ay, float *az)
+{
+	const uint32_t n = src.size();
+	const float *sx = src.x.data();
+	const float *sy = src.y.data();
+	const float *sz = src.z.data();
+	const float *sm = src.m.data();
+	const __m512 g = _mm512_set1_ps(G);
+
+	// 32 query points per pass, two independent accumulator chains hide the
+	// FMA latency
+	uint32_t i = 0;
+	for(; i + 32 <= count; i += 32)
+	{
+		__m512 px0 = _mm512_loadu_ps(qx + i);
+		__m512 py0 = _mm512_loadu_ps(qy + i);
+		__m512 pz0 = _mm512_loadu_ps(qz + i);
+		__m512 px1 = _mm512_loadu_ps(qx + i + 16);
+		__m512 py1 = _mm512_loadu_ps(qy + i + 16);
+		__m512 pz1 = _mm512_loadu_ps(qz + i + 16);
+		__m512i id0 = _mm512_loadu_si512(ids + i);
+		__m512i id1 = _mm512_loadu_si512(ids + i + 16);
+
+		__m512 ax0 = _mm512_setzero_ps(), ay0 = _mm512_setzero_ps();
+		__m512 az0 = _mm512_setzero_ps(), ax1 = _mm512_setzero_ps();
+		__m512 ay1 = _mm512_setzero_ps(), az1 = _mm512_setzero_ps();
+
+		for(uint32_t j = 0; j < n; j++)
+		{
+			__m512 bx = _mm512_set1_ps(sx[j]);
+			__m512 by = _mm512_set1_ps(sy[j]);
+			__m512 bz = _mm512_set1_ps(sz[j]);
+			__m512 bm = _mm512_set1_ps(sm[j]);
+			__m512i bj = _mm512_set1_epi32((int)j);
+
+			__m512 dx0 = _mm512_sub_ps(bx, px0);
+			__m512 dy0 = _mm512_sub_ps(by, py0);
+			__m512 dz0 = _mm512_sub_ps(bz, pz0);
+			__m512 dx1 = _mm512_sub_ps(bx, px1);
+			__m512 dy1 = _mm512_sub_ps(by, py1);
+			__m512 dz1 = _mm512_sub_ps(bz, pz1);
+
+			__m512 d20 = _mm512_fmadd_ps(dx0, dx0,
+				_mm512_fmadd_ps(dy0, dy0, _mm512_mul_ps(dz0, dz0)));
+			__m512 d21 = _mm512_fmadd_ps(dx1, dx1,
+				_mm512_fmadd_ps(dy1, dy1, _mm512_mul_ps(dz1, dz1)));
+
+			__m512 inv0 = rsqrt_nr(d20);
+			__m512 inv1 = rsqrt_nr(d21);
+			__m512 s0 = _mm512_mul_ps(_mm512_mul_ps(inv0, inv0),
+				_mm512_mul_ps(inv0, bm));
+			__m512 s1 = _mm512_mul_ps(_mm512_mul_ps(inv1, inv1),
+				_mm512_mul_ps(inv1, bm));
+
+			// zero the self term instead of letting inf or nan through
+			__mmask16 keep0 = _mm512_cmpneq_epi32_mask(id0, bj);
+			__mmask16 keep1 = _mm512_cmpneq_epi32_mask(id1, bj);
+
+			ax0 = _mm512_mask3_fmadd_ps(dx0, s0, ax0, keep0);
+			ay0 = _mm512_mask3_fmadd_ps(dy0, s0, ay0, keep0);
+			az0 = _mm512_mask3_fmadd_ps(dz0, s0, az0, keep0);
+			ax1 = _mm512_mask3_fmadd_ps(dx1, s1, ax1, keep1);
+			ay1 = _mm512_mask3_fmadd_ps(dy1, s1, ay1, keep1);
+			az1 = _mm512_mask3_fmadd_ps(dz1, s1, az1, keep1);
+		}
+
+		_mm512_storeu_ps(ax + i, _mm512_mul_ps(g, ax0));
+		_mm512_storeu_ps(ay + i, _mm512_mul_ps(g, ay0));
+		_mm512_storeu_ps(az + i, _mm512_mul_ps(g, az0));
+		_mm512_storeu_ps(ax + i + 16, _mm512_mul_ps(g, ax1));
+		_mm512_storeu_ps(ay + i + 16, _mm512_mul_ps(g, ay1));
+		_mm512_storeu_ps(az + i + 16, _mm512_mul_ps(g, az1));
+	}
+
+	if(i < count)
+		accel_scalar(qx + i, qy + i, qz + i, ids + i, count - i, src, G,
+			ax + i, ay + i, az + i);
+}
+
+// one block of 16 j bodies against N blocks of 16 i bodies from i, the j
+// block turns one lane at a time so after 16 turns every i has met every j
+// once and the j lanes are back where they started. The turn is the only
+// shuffle and doing it once for N i blocks keeps it off the critical port.
+template <int N>
+static inline void sym_blocks(const particle_soa &src, uint32_t i, uint32_t j,
+	float *ax, float *ay, float *az)
+{
+	// lane k takes lane k + 1, the j accumulators travel with their bodies
+	const __m512i rot = _mm512_set_epi32(0, 15, 14, 13, 12, 11, 10, 9, 8, 7,
+		6, 5, 4, 3, 2, 1);
+
+	__m512 px[N], py[N], pz[N], pm[N], a_x[N], a_y[N], a_z[N];
+	for(int k = 0; k < N; k++)
+	{
+		px[k] = _mm512_loadu_ps(src.x.data() + i + 16 * k);
+		py[k] = _mm512_loadu_ps(src.y.data() + i + 16 * k);
+		pz[k] = _mm512_loadu_ps(src.z.data() + i + 16 * k);
+		pm[k] = _mm512_loadu_ps(src.m.data() + i + 16 * k);
+		a_x[k] = _mm512_setzero_ps();
+		a_y[k] = _mm512_setzero_ps();
+		a_z[k] = _mm512_setzero_ps();
+	}
+
+	__m512 bx = _mm512_loadu_ps(src.x.data() + j);
+	__m512 by = _mm512_loadu_ps(src.y.data() + j);
+	__m512 bz = _mm512_loadu_ps(src.z.data() + j);
+	__m512 bm = _mm512_loadu_ps(src.m.data() + j);
+	__m512 bax = _mm512_loadu_ps(ax + j);
+	__m512 bay = _mm512_loadu_ps(ay + j);
+	__m512 baz = _mm512_loadu_ps(az + j);
+
+	for(uint32_t r = 0; r < 16; r++)
+	{
+		for(int k = 0; k < N; k++)
+		{
+			__m512 dx = _mm512_sub_ps(bx, px[k]);
+			__m512 dy = _mm512_sub_ps(by, py[k]);
+			__m512 dz = _mm512_sub_ps(bz, pz[k]);
+			__m512 d2 = _mm512_fmadd_ps(dx, dx,
+				_mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+			__m512 inv = rsqrt_nr(d2);
+			__m512 inv3 = _mm512_mul_ps(_mm512_mul_ps(inv, inv), inv);
+			__m512 sj = _mm512_mul_ps(bm, inv3);
+			__m512 si = _mm512_mul_ps(pm[k], inv3);
+
+			a_x[k] = _mm512_fmadd_ps(dx, sj, a_x[k]);
+			a_y[k] = _mm512_fmadd_ps(dy, sj, a_y[k]);
+			a_z[k] = _mm512_fmadd_ps(dz, sj, a_z[k]);
+			bax = _mm512_fnmadd_ps(dx, si, bax);
+			bay = _mm512_fnmadd_ps(dy, si, bay);
+			baz = _mm512_fnmadd_ps(dz, si, baz);
+		}
+
+		bx = _mm512_permutexvar_ps(rot, bx);
+		by = _mm512_permutexvar_ps(rot, by);
+		bz = _mm512_permutexvar_ps(rot, bz);
+		bm = _mm512_permutexvar_ps(rot, bm);
+		bax = _mm512_permutexvar_ps(rot, bax);
+		bay = _mm512_permutexvar_ps(rot, bay);
+		baz = _mm512_permutexvar_ps(rot, baz);
+	}
+
+	_mm512_storeu_ps(ax + j, bax);
+	_mm512_storeu_ps(ay + j, bay);
+	_mm512_storeu_ps(az + j, baz);
+	for(int k = 0; k < N; k++)
+	{
+		float *x = ax + i + 16 * k, *y = ay + i + 16 * k, *z = az + i + 16 * k;
+		_mm512_storeu_ps(x, _mm512_add_ps(_mm512_loadu_ps(x), a_x[k]));
+		_mm512_storeu_ps(y, _mm512_add_ps(_mm512_loadu_ps(y), a_y[k]));
+		_mm512_storeu_ps(z, _mm512_add_ps(_mm512_loadu_ps(z), a_z[k]));
+	}
+}
+
+void sym_tile_avx512(const particle_soa &src, uint32_t i_begin,
+	uint32_t j_begin, uint32_t tile, float *ax, float *ay, float *az)
+{
+	const bool same = i_begin == j_begin;
+
+	for(uint32_t i = i_begin; i < i_begin + tile; i += 32)
+	{
+		uint32_t j = j_begin;
+		if(same)
+		{
+			// the pairs inside a block of 16 are not a full turn
+			sym_tile_scalar(src, i, i, 16, ax, ay, az);
+			sym_tile_scalar(src, i + 16, i + 16, 16, ax, ay, az);
+			sym_blocks<1>(src, i, i + 16, ax, ay, az);
+			j = i + 32;
+		}
+
+		for(; j < j_begin + tile; j += 16)
+			sym_blocks<2>(src, i, j, ax, ay, az);
+	}
+}
+
+#endif
@@ -0,0 +1,20 @@
+// the per step parameters gfx keeps in a uniform buffer, the same std140
+// layout as gfx::step_params, gfx puts this straight after the #version line
+// of every compute shader
+layout(std140, binding=0) uniform params
+{
+	float delta_t;
+	uint point_count;
+	float G;
+	// softening length squared, added to every distance squared
+	float softening2;
+	// leapfrog, 0 when acc does not hold the last step's acceleration,
+	// straight after init or after a dispatch with drift 0
+	uint kick;
+	// leapfrog, 0 to only bring the velocities level with the positions, x is
+	// copied
+	uint drift;
+	// block, the shortest step is delta_t / 2^max_level
+	uint max_level;
+	float eta;
+};
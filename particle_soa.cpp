@@ -0,0 +1,57 @@
+#include "particle_soa.hpp"
+
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+/**
+ * @brief Resize v and zero the new elements [old, count)
+ */
+static void resize_zeroed(aligned_vector &v, uint32_t count, thread_pool *pool)
+{
+	uint32_t old = (uint32_t)v.size();
+	v.resize(count);
+	if(count <= old)
+		return;
+
+	// the same grain as the integration sweeps, which for a large array
+	// gives the same split whatever the grain
+	if(pool)
+	{
+		pool->parallel_for(old, count, [&](uint32_t begin, uint32_t end)
+		{
+			std::fill(v.begin() + begin, v.begin() + end, 0.0f);
+		}, 1024);
+	}
+	else
+	{
+		std::fill(v.begin() + old, v.end(), 0.0f);
+	}
+}
+
+void vec3_soa::resize(uint32_t count, thread_pool *pool)
+{
+	resize_zeroed(x, count, pool);
+	resize_zeroed(y, count, pool);
+	resize_zeroed(z, count, pool);
+}
+
+void vec3_soa::from_aos(const std::vector<Eigen::Vector3f> &p)
+{
+	resize((uint32_t)p.size());
+	for(uint32_t i = 0; i < p.size(); i++)
+		set(i, p[i]);
+}
+
+void vec3_soa::to_aos(std::vector<Eigen::Vector3f> &p) const
+{
+	p.resize(size());
+	for(uint32_t i = 0; i < size(); i++)
+		p[i] = get(i);
+}
+
+void particle_soa::resize(uint32_t count, thread_pool *pool)
+{
+	vec3_soa::resize(count, pool);
+	resize_zeroed(m, count, pool);
+}
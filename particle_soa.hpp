@@ -0,0 +1,100 @@
+#ifndef PARTICLE_SOA_HPP
+#define PARTICLE_SOA_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include <Eigen/Core>
+
+/**
+ * @brief Minimal allocator that aligns every allocation to Alignment bytes so
+ * SIMD loads never straddle a cache line
+ */
+template <typename T, size_t Alignment = 64>
+struct aligned_allocator
+{
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind { typedef aligned_allocator<U, Alignment> other; };
+
+	aligned_allocator() {}
+	template <typename U>
+	aligned_allocator(const aligned_allocator<U, Alignment> &) {}
+
+	T *allocate(size_t n)
+	{
+		return (T *)::operator new(n * sizeof(T), std::align_val_t(Alignment));
+	}
+	void deallocate(T *p, size_t)
+	{
+		::operator delete(p, std::align_val_t(Alignment));
+	}
+
+	/**
+	 * @brief New elements are left uninitialized, so resize() does not touch
+	 * the pages; vec3_soa::resize() zeroes them itself
+	 */
+	template <typename U>
+	void construct(U *p) { ::new((void *)p) U; }
+	template <typename U, typename... Args>
+	void construct(U *p, Args &&... args)
+	{
+		::new((void *)p) U(std::forward<Args>(args)...);
+	}
+
+	bool operator==(const aligned_allocator &) const { return true; }
+	bool operator!=(const aligned_allocator &) const { return false; }
+};
+
+typedef std::vector<float, aligned_allocator<float>> aligned_vector;
+
+class thread_pool;
+
+/**
+ * @brief Three separate aligned float arrays, one per axis
+ */
+struct vec3_soa
+{
+	aligned_vector x, y, z;
+
+	/**
+	 * @brief Resize and zero any new elements, with a pool they are zeroed
+	 * by the threads that will work on them so on a NUMA machine each part of
+	 * the array lands on the node that uses it
+	 */
+	void resize(uint32_t count, thread_pool *pool = nullptr);
+	uint32_t size() const { return (uint32_t)x.size(); }
+
+	void set(uint32_t i, const Eigen::Vector3f &p)
+	{
+		x[i] = p.x();
+		y[i] = p.y();
+		z[i] = p.z();
+	}
+	Eigen::Vector3f get(uint32_t i) const
+	{
+		return Eigen::Vector3f(x[i], y[i], z[i]);
+	}
+
+	void from_aos(const std::vector<Eigen::Vector3f> &p);
+	void to_aos(std::vector<Eigen::Vector3f> &p) const;
+};
+
+/**
+ * @brief Structure-of-arrays particle positions and masses
+ *
+ * Unlike the 12 byte Eigen::Vector3f elements gfx uploads, consecutive bodies
+ * along one axis are contiguous here so a SIMD register loads 8 or 16 of them
+ * at once.
+ */
+struct particle_soa : vec3_soa
+{
+	aligned_vector m;
+
+	void resize(uint32_t count, thread_pool *pool = nullptr);
+};
+
+#endif
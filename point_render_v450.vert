@@ -0,0 +1,20 @@
+#version 450
+
+// draws the bodies cull.comp listed, one vertex per visible body
+
+uniform mat4 MVP;
+
+layout(std430, binding=0) buffer x
+{
+	vec4 pos[];
+};
+
+layout(std430, binding=10) buffer vis
+{
+	uint visible_ids[];
+};
+
+void main()
+{
+	gl_Position = MVP * vec4(pos[visible_ids[gl_VertexID]].xyz, 1.0);
+}
@@ -0,0 +1,46 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+scheduler::scheduler(float delta_t, uint32_t steps_per_frame,
+	uint32_t max_steps, float render_fps)
+{
+	this->delta_t = delta_t;
+	this->steps_per_frame = steps_per_frame;
+	this->max_steps = std::max(max_steps, 1u);
+	render_interval = render_fps > 0.0f ? 1.0 / render_fps : 0.0;
+
+	accumulator = 0.0;
+	// draw the first pass
+	since_render = render_interval;
+	draw = true;
+	steps = 0;
+}
+
+uint32_t scheduler::begin_pass(double elapsed)
+{
+	since_render += elapsed;
+	draw = since_render >= render_interval;
+	if(draw)
+		since_render = render_interval > 0.0 ?
+			std::fmod(since_render, render_interval) : 0.0;
+
+	uint32_t n;
+	if(steps_per_frame > 0)
+	{
+		n = steps_per_frame;
+	}
+	else
+	{
+		accumulator += elapsed;
+		n = (uint32_t)std::min(accumulator / delta_t, (double)max_steps);
+		accumulator -= n * (double)delta_t;
+		// drop the time we could not keep up with
+		if(n == max_steps)
+			accumulator = std::min(accumulator, (double)delta_t);
+	}
+
+	steps += n;
+	return n;
+}
@@ -0,0 +1,57 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <cstdint>
+
+/**
+ * @brief Decides how many fixed size physics steps to run and whether to draw
+ * on each pass of the main loop
+ *
+ * Every step is delta_t long no matter how long frames take, so a run gives
+ * the same result on any machine. With steps_per_frame 0 it keeps pace with
+ * the wall clock, running as many steps as the time since the last pass
+ * covers. Otherwise it runs exactly steps_per_frame steps per pass as fast as
+ * the GPU goes, for batch runs. Drawing is throttled separately to
+ * render_fps so the swaps do not eat into the step rate.
+ */
+class scheduler
+{
+public:
+	/**
+	 * @param steps_per_frame steps per pass, 0 to follow the wall clock
+	 * @param max_steps the most steps one pass runs when following the wall
+	 * clock, the simulation slows down rather than falling further behind
+	 * @param render_fps the most frames to draw a second, 0 to draw every pass
+	 */
+	scheduler(float delta_t, uint32_t steps_per_frame = 0,
+		uint32_t max_steps = 8, float render_fps = 0.0f);
+
+	/**
+	 * @brief Start a pass of the main loop
+	 * @param elapsed wall clock seconds since the last pass
+	 * @return how many steps to run this pass
+	 */
+	uint32_t begin_pass(double elapsed);
+	/**
+	 * @brief Whether this pass should draw and swap
+	 */
+	bool render_due() const { return draw; }
+
+	float step_size() const { return delta_t; }
+	uint64_t total_steps() const { return steps; }
+
+private:
+	float delta_t;
+	uint32_t steps_per_frame;
+	uint32_t max_steps;
+	double render_interval;
+
+	// wall clock time not yet covered by a step
+	double accumulator;
+	// wall clock time since the last drawn frame
+	double since_render;
+	bool draw;
+	uint64_t steps;
+};
+
+#endif
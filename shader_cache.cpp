@@ -0,0 +1,347 @@
+#include "shader_cache.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+namespace
+{
+
+const uint64_t fnv_offset = 14695981039346656037ull;
+const uint64_t fnv_prime = 1099511628211ull;
+
+// FNV-1a, the key only has to change when any of its inputs do
+uint64_t hash_bytes(uint64_t h, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	for(size_t i = 0; i < size; i++)
+	{
+		h ^= p[i];
+		h *= fnv_prime;
+	}
+	return h;
+}
+
+uint64_t hash_string(uint64_t h, const char *s)
+{
+	// the terminator too so "ab" + "c" and "a" + "bc" differ
+	return s ? hash_bytes(h, s, strlen(s) + 1) : hash_bytes(h, "", 1);
+}
+
+// at the start of every cache file
+const char binary_magic[4] = {'G', 'L', 'P', 'B'};
+
+}
+
+shader_cache::shader_cache(const std::string &cache_dir,
+	const std::string &shader_dir)
+{
+	this->cache_dir = cache_dir;
+	this->shader_dir = shader_dir;
+	hits = 0;
+	misses = 0;
+
+	// let the driver compile on its own threads, start() then returns
+	// straight away and ready() says when a program is done
+	parallel_compile = GLEW_ARB_parallel_shader_compile != 0;
+	if(parallel_compile)
+		glMaxShaderCompilerThreadsARB(0xffffffffu);
+
+	driver_hash = fnv_offset;
+	GLenum names[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+	for(GLenum name : names)
+		driver_hash = hash_string(driver_hash,
+			(const char *)glGetString(name));
+
+	if(this->cache_dir.empty())
+		return;
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if(formats == 0)
+	{
+		printf("The driver has no program binary formats, shaders will be "
+			"compiled every run\n");
+		this->cache_dir.clear();
+		return;
+	}
+
+	std::error_code err;
+	std::filesystem::create_directories(this->cache_dir, err);
+	if(err)
+	{
+		printf("ERROR couldn't create shader cache directory %s: %s\n",
+			this->cache_dir.c_str(), err.message().c_str());
+		this->cache_dir.clear();
+	}
+}
+
+std::string shader_cache::default_dir()
+{
+#ifdef _WIN32
+	const char *base = getenv("LOCALAPPDATA");
+	if(base && base[0])
+		return std::string(base) + "/gl_compute_shader1";
+#else
+	const char *base = getenv("XDG_CACHE_HOME");
+	if(base && base[0])
+		return std::string(base) + "/gl_compute_shader1";
+	base = getenv("HOME");
+	if(base && base[0])
+		return std::string(base) + "/.cache/gl_compute_shader1";
+#endif
+	return std::string();
+}
+
+bool shader_cache::source(const std::string &name, std::string &out) const
+{
+	if(shader_dir.empty())
+	{
+		for(const embedded_shader *s = embedded_shaders; s->name; s++)
+		{
+			if(name == s->name)
+			{
+				out = s->source;
+				return true;
+			}
+		}
+		printf("ERROR no shader named %s is built in\n", name.c_str());
+		return false;
+	}
+
+	// an editor may have the file deleted or half renamed into place, that is
+	// for the caller to ride out
+	std::string fname = shader_dir + "/" + name;
+	FILE *f = fopen(fname.c_str(), "rb");
+	if(f == NULL)
+	{
+		printf("ERROR couldn't open shader file %s\n", fname.c_str());
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	if(size < 0)
+	{
+		printf("ERROR couldn't read shader file %s\n", fname.c_str());
+		fclose(f);
+		return false;
+	}
+
+	out.assign(size, '\0');
+	long result = fread(&out[0], 1, size, f);
+	fclose(f);
+	if(result != size)
+	{
+		printf("ERROR: loading shader: %s\n", fname.c_str());
+		printf("Expected %ld bytes but only read %ld\n", size, result);
+		return false;
+	}
+
+	return true;
+}
+
+GLuint shader_cache::program(
+	const std::vector<std::pair<GLenum, std::string>> &stages)
+{
+	if(cache_dir.empty())
+	{
+		misses++;
+		return compile(stages);
+	}
+
+	uint64_t key = driver_hash;
+	for(const auto &stage : stages)
+	{
+		key = hash_bytes(key, &stage.first, sizeof(stage.first));
+		key = hash_string(key, stage.second.c_str());
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+	std::string fname = cache_dir + "/" + name;
+
+	GLuint prog = load_binary(fname);
+	if(prog != 0)
+	{
+		hits++;
+		return prog;
+	}
+
+	misses++;
+	prog = compile(stages);
+	if(prog != 0)
+		save_binary(prog, fname);
+	return prog;
+}
+
+GLuint shader_cache::compile(
+	const std::vector<std::pair<GLenum, std::string>> &stages)
+{
+	GLuint prog = start(stages);
+	if(prog != 0)
+		finish(prog);
+	return prog;
+}
+
+GLuint shader_cache::start(
+	const std::vector<std::pair<GLenum, std::string>> &stages)
+{
+	GLuint prog = glCreateProgram();
+	if(prog == 0)
+	{
+		printf("Failed at glCreateProgram()!\n");
+		return 0;
+	}
+
+	std::vector<GLuint> shaders;
+	for(const auto &stage : stages)
+	{
+		GLuint shader = glCreateShader(stage.first);
+		if(shader == 0)
+		{
+			printf("Failed to create shader of type 0x%x!\n", stage.first);
+			for(GLuint s : shaders)
+				glDeleteShader(s);
+			glDeleteProgram(prog);
+			return 0;
+		}
+		shaders.push_back(shader);
+		const GLchar *str = stage.second.c_str();
+		glShaderSource(shader, 1, &str, NULL);
+		glCompileShader(shader);
+		glAttachShader(prog, shader);
+	}
+
+	glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(prog);
+
+	return prog;
+}
+
+bool shader_cache::ready(GLuint prog) const
+{
+	if(!parallel_compile)
+		return true;
+	GLint done = GL_TRUE;
+	glGetProgramiv(prog, GL_COMPLETION_STATUS_ARB, &done);
+	return done == GL_TRUE;
+}
+
+bool shader_cache::finish(GLuint prog)
+{
+	if(prog == 0)
+		return false;
+
+	GLint length = 0;
+	std::vector<char> info_log;
+
+	// the program keeps what it needs once it is linked
+	GLint count = 0;
+	glGetProgramiv(prog, GL_ATTACHED_SHADERS, &count);
+	std::vector<GLuint> shaders(count);
+	if(count > 0)
+		glGetAttachedShaders(prog, count, NULL, shaders.data());
+	for(GLuint shader : shaders)
+	{
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		// use 4 for the length because NVidia cards return a line feed always
+		if(length > 4)
+		{
+			info_log.resize(length);
+			glGetShaderInfoLog(shader, length, NULL, info_log.data());
+			printf("Shader info log: %s\n", info_log.data());
+		}
+		glDetachShader(prog, shader);
+		glDeleteShader(shader);
+	}
+
+	glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &length);
+	if(length > 4)
+	{
+		info_log.resize(length);
+		glGetProgramInfoLog(prog, length, NULL, info_log.data());
+		printf("Shader program info log:\n%s\n", info_log.data());
+	}
+
+	GLint status = GL_FALSE;
+	glGetProgramiv(prog, GL_LINK_STATUS, &status);
+	return status == GL_TRUE;
+}
+
+GLuint shader_cache::load_binary(const std::string &fname)
+{
+	FILE *f = fopen(fname.c_str(), "rb");
+	if(f == NULL)
+		return 0;
+
+	char magic[4];
+	uint32_t header[2];
+	std::vector<uint8_t> binary;
+	bool ok = fread(magic, 1, 4, f) == 4 &&
+		memcmp(magic, binary_magic, 4) == 0 &&
+		fread(header, sizeof(uint32_t), 2, f) == 2;
+	if(ok)
+	{
+		binary.resize(header[1]);
+		ok = fread(binary.data(), 1, binary.size(), f) == binary.size();
+	}
+	fclose(f);
+	if(!ok)
+		return 0;
+
+	GLuint prog = glCreateProgram();
+	glProgramBinary(prog, header[0], binary.data(), (GLsizei)binary.size());
+	GLint status = GL_FALSE;
+	glGetProgramiv(prog, GL_LINK_STATUS, &status);
+	if(status != GL_TRUE)
+	{
+		// a driver update or a format it no longer takes, compile instead
+		glDeleteProgram(prog);
+		// glProgramBinary failing is not an error worth reporting later
+		while(glGetError() != GL_NO_ERROR)
+			;
+		return 0;
+	}
+
+	return prog;
+}
+
+void shader_cache::save_binary(GLuint prog, const std::string &fname)
+{
+	GLint status = GL_FALSE, length = 0;
+	glGetProgramiv(prog, GL_LINK_STATUS, &status);
+	glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+	if(status != GL_TRUE || length <= 0)
+		return;
+
+	std::vector<uint8_t> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(prog, length, &length, &format, binary.data());
+	uint32_t header[2] = {(uint32_t)format, (uint32_t)length};
+
+	// write to the side and rename so a crash or a second instance never
+	// leaves a torn file under the real name, the side file is this
+	// instance's alone so two saving the same program cannot interleave
+	std::random_device random;
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", random(), random());
+	std::string tmp = fname + suffix;
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if(f == NULL)
+		return;
+	bool ok = fwrite(binary_magic, 1, 4, f) == 4 &&
+		fwrite(header, sizeof(uint32_t), 2, f) == 2 &&
+		fwrite(binary.data(), 1, length, f) == (size_t)length;
+	ok = fclose(f) == 0 && ok;
+
+	std::error_code err;
+	if(ok)
+		std::filesystem::rename(tmp, fname, err);
+	if(!ok || err)
+	{
+		printf("ERROR couldn't write shader cache file %s\n", fname.c_str());
+		std::filesystem::remove(tmp, err);
+	}
+}
@@ -0,0 +1,110 @@
+#ifndef SHADER_CACHE_HPP
+#define SHADER_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <GL/glew.h>
+
+/**
+ * @brief One GLSL file built into the program, embedded_shaders ends with a
+ * null name
+ */
+struct embedded_shader
+{
+	const char *name;
+	const char *source;
+};
+
+/**
+ * @brief Generated at build time from the GLSL files by embed_shaders.cmake
+ */
+extern const embedded_shader embedded_shaders[];
+
+/**
+ * @brief Hands out shader sources and linked programs
+ *
+ * Sources come from the copies built into the program, or from shader_dir
+ * when one is given so the GLSL can be edited without a rebuild. Linked
+ * programs are saved with glGetProgramBinary under cache_dir, named by a hash
+ * of the GL vendor, renderer and version and of every stage's source, and the
+ * next run loads them with glProgramBinary instead of compiling. A binary the
+ * driver rejects, after a driver update say, is compiled again and replaced.
+ */
+class shader_cache
+{
+public:
+	/**
+	 * @param cache_dir where to keep program binaries, empty to always compile
+	 * @param shader_dir where to read the GLSL from, empty for the embedded
+	 * copies
+	 */
+	shader_cache(const std::string &cache_dir, const std::string &shader_dir);
+
+	/**
+	 * @brief The GLSL of a shader file such as "physics.comp"
+	 * @return false, after printing why, if there is no such shader or it
+	 * could not be read
+	 */
+	bool source(const std::string &name, std::string &out) const;
+	/**
+	 * @brief Link a program from (stage, source) pairs, from the cache when
+	 * it has it, printing any compile and link logs
+	 * @return 0 if GL could not create the program or a shader
+	 */
+	GLuint program(const std::vector<std::pair<GLenum, std::string>> &stages);
+
+	/**
+	 * @brief Start compiling and linking a program from source without
+	 * waiting for it, it is not cached
+	 * @return 0 if GL could not create the program or a shader
+	 */
+	GLuint start(const std::vector<std::pair<GLenum, std::string>> &stages);
+	/**
+	 * @brief True once a program from start() has finished linking, always
+	 * true when the driver can not compile in the background
+	 */
+	bool ready(GLuint prog) const;
+	/**
+	 * @brief Print the compile and link logs of a program from start(),
+	 * waiting for it if it is not ready
+	 * @return true if it linked
+	 */
+	bool finish(GLuint prog);
+
+	/**
+	 * @brief Programs loaded from the cache and compiled so far
+	 */
+	uint32_t hit_count() const { return hits; }
+	uint32_t miss_count() const { return misses; }
+
+	/**
+	 * @brief $XDG_CACHE_HOME or ~/.cache on Linux, %LOCALAPPDATA% on
+	 * Windows, with gl_compute_shader1 on the end, empty if none is set
+	 */
+	static std::string default_dir();
+
+private:
+	/**
+	 * @brief start() and finish(), the program can be retrieved
+	 */
+	GLuint compile(const std::vector<std::pair<GLenum, std::string>> &stages);
+	GLuint load_binary(const std::string &fname);
+	void save_binary(GLuint prog, const std::string &fname);
+
+	std::string cache_dir;
+	std::string shader_dir;
+	/**
+	 * @brief The driver has ARB_parallel_shader_compile
+	 */
+	bool parallel_compile;
+	/**
+	 * @brief Hash of the driver strings, the start of every program's key
+	 */
+	uint64_t driver_hash;
+	uint32_t hits;
+	uint32_t misses;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include "shader_watcher.hpp"
+
+#include <cstdio>
+#include <algorithm>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+shader_watcher::shader_watcher(const std::string &dir)
+{
+	fd = -1;
+	wd = -1;
+#ifdef __linux__
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0)
+	{
+		perror("ERROR inotify_init1");
+		return;
+	}
+	wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	if(wd < 0)
+	{
+		printf("ERROR couldn't watch %s for shader changes\n", dir.c_str());
+		close(fd);
+		fd = -1;
+	}
+#else
+	printf("Shader hot reload needs inotify, it only works on Linux\n");
+#endif
+}
+
+shader_watcher::~shader_watcher()
+{
+#ifdef __linux__
+	if(fd >= 0)
+		close(fd);
+#endif
+}
+
+std::vector<std::string> shader_watcher::changed()
+{
+	std::vector<std::string> names;
+#ifdef __linux__
+	if(fd < 0)
+		return names;
+
+	alignas(struct inotify_event) char buffer[4096];
+	for(;;)
+	{
+		ssize_t len = read(fd, buffer, sizeof(buffer));
+		if(len <= 0)
+			break;
+		for(ssize_t off = 0; off < len;)
+		{
+			const struct inotify_event *e =
+				(const struct inotify_event *)(buffer + off);
+			if(e->len > 0)
+				names.push_back(e->name);
+			off += sizeof(struct inotify_event) + e->len;
+		}
+	}
+
+	std::sort(names.begin(), names.end());
+	names.erase(std::unique(names.begin(), names.end()), names.end());
+#endif
+	return names;
+}
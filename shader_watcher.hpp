@@ -0,0 +1,35 @@
+#ifndef SHADER_WATCHER_HPP
+#define SHADER_WATCHER_HPP
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Notices when files in a shader directory are written
+ *
+ * Uses inotify on Linux, polled without blocking, so checking it once a frame
+ * costs one read() that normally finds nothing. Editors that save by writing
+ * a new file and renaming it over the old one are seen too. Elsewhere it never
+ * reports a change.
+ */
+class shader_watcher
+{
+public:
+	explicit shader_watcher(const std::string &dir);
+	~shader_watcher();
+
+	/**
+	 * @brief False if the directory could not be watched
+	 */
+	bool ok() const { return fd >= 0; }
+	/**
+	 * @brief Names of the files written since the last call, each once
+	 */
+	std::vector<std::string> changed();
+
+private:
+	int fd;
+	int wd;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#include "snapshot_ring.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+snapshot_ring::snapshot_ring(uint32_t count, uint32_t slot_count,
+	consumer consume)
+{
+	this->count = count;
+	this->consume = consume;
+	quit = false;
+	capture_count = 0;
+	drop_count = 0;
+
+	// x then v, mapped for good so the consumer reads GL's copy in place
+	GLsizeiptr size = 2 * sizeof(Eigen::Vector4f) * (GLsizeiptr)count;
+	GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT |
+		GL_MAP_COHERENT_BIT;
+	slots.resize(slot_count);
+	for(slot &s : slots)
+	{
+		glCreateBuffers(1, &s.buffer);
+		glNamedBufferStorage(s.buffer, size, NULL,
+			flags | GL_CLIENT_STORAGE_BIT);
+		s.data = (const uint8_t *)glMapNamedBufferRange(s.buffer, 0, size,
+			flags);
+		if(s.data == NULL)
+		{
+			printf("ERROR couldn't persistently map a snapshot buffer\n");
+			exit(-1);
+		}
+		s.fence = 0;
+		s.state = slot_state::free;
+	}
+
+	thread = std::thread(&snapshot_ring::run, this);
+}
+
+snapshot_ring::~snapshot_ring()
+{
+	flush();
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	wake.notify_all();
+	thread.join();
+
+	for(slot &s : slots)
+	{
+		glUnmapNamedBuffer(s.buffer);
+		glDeleteBuffers(1, &s.buffer);
+	}
+}
+
+bool snapshot_ring::capture(GLuint x_buf, GLuint v_buf, uint64_t step,
+	double time)
+{
+	// the consumer frees slots out of this thread's sight, look under the lock
+	slot *s = NULL;
+	uint32_t index = 0;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for(uint32_t i = 0; i < slots.size() && s == NULL; i++)
+		{
+			if(slots[i].state == slot_state::free)
+			{
+				s = &slots[i];
+				index = i;
+				s->state = slot_state::copying;
+			}
+		}
+	}
+	if(s == NULL)
+	{
+		drop_count++;
+		return false;
+	}
+
+	GLsizeiptr size = sizeof(Eigen::Vector4f) * (GLsizeiptr)count;
+	glCopyNamedBufferSubData(x_buf, s->buffer, 0, 0, size);
+	glCopyNamedBufferSubData(v_buf, s->buffer, 0, size, size);
+	s->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	s->info.step = step;
+	s->info.time = time;
+	s->info.count = count;
+	s->info.x = (const Eigen::Vector4f *)s->data;
+	s->info.v = (const Eigen::Vector4f *)(s->data + size);
+	copying.push_back(index);
+	capture_count++;
+	return true;
+}
+
+void snapshot_ring::poll()
+{
+	// fences signal in the order they were queued, so stop at the first one
+	// that has not
+	while(!copying.empty())
+	{
+		slot &s = slots[copying.front()];
+		GLenum result = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+			0);
+		if(result == GL_TIMEOUT_EXPIRED)
+			return;
+		if(result == GL_WAIT_FAILED)
+		{
+			printf("ERROR waiting on a snapshot fence failed\n");
+			exit(-1);
+		}
+		glDeleteSync(s.fence);
+		s.fence = 0;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			s.state = slot_state::consuming;
+			ready.push_back(copying.front());
+		}
+		wake.notify_all();
+		copying.pop_front();
+	}
+}
+
+void snapshot_ring::flush()
+{
+	for(uint32_t index : copying)
+	{
+		slot &s = slots[index];
+		GLenum result;
+		do
+		{
+			result = glClientWaitSync(s.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+				1000000000);
+		} while(result == GL_TIMEOUT_EXPIRED);
+	}
+	poll();
+
+	std::unique_lock<std::mutex> guard(lock);
+	wake.wait(guard, [this]()
+	{
+		for(const slot &s : slots)
+		{
+			if(s.state != slot_state::free)
+				return false;
+		}
+		return true;
+	});
+}
+
+void snapshot_ring::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [this]() { return quit || !ready.empty(); });
+		if(ready.empty())
+			return;
+
+		uint32_t index = ready.front();
+		ready.pop_front();
+
+		// nothing touches a consuming slot but this thread
+		guard.unlock();
+		consume(slots[index].info);
+		guard.lock();
+
+		slots[index].state = slot_state::free;
+		// flush() may be waiting for the ring to empty
+		wake.notify_all();
+	}
+}
+
+void print_snapshot_summary(const snapshot &s)
+{
+	double mass = 0.0, kinetic = 0.0;
+	Eigen::Vector3d momentum = Eigen::Vector3d::Zero();
+	Eigen::Vector3d centre = Eigen::Vector3d::Zero();
+	for(uint32_t i = 0; i < s.count; i++)
+	{
+		double m = s.x[i].w();
+		Eigen::Vector3d x = s.x[i].head<3>().cast<double>();
+		Eigen::Vector3d v = s.v[i].head<3>().cast<double>();
+		mass += m;
+		kinetic += 0.5 * m * v.squaredNorm();
+		momentum += m * v;
+		centre += m * x;
+	}
+	if(mass > 0.0)
+		centre /= mass;
+
+	printf("Snapshot step %llu t %.4f: kinetic %.6e, |p| %.6e, "
+		"centre of mass (%.4f, %.4f, %.4f)\n", (unsigned long long)s.step,
+		s.time, kinetic, momentum.norm(), centre.x(), centre.y(),
+		centre.z());
+}
@@ -0,0 +1,135 @@
+#ifndef SNAPSHOT_RING_HPP
+#define SNAPSHOT_RING_HPP
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <GL/glew.h>
+#include <Eigen/Core>
+
+/**
+ * @brief The state of every body at one step, only valid inside the consumer
+ */
+struct snapshot
+{
+	uint64_t step;
+	double time;
+	uint32_t count;
+	/**
+	 * @brief Positions with the mass in w
+	 */
+	const Eigen::Vector4f *x;
+	/**
+	 * @brief Velocities, w is unused
+	 */
+	const Eigen::Vector4f *v;
+};
+
+/**
+ * @brief Copies the GPU state out without ever waiting for it
+ *
+ * Each slot of the ring is a buffer persistently mapped for reading. capture()
+ * queues a GPU copy of the position and velocity buffers into a free slot and
+ * a fence after it, poll() hands every slot whose fence has signalled to a
+ * background thread, and the slot is free again once the consumer returns.
+ * The GL thread only ever checks fences with a zero timeout, so a slow
+ * consumer or disk costs dropped snapshots, never a stalled step.
+ */
+class snapshot_ring
+{
+public:
+	/**
+	 * @brief Called on the ring's own thread, one snapshot at a time in the
+	 * order they were captured, it must not use GL
+	 */
+	typedef std::function<void(const snapshot &)> consumer;
+
+	/**
+	 * @param count bodies per snapshot
+	 * @param slot_count snapshots that can be copying or waiting for the
+	 * consumer at once
+	 */
+	snapshot_ring(uint32_t count, uint32_t slot_count, consumer consume);
+	/**
+	 * @brief flush() and delete the buffers, the GL context must be current
+	 */
+	~snapshot_ring();
+
+	/**
+	 * @brief Queue a copy of x_buf and v_buf, count vec4 each, into a free
+	 * slot. The buffers must already be safe to copy from.
+	 * @return false if every slot is busy and the snapshot was dropped
+	 */
+	bool capture(GLuint x_buf, GLuint v_buf, uint64_t step, double time);
+	/**
+	 * @brief Pass the slots whose copies have finished to the consumer
+	 */
+	void poll();
+	/**
+	 * @brief Wait until every capture so far has been consumed
+	 */
+	void flush();
+
+	uint64_t captured() const { return capture_count; }
+	uint64_t dropped() const { return drop_count; }
+
+private:
+	enum class slot_state
+	{
+		free,
+		/**
+		 * @brief Copy queued on the GPU, fence not seen yet
+		 */
+		copying,
+		/**
+		 * @brief Waiting for or inside the consumer
+		 */
+		consuming
+	};
+
+	struct slot
+	{
+		GLuint buffer;
+		const uint8_t *data;
+		GLsync fence;
+		snapshot info;
+		slot_state state;
+	};
+
+	void run();
+
+	uint32_t count;
+	consumer consume;
+	std::vector<slot> slots;
+	/**
+	 * @brief Slots in capture order that are still copying, GL thread only
+	 */
+	std::deque<uint32_t> copying;
+
+	std::thread thread;
+	/**
+	 * @brief Guards every slot's state, ready and quit
+	 */
+	std::mutex lock;
+	std::condition_variable wake;
+	/**
+	 * @brief Slots for the consumer in capture order
+	 */
+	std::deque<uint32_t> ready;
+	bool quit;
+
+	uint64_t capture_count;
+	uint64_t drop_count;
+};
+
+/**
+ * @brief A consumer that prints the kinetic energy, momentum and centre of
+ * mass of each snapshot, cheap enough to keep up with any rate
+ */
+void print_snapshot_summary(const snapshot &s);
+
+#endif
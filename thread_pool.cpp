@@ -0,0 +1,194 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+thread_pool::thread_pool(uint32_t thread_count, bool pin)
+{
+	if(thread_count == 0)
+		thread_count = std::thread::hardware_concurrency();
+	if(thread_count == 0)
+		thread_count = 1;
+	this->thread_count = thread_count;
+
+	generation = 0;
+	busy = 0;
+	quit = false;
+	job = nullptr;
+	chunk_count = 0;
+	queues.reset(new chunk_queue[thread_count]);
+	for(uint32_t i = 0; i < thread_count; i++)
+		queues[i].range = 0;
+
+	this->pin = false;
+#ifdef __linux__
+	if(pin)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if(sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for(int c = 0; c < CPU_SETSIZE; c++)
+			{
+				if(CPU_ISSET(c, &set))
+					cpus.push_back(c);
+			}
+		}
+		this->pin = !cpus.empty();
+	}
+#endif
+
+	pin_thread(0);
+	for(uint32_t i = 1; i < thread_count; i++)
+		threads.emplace_back(&thread_pool::worker, this, i);
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	start_cv.notify_all();
+	for(auto &t : threads)
+		t.join();
+
+#ifdef __linux__
+	// let the caller run anywhere it could before
+	if(pin)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(int c : cpus)
+			CPU_SET(c, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+#endif
+}
+
+void thread_pool::pin_thread(uint32_t self)
+{
+#ifdef __linux__
+	if(!pin)
+		return;
+
+	// more threads than CPUs wrap round and share
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpus[self % cpus.size()], &set);
+	sched_setaffinity(0, sizeof(set), &set);
+#else
+	(void)self;
+#endif
+}
+
+void thread_pool::parallel_for(uint32_t begin, uint32_t end,
+	const std::function<void(uint32_t, uint32_t)> &fn, uint32_t grain)
+{
+	if(end <= begin)
+		return;
+
+	uint32_t count = end - begin;
+	grain = std::max(grain, 1u);
+	// enough chunks per thread that stealing can even out uneven ones
+	uint32_t chunks = std::min((count + grain - 1) / grain, thread_count * 8);
+
+	if(chunks <= 1 || thread_count == 1)
+	{
+		fn(begin, end);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &fn;
+		job_begin = begin;
+		job_end = end;
+		job_chunk = (count + chunks - 1) / chunks;
+		chunk_count = (count + job_chunk - 1) / job_chunk;
+		for(uint64_t t = 0; t < thread_count; t++)
+		{
+			uint64_t head = chunk_count * t / thread_count;
+			uint64_t tail = chunk_count * (t + 1) / thread_count;
+			queues[t].range.store(head | tail << 32, std::memory_order_relaxed);
+		}
+		busy = (uint32_t)threads.size();
+		generation++;
+	}
+	start_cv.notify_all();
+
+	run_chunks(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done_cv.wait(lock, [this]{ return busy == 0; });
+	job = nullptr;
+}
+
+bool thread_pool::take(chunk_queue &q, bool front, uint32_t &chunk)
+{
+	uint64_t r = q.range.load(std::memory_order_relaxed);
+	while(true)
+	{
+		uint32_t head = (uint32_t)r, tail = (uint32_t)(r >> 32);
+		if(head >= tail)
+			return false;
+
+		uint64_t next = front ? (uint64_t)(head + 1) | (uint64_t)tail << 32 :
+			(uint64_t)head | (uint64_t)(tail - 1) << 32;
+		if(q.range.compare_exchange_weak(r, next))
+		{
+			chunk = front ? head : tail - 1;
+			return true;
+		}
+	}
+}
+
+void thread_pool::run_chunks(uint32_t self)
+{
+	auto run = [this](uint32_t c)
+	{
+		uint32_t b = job_begin + c * job_chunk;
+		uint32_t e = std::min(b + job_chunk, job_end);
+		(*job)(b, e);
+	};
+
+	uint32_t c;
+	while(take(queues[self], true, c))
+		run(c);
+
+	// nothing is added to a queue during a job, so once every other queue
+	// has been seen empty the job is done, neighbours first
+	for(uint32_t k = 1; k < thread_count; k++)
+	{
+		chunk_queue &victim = queues[(self + k) % thread_count];
+		while(take(victim, false, c))
+			run(c);
+	}
+}
+
+void thread_pool::worker(uint32_t self)
+{
+	pin_thread(self);
+
+	uint64_t seen = 0;
+	while(true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_cv.wait(lock, [&]{ return quit || generation != seen; });
+			if(quit)
+				return;
+			seen = generation;
+		}
+
+		run_chunks(self);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		busy--;
+		if(busy == 0)
+			done_cv.notify_one();
+	}
+}
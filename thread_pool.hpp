@@ -0,0 +1,85 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+/**
+ * @brief A fixed set of worker threads that split index ranges between them
+ *
+ * The calling thread takes part in every parallel_for() so a pool of n threads
+ * only starts n - 1 workers.
+ *
+ * parallel_for() cuts the range into chunks and hands thread t the t-th
+ * contiguous run of them. A thread works through its own chunks front to back
+ * and then steals single chunks from the back of the others, so uneven chunks
+ * still balance out. Without stealing, the same range is split the same way
+ * every call, so thread t keeps touching the same part of an array. Arrays
+ * first touched through the pool, like vec3_soa::resize() with a pool, have
+ * their pages on the memory node of the thread that sums over them.
+ */
+class thread_pool
+{
+public:
+	/**
+	 * @brief Create the pool
+	 * @param thread_count total threads including the caller, 0 for one per
+	 * logical core
+	 * @param pin bind thread t, the caller being thread 0, to the t-th CPU
+	 * the process may run on until the pool is destroyed (Linux only)
+	 */
+	thread_pool(uint32_t thread_count = 0, bool pin = false);
+	~thread_pool();
+
+	/**
+	 * @brief Call fn(chunk_begin, chunk_end) over [begin, end) in parallel and
+	 * wait for all chunks to finish
+	 * @param grain the smallest chunk worth handing to a thread
+	 */
+	void parallel_for(uint32_t begin, uint32_t end,
+		const std::function<void(uint32_t, uint32_t)> &fn, uint32_t grain = 64);
+
+	uint32_t size() const { return thread_count; }
+
+private:
+	/**
+	 * @brief The chunks [head, tail) a thread has left, the owner takes from
+	 * the head and thieves from the tail, both packed in one word so a
+	 * compare and swap takes either end
+	 */
+	struct alignas(64) chunk_queue
+	{
+		std::atomic<uint64_t> range;
+	};
+
+	void worker(uint32_t self);
+	void run_chunks(uint32_t self);
+	bool take(chunk_queue &q, bool front, uint32_t &chunk);
+	void pin_thread(uint32_t self);
+
+	uint32_t thread_count;
+	std::vector<std::thread> threads;
+
+	std::mutex mutex;
+	std::condition_variable start_cv;
+	std::condition_variable done_cv;
+	uint64_t generation;
+	uint32_t busy;
+	bool quit;
+	bool pin;
+	std::vector<int> cpus;
+
+	// the job currently being run
+	const std::function<void(uint32_t, uint32_t)> *job;
+	uint32_t job_begin, job_end, job_chunk;
+	uint32_t chunk_count;
+	std::unique_ptr<chunk_queue[]> queues;
+};
+
+#endif
@@ -0,0 +1,503 @@
+#include "trajectory.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "thread_pool.hpp"
+
+namespace
+{
+
+const char file_magic[4] = {'N', 'B', 'T', 'J'};
+const char frame_magic[4] = {'F', 'R', 'A', 'M'};
+const char index_magic[4] = {'I', 'N', 'D', 'X'};
+const uint32_t file_version = 1;
+// O_DIRECT wants offsets, sizes and buffers aligned to the logical block
+// size, 4096 covers every disk in use
+const uint32_t file_alignment = 4096;
+
+uint64_t align_up(uint64_t size)
+{
+	return (size + file_alignment - 1) / file_alignment * file_alignment;
+}
+
+uint8_t *alloc_aligned(uint64_t size)
+{
+	void *p = NULL;
+#ifdef _WIN32
+	p = _aligned_malloc(size, file_alignment);
+#else
+	if(posix_memalign(&p, file_alignment, size) != 0)
+		p = NULL;
+#endif
+	if(p == NULL)
+	{
+		printf("ERROR couldn't allocate a %llu byte trajectory buffer\n",
+			(unsigned long long)size);
+		exit(-1);
+	}
+	memset(p, 0, size);
+	return (uint8_t *)p;
+}
+
+void free_aligned(uint8_t *p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+}
+
+trajectory_writer::trajectory_writer(const std::string &fname, uint32_t count,
+	double delta_t, double G, double softening, uint32_t buffer_count,
+	bool direct, const trajectory_quantization *quant, uint32_t threads)
+{
+	this->fname = fname;
+	failed = false;
+	quit = false;
+	drop_count = 0;
+	stored = 0;
+	raw = 0;
+	pool = nullptr;
+	encoder = nullptr;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, file_magic, 4);
+	header.version = file_version;
+	header.header_size = file_alignment;
+	header.alignment = file_alignment;
+	header.count = count;
+	header.layout = trajectory_layout::vec4_f32;
+	header.delta_t = delta_t;
+	header.G = G;
+	header.softening = softening;
+
+	uint64_t payload_size = 2 * sizeof(Eigen::Vector4f) * (uint64_t)count;
+	if(quant)
+	{
+		header.block_size = quant->block_size;
+		header.keyframe_every = quant->keyframe_every;
+		header.position_error = quant->position_error;
+		header.velocity_error = quant->velocity_error;
+		pool = new thread_pool(threads);
+		encoder = new frame_encoder(count, *quant, pool);
+		payload_size = encoder->max_size();
+	}
+	buffer_size = align_up(sizeof(trajectory_frame_header) + payload_size);
+	end_offset = header.header_size;
+
+#ifdef _WIN32
+	fd = _open(fname.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+		_S_IREAD | _S_IWRITE);
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	fd = -1;
+#ifdef O_DIRECT
+	if(direct)
+	{
+		fd = open(fname.c_str(), flags | O_DIRECT, 0644);
+		// tmpfs and some others refuse it outright
+		if(fd < 0 && errno == EINVAL)
+			printf("%s can not be opened with O_DIRECT, writing through the "
+				"page cache\n", fname.c_str());
+	}
+#else
+	if(direct)
+		printf("No O_DIRECT here, writing %s through the page cache\n",
+			fname.c_str());
+#endif
+	if(fd < 0)
+		fd = open(fname.c_str(), flags, 0644);
+#endif
+	if(fd < 0)
+	{
+		printf("ERROR couldn't create trajectory file %s: %s\n",
+			fname.c_str(), strerror(errno));
+		return;
+	}
+
+	// the header goes first as written at close, with no frames, so a file
+	// cut short is still readable
+	uint8_t *block = alloc_aligned(header.header_size);
+	memcpy(block, &header, sizeof(header));
+	failed = !write_at(block, header.header_size, 0);
+	free_aligned(block);
+
+	for(uint32_t i = 0; i < std::max(buffer_count, 1u); i++)
+	{
+		buffers.push_back(alloc_aligned(buffer_size));
+		free_buffers.push_back(buffers.back());
+	}
+	thread = std::thread(&trajectory_writer::run, this);
+}
+
+trajectory_writer::~trajectory_writer()
+{
+	close();
+	for(uint8_t *buffer : buffers)
+		free_aligned(buffer);
+	delete encoder;
+	delete pool;
+}
+
+bool trajectory_writer::write(const snapshot &s)
+{
+	if(fd < 0 || s.count != header.count)
+		return false;
+
+	uint8_t *buffer = NULL;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(!free_buffers.empty())
+		{
+			buffer = free_buffers.back();
+			free_buffers.pop_back();
+		}
+	}
+	if(buffer == NULL)
+	{
+		drop_count++;
+		return false;
+	}
+
+	trajectory_frame_header frame;
+	memset(&frame, 0, sizeof(frame));
+	memcpy(frame.magic, frame_magic, 4);
+	frame.step = s.step;
+	frame.time = s.time;
+	uint8_t *payload = buffer + sizeof(frame);
+	size_t half = sizeof(Eigen::Vector4f) * s.count;
+	if(encoder)
+	{
+		bool keyframe;
+		frame.encoding = trajectory_encoding::quantized;
+		frame.payload_size = encoder->encode(s, payload, keyframe);
+		frame.keyframe = keyframe ? 1 : 0;
+	}
+	else
+	{
+		frame.encoding = trajectory_encoding::raw;
+		frame.payload_size = 2 * half;
+		frame.keyframe = 1;
+		memcpy(payload, s.x, half);
+		memcpy(payload + half, s.v, half);
+	}
+	frame.chunk_size = align_up(sizeof(frame) + frame.payload_size);
+	memcpy(buffer, &frame, sizeof(frame));
+	// no stale bytes from an earlier, longer frame on the disk
+	memset(payload + frame.payload_size, 0,
+		frame.chunk_size - sizeof(frame) - frame.payload_size);
+	stored += frame.payload_size;
+	raw += 2 * half;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(buffer);
+	}
+	wake.notify_all();
+	return true;
+}
+
+bool trajectory_writer::close()
+{
+	if(fd < 0)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	wake.notify_all();
+	thread.join();
+
+	// the index, then the header that points at it
+	uint64_t index_size = 16 + sizeof(trajectory_index_entry) * index.size();
+	uint8_t *block = alloc_aligned(align_up(index_size));
+	memcpy(block, index_magic, 4);
+	uint64_t frames = index.size();
+	memcpy(block + 8, &frames, sizeof(frames));
+	if(!index.empty())
+		memcpy(block + 16, index.data(),
+			sizeof(trajectory_index_entry) * index.size());
+	bool ok = !failed && write_at(block, align_up(index_size), end_offset);
+	free_aligned(block);
+
+	if(ok)
+	{
+		header.frame_count = frames;
+		header.index_offset = end_offset;
+		block = alloc_aligned(header.header_size);
+		memcpy(block, &header, sizeof(header));
+		ok = write_at(block, header.header_size, 0);
+		free_aligned(block);
+	}
+
+#ifdef _WIN32
+	ok = _close(fd) == 0 && ok;
+#else
+	ok = ::close(fd) == 0 && ok;
+#endif
+	fd = -1;
+	if(!ok)
+		printf("ERROR writing trajectory file %s failed\n", fname.c_str());
+	return ok;
+}
+
+void trajectory_writer::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		wake.wait(guard, [this]() { return quit || !queue.empty(); });
+		if(queue.empty())
+			return;
+
+		uint8_t *buffer = queue.front();
+		queue.pop_front();
+
+		guard.unlock();
+		// frames are written in the order they were queued, one after another
+		const trajectory_frame_header *frame =
+			(const trajectory_frame_header *)buffer;
+		trajectory_index_entry entry = {end_offset, frame->step, frame->time};
+		if(!failed && write_at(buffer, frame->chunk_size, end_offset))
+		{
+			index.push_back(entry);
+			end_offset += frame->chunk_size;
+		}
+		else
+			failed = true;
+		guard.lock();
+
+		free_buffers.push_back(buffer);
+	}
+}
+
+bool trajectory_writer::write_at(const uint8_t *data, uint64_t size,
+	uint64_t offset)
+{
+	while(size > 0)
+	{
+#ifdef _WIN32
+		unsigned int part = (unsigned int)std::min(size, (uint64_t)1 << 30);
+		long long result = -1;
+		if(_lseeki64(fd, offset, SEEK_SET) == (long long)offset)
+			result = _write(fd, data, part);
+#else
+		ssize_t result = pwrite(fd, data, size, offset);
+#ifdef O_DIRECT
+		if(result < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT))
+		{
+			// some file systems only say no on the first write
+			printf("%s can not be written with O_DIRECT, writing through the "
+				"page cache\n", fname.c_str());
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			continue;
+		}
+#endif
+#endif
+		if(result < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			printf("ERROR writing trajectory file %s: %s\n", fname.c_str(),
+				strerror(errno));
+			return false;
+		}
+		data += result;
+		size -= result;
+		offset += result;
+	}
+	return true;
+}
+
+trajectory_reader::trajectory_reader(const std::string &fname)
+{
+	data = nullptr;
+	size = 0;
+	decoder = nullptr;
+	decoded = -1;
+	memset(&header, 0, sizeof(header));
+
+#ifdef _WIN32
+	FILE *f = fopen(fname.c_str(), "rb");
+	if(f == NULL)
+	{
+		printf("ERROR couldn't open trajectory file %s\n", fname.c_str());
+		return;
+	}
+	_fseeki64(f, 0, SEEK_END);
+	contents.resize(_ftelli64(f));
+	rewind(f);
+	bool read_ok = fread(contents.data(), 1, contents.size(), f) ==
+		contents.size();
+	fclose(f);
+	if(!read_ok)
+	{
+		printf("ERROR couldn't read trajectory file %s\n", fname.c_str());
+		return;
+	}
+	const uint8_t *mapped = contents.data();
+	size = contents.size();
+#else
+	int fd = open(fname.c_str(), O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0)
+	{
+		printf("ERROR couldn't open trajectory file %s: %s\n", fname.c_str(),
+			strerror(errno));
+		if(fd >= 0)
+			::close(fd);
+		return;
+	}
+	size = st.st_size;
+	void *p = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) :
+		MAP_FAILED;
+	// the mapping keeps the file open by itself
+	::close(fd);
+	if(p == MAP_FAILED)
+	{
+		printf("ERROR couldn't map trajectory file %s\n", fname.c_str());
+		size = 0;
+		return;
+	}
+	const uint8_t *mapped = (const uint8_t *)p;
+#endif
+
+	if(size < sizeof(header) ||
+		memcmp(mapped, file_magic, 4) != 0)
+	{
+		printf("ERROR %s is not a trajectory file\n", fname.c_str());
+#ifndef _WIN32
+		munmap((void *)mapped, size);
+#endif
+		return;
+	}
+	memcpy(&header, mapped, sizeof(header));
+	if(header.version != file_version ||
+		header.layout != trajectory_layout::vec4_f32)
+	{
+		printf("ERROR %s is trajectory version %u layout %u, only version %u "
+			"layout %u is known\n", fname.c_str(), header.version,
+			(uint32_t)header.layout, file_version,
+			(uint32_t)trajectory_layout::vec4_f32);
+#ifndef _WIN32
+		munmap((void *)mapped, size);
+#endif
+		return;
+	}
+	data = mapped;
+	if(header.block_size > 0)
+	{
+		trajectory_quantization quant;
+		quant.block_size = header.block_size;
+		quant.keyframe_every = header.keyframe_every;
+		quant.position_error = header.position_error;
+		quant.velocity_error = header.velocity_error;
+		decoder = new frame_decoder(header.count, quant);
+	}
+
+	if(header.index_offset != 0 &&
+		header.index_offset + 16 + sizeof(trajectory_index_entry) *
+		header.frame_count <= size &&
+		memcmp(data + header.index_offset, index_magic, 4) == 0)
+	{
+		const trajectory_index_entry *entries =
+			(const trajectory_index_entry *)(data + header.index_offset + 16);
+		for(uint64_t i = 0; i < header.frame_count; i++)
+			offsets.push_back(entries[i].offset);
+		return;
+	}
+
+	// never closed, walk the chunks until one is missing or cut short
+	uint64_t offset = header.header_size;
+	while(offset + sizeof(trajectory_frame_header) <= size)
+	{
+		const trajectory_frame_header *frame =
+			(const trajectory_frame_header *)(data + offset);
+		if(memcmp(frame->magic, frame_magic, 4) != 0 ||
+			frame->chunk_size == 0 || offset + frame->chunk_size > size)
+			break;
+		offsets.push_back(offset);
+		offset += frame->chunk_size;
+	}
+	printf("%s has no index, it was not closed, found %zu frames\n",
+		fname.c_str(), offsets.size());
+	header.frame_count = offsets.size();
+}
+
+trajectory_reader::~trajectory_reader()
+{
+	delete decoder;
+#ifndef _WIN32
+	if(data != nullptr)
+		munmap((void *)data, size);
+#endif
+}
+
+bool trajectory_reader::frame(uint64_t i, snapshot &out)
+{
+	if(i >= offsets.size())
+		return false;
+
+	auto frame_at = [this](uint64_t j)
+	{
+		return (const trajectory_frame_header *)(data + offsets[j]);
+	};
+	const trajectory_frame_header *frame = frame_at(i);
+	out.step = frame->step;
+	out.time = frame->time;
+	out.count = header.count;
+
+	if(frame->encoding == trajectory_encoding::raw)
+	{
+		const uint8_t *payload = data + offsets[i] + sizeof(*frame);
+		out.x = (const Eigen::Vector4f *)payload;
+		out.v = (const Eigen::Vector4f *)(payload +
+			sizeof(Eigen::Vector4f) * header.count);
+		return true;
+	}
+	if(frame->encoding != trajectory_encoding::quantized || !decoder)
+		return false;
+
+	// back to the keyframe, unless the frame decoded last is on the way
+	uint64_t first = i;
+	while(first > 0 && !frame_at(first)->keyframe &&
+		(int64_t)first - 1 != decoded)
+		first--;
+	if(decoded >= 0 && (uint64_t)decoded == i)
+		first = i + 1;
+	for(uint64_t j = first; j <= i; j++)
+	{
+		const trajectory_frame_header *f = frame_at(j);
+		if(f->encoding != trajectory_encoding::quantized ||
+			sizeof(*f) + f->payload_size > f->chunk_size ||
+			!decoder->decode(data + offsets[j] + sizeof(*f), f->payload_size,
+			f->keyframe != 0))
+		{
+			decoded = -1;
+			printf("ERROR frame %llu could not be decoded\n",
+				(unsigned long long)j);
+			return false;
+		}
+		decoded = j;
+	}
+	out.x = decoder->x();
+	out.v = decoder->v();
+	return true;
+}
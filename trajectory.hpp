@@ -0,0 +1,247 @@
+#ifndef TRAJECTORY_HPP
+#define TRAJECTORY_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "snapshot_ring.hpp"
+#include "trajectory_codec.hpp"
+
+class thread_pool;
+
+/**
+ * @brief How the bodies of a frame are laid out
+ */
+enum class trajectory_layout : uint32_t
+{
+	/**
+	 * @brief count vec4 float positions with the mass in w, then count vec4
+	 * float velocities, the layout of the GPU buffers
+	 */
+	vec4_f32 = 1
+};
+
+/**
+ * @brief How the bodies of one frame are stored
+ */
+enum class trajectory_encoding : uint32_t
+{
+	/**
+	 * @brief As they are in the layout
+	 */
+	raw = 0,
+	/**
+	 * @brief frame_encoder's quantized deltas, with the settings in the header
+	 */
+	quantized = 1
+};
+
+/**
+ * @brief The start of a trajectory file, padded out to header_size
+ *
+ * A file is the header, then one chunk per frame, then the index chunk. Every
+ * chunk starts on a multiple of alignment so it can be written with O_DIRECT
+ * and read in place from a mapping. Until the writer closes the file
+ * frame_count and index_offset are 0, and a reader finds the frames by
+ * walking the chunks from header_size instead.
+ */
+struct trajectory_header
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t alignment;
+	uint32_t count;
+	trajectory_layout layout;
+	double delta_t;
+	double G;
+	double softening;
+	uint64_t frame_count;
+	uint64_t index_offset;
+	/**
+	 * @brief The quantized encoding's settings, block_size is 0 when every
+	 * frame is raw
+	 */
+	uint32_t block_size;
+	uint32_t keyframe_every;
+	double position_error;
+	double velocity_error;
+};
+
+/**
+ * @brief The start of every frame chunk, the bodies follow it
+ */
+struct trajectory_frame_header
+{
+	char magic[4];
+	trajectory_encoding encoding;
+	uint64_t step;
+	double time;
+	/**
+	 * @brief Bytes of bodies after this header
+	 */
+	uint64_t payload_size;
+	/**
+	 * @brief This header and the payload padded to the alignment, the next
+	 * chunk starts this far on
+	 */
+	uint64_t chunk_size;
+	/**
+	 * @brief 1 if a quantized frame can be decoded without the ones before
+	 */
+	uint32_t keyframe;
+	uint8_t reserved[20];
+};
+
+/**
+ * @brief One frame in the index chunk
+ */
+struct trajectory_index_entry
+{
+	uint64_t offset;
+	uint64_t step;
+	double time;
+};
+
+/**
+ * @brief Streams snapshots to a trajectory file from a thread of its own
+ *
+ * write() copies a snapshot into one of a fixed number of aligned buffers and
+ * queues it, the writer thread writes each frame with a single large aligned
+ * write at the end of the file and hands the buffer back. If every buffer is
+ * queued the frame is dropped and counted, so a slow disk never holds up
+ * whoever calls write(). With direct the file is opened with O_DIRECT where
+ * the OS and file system allow it, so frames go to the disk without filling
+ * the page cache. With quantization the frames are encoded by frame_encoder
+ * in write(), on threads threads, and a frame is only encoded once it has a
+ * buffer so the deltas always follow the frame written before.
+ */
+class trajectory_writer
+{
+public:
+	/**
+	 * @param quant NULL to write the frames raw
+	 * @param threads encoding threads, 0 for one per logical core
+	 */
+	trajectory_writer(const std::string &fname, uint32_t count, double delta_t,
+		double G, double softening, uint32_t buffer_count, bool direct,
+		const trajectory_quantization *quant = NULL, uint32_t threads = 0);
+	/**
+	 * @brief close() if it has not been
+	 */
+	~trajectory_writer();
+
+	/**
+	 * @brief False if the file could not be created
+	 */
+	bool ok() const { return fd >= 0; }
+	/**
+	 * @brief Queue a frame, never waits for the disk
+	 * @return false if it was dropped, every buffer being queued already
+	 */
+	bool write(const snapshot &s);
+	/**
+	 * @brief Write every queued frame, then the index, then the final header
+	 * @return false if any write failed
+	 */
+	bool close();
+
+	uint64_t written() const { return index.size(); }
+	uint64_t dropped() const { return drop_count; }
+	/**
+	 * @brief Bytes of bodies queued so far and what they would be raw
+	 */
+	uint64_t stored_bytes() const { return stored; }
+	uint64_t raw_bytes() const { return raw; }
+
+private:
+	void run();
+	/**
+	 * @brief Write all of data at offset, dropping O_DIRECT if the file
+	 * system turns out not to take it
+	 */
+	bool write_at(const uint8_t *data, uint64_t size, uint64_t offset);
+
+	std::string fname;
+	int fd;
+	trajectory_header header;
+	/**
+	 * @brief Size of every frame buffer, the largest chunk a frame can take
+	 */
+	uint64_t buffer_size;
+	uint64_t end_offset;
+	bool failed;
+	thread_pool *pool;
+	frame_encoder *encoder;
+	uint64_t stored;
+	uint64_t raw;
+
+	/**
+	 * @brief Every aligned frame buffer, free ones and queued ones
+	 */
+	std::vector<uint8_t *> buffers;
+	std::vector<uint8_t *> free_buffers;
+	std::deque<uint8_t *> queue;
+	std::thread thread;
+	/**
+	 * @brief Guards free_buffers, queue and quit
+	 */
+	std::mutex lock;
+	std::condition_variable wake;
+	bool quit;
+
+	/**
+	 * @brief Frames written so far, writer thread only until it stops
+	 */
+	std::vector<trajectory_index_entry> index;
+	uint64_t drop_count;
+};
+
+/**
+ * @brief Maps a trajectory file and hands out its frames in place
+ */
+class trajectory_reader
+{
+public:
+	explicit trajectory_reader(const std::string &fname);
+	~trajectory_reader();
+
+	/**
+	 * @brief False if the file could not be opened or is not a trajectory
+	 */
+	bool ok() const { return data != nullptr; }
+	const trajectory_header &info() const { return header; }
+	uint64_t frame_count() const { return offsets.size(); }
+	/**
+	 * @brief Frame i with x and v pointing into the mapping, valid as long as
+	 * the reader is. A quantized frame is decoded from the keyframe before it,
+	 * or from the last frame asked for when that is nearer, and points into
+	 * the reader until the next call.
+	 * @return false if i is out of range or could not be decoded
+	 */
+	bool frame(uint64_t i, snapshot &out);
+
+private:
+	const uint8_t *data;
+	uint64_t size;
+	trajectory_header header;
+	std::vector<uint64_t> offsets;
+	frame_decoder *decoder;
+	/**
+	 * @brief The quantized frame decoder holds, -1 for none
+	 */
+	int64_t decoded;
+#ifdef _WIN32
+	/**
+	 * @brief No mmap here, the file is read into memory instead
+	 */
+	std::vector<uint8_t> contents;
+#endif
+};
+
+#endif
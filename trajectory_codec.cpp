@@ -0,0 +1,287 @@
+#include "trajectory_codec.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+namespace
+{
+
+const uint32_t component_count = 6;
+
+/**
+ * @brief What each component of a block starts with, the packed values
+ * follow as width bit offsets from base in 64 bit words
+ */
+struct component_header
+{
+	int64_t base;
+	uint32_t width;
+	uint32_t reserved;
+};
+
+size_t pad8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+size_t packed_words(uint32_t n, uint32_t width)
+{
+	return ((uint64_t)n * width + 63) / 64;
+}
+
+/**
+ * @brief Largest bytes one block of n bodies can take
+ */
+size_t max_block_size(uint32_t n)
+{
+	return component_count * (sizeof(component_header) + 8 * (size_t)n);
+}
+
+int64_t quantize(float value, double step)
+{
+	// anything this far out is lost anyway, keep llround defined
+	double q = std::max(std::min(value / step, 4.0e18), -4.0e18);
+	return std::llround(q);
+}
+
+double component_step(const trajectory_quantization &quant, uint32_t c)
+{
+	return 2.0 * (c < 3 ? quant.position_error : quant.velocity_error);
+}
+
+/**
+ * @brief Pack n values of width bits each, lowest bits first
+ */
+void pack(const uint64_t *values, uint32_t n, uint32_t width, uint64_t *words)
+{
+	uint64_t acc = 0;
+	uint32_t bits = 0;
+	size_t w = 0;
+	for(uint32_t i = 0; i < n; i++)
+	{
+		acc |= values[i] << bits;
+		bits += width;
+		if(bits >= 64)
+		{
+			words[w++] = acc;
+			bits -= 64;
+			// the high bits that did not fit
+			acc = bits > 0 ? values[i] >> (width - bits) : 0;
+		}
+	}
+	if(bits > 0)
+		words[w] = acc;
+}
+
+void unpack(const uint64_t *words, uint32_t n, uint32_t width,
+	uint64_t *values)
+{
+	// every value the same, nothing was stored for them
+	if(width == 0)
+	{
+		std::fill(values, values + n, (uint64_t)0);
+		return;
+	}
+	uint64_t mask = width == 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+	uint32_t bits = 0;
+	size_t w = 0;
+	for(uint32_t i = 0; i < n; i++)
+	{
+		uint64_t v = words[w] >> bits;
+		if(bits + width > 64)
+			v |= words[w + 1] << (64 - bits);
+		values[i] = v & mask;
+		bits += width;
+		if(bits >= 64)
+		{
+			bits -= 64;
+			w++;
+		}
+	}
+}
+
+}
+
+frame_encoder::frame_encoder(uint32_t count,
+	const trajectory_quantization &quant, thread_pool *pool)
+{
+	this->count = count;
+	this->quant = quant;
+	this->pool = pool;
+	block_count = (count + quant.block_size - 1) / quant.block_size;
+	frames = 0;
+	last.resize((size_t)component_count * count);
+	scratch.resize(block_count);
+	scratch_size.resize(block_count);
+	for(uint32_t b = 0; b < block_count; b++)
+	{
+		uint32_t n = std::min(quant.block_size, count - b * quant.block_size);
+		scratch[b].resize(max_block_size(n));
+	}
+}
+
+size_t frame_encoder::max_size() const
+{
+	return pad8(sizeof(float) * count) + pad8(sizeof(uint32_t) * block_count) +
+		component_count * sizeof(component_header) * block_count +
+		8 * component_count * (size_t)count;
+}
+
+size_t frame_encoder::encode(const snapshot &s, uint8_t *out, bool &keyframe)
+{
+	keyframe = quant.keyframe_every <= 1 || frames % quant.keyframe_every == 0;
+	frames++;
+
+	auto encode_blocks = [&](uint32_t begin, uint32_t end)
+	{
+		std::vector<uint64_t> offsets(quant.block_size);
+		std::vector<int64_t> deltas(quant.block_size);
+		for(uint32_t b = begin; b < end; b++)
+		{
+			uint32_t first = b * quant.block_size;
+			uint32_t n = std::min(quant.block_size, count - first);
+			uint8_t *p = scratch[b].data();
+			for(uint32_t c = 0; c < component_count; c++)
+			{
+				double step = component_step(quant, c);
+				const Eigen::Vector4f *src = c < 3 ? s.x : s.v;
+				int64_t *prev = &last[(size_t)c * count + first];
+				int64_t lo = INT64_MAX, hi = INT64_MIN;
+				for(uint32_t i = 0; i < n; i++)
+				{
+					int64_t q = quantize(src[first + i][c % 3], step);
+					// deltas are against the integers, not the floats, so
+					// errors never pile up from frame to frame
+					deltas[i] = keyframe ? q : q - prev[i];
+					prev[i] = q;
+					lo = std::min(lo, deltas[i]);
+					hi = std::max(hi, deltas[i]);
+				}
+
+				uint64_t range = (uint64_t)hi - (uint64_t)lo;
+				uint32_t width = 0;
+				while(width < 64 && (range >> width) != 0)
+					width++;
+				for(uint32_t i = 0; i < n; i++)
+					offsets[i] = (uint64_t)deltas[i] - (uint64_t)lo;
+
+				component_header h = {lo, width, 0};
+				memcpy(p, &h, sizeof(h));
+				p += sizeof(h);
+				size_t words = packed_words(n, width);
+				pack(offsets.data(), n, width, (uint64_t *)p);
+				p += 8 * words;
+			}
+			scratch_size[b] = p - scratch[b].data();
+		}
+	};
+	if(pool)
+		pool->parallel_for(0, block_count, encode_blocks, 1);
+	else
+		encode_blocks(0, block_count);
+
+	// the masses never change, keyframes carry them for a reader that starts
+	// there
+	uint8_t *p = out;
+	if(keyframe)
+	{
+		float *mass = (float *)p;
+		for(uint32_t i = 0; i < count; i++)
+			mass[i] = s.x[i].w();
+		memset(p + sizeof(float) * count, 0,
+			pad8(sizeof(float) * count) - sizeof(float) * count);
+		p += pad8(sizeof(float) * count);
+	}
+	uint32_t *sizes = (uint32_t *)p;
+	for(uint32_t b = 0; b < block_count; b++)
+		sizes[b] = (uint32_t)scratch_size[b];
+	memset(p + sizeof(uint32_t) * block_count, 0,
+		pad8(sizeof(uint32_t) * block_count) - sizeof(uint32_t) * block_count);
+	p += pad8(sizeof(uint32_t) * block_count);
+	for(uint32_t b = 0; b < block_count; b++)
+	{
+		memcpy(p, scratch[b].data(), scratch_size[b]);
+		p += scratch_size[b];
+	}
+	return p - out;
+}
+
+frame_decoder::frame_decoder(uint32_t count,
+	const trajectory_quantization &quant)
+{
+	this->count = count;
+	this->quant = quant;
+	block_count = (count + quant.block_size - 1) / quant.block_size;
+	have_keyframe = false;
+	last.resize((size_t)component_count * count);
+	mass.resize(count);
+	pos.resize(count);
+	vel.resize(count);
+}
+
+bool frame_decoder::decode(const uint8_t *data, size_t size, bool keyframe)
+{
+	if(!keyframe && !have_keyframe)
+		return false;
+	// a frame that fails half way leaves last unusable until a keyframe
+	have_keyframe = false;
+
+	const uint8_t *p = data;
+	const uint8_t *end = data + size;
+	if(keyframe)
+	{
+		if(pad8(sizeof(float) * count) > size)
+			return false;
+		memcpy(mass.data(), p, sizeof(float) * count);
+		p += pad8(sizeof(float) * count);
+	}
+	if(p + pad8(sizeof(uint32_t) * block_count) > end)
+		return false;
+	const uint32_t *sizes = (const uint32_t *)p;
+	p += pad8(sizeof(uint32_t) * block_count);
+
+	std::vector<uint64_t> offsets(quant.block_size);
+	for(uint32_t b = 0; b < block_count; b++)
+	{
+		uint32_t first = b * quant.block_size;
+		uint32_t n = std::min(quant.block_size, count - first);
+		const uint8_t *block_end = p + sizes[b];
+		if(block_end > end)
+			return false;
+		for(uint32_t c = 0; c < component_count; c++)
+		{
+			component_header h;
+			if(p + sizeof(h) > block_end)
+				return false;
+			memcpy(&h, p, sizeof(h));
+			p += sizeof(h);
+			size_t words = packed_words(n, h.width);
+			if(h.width > 64 || p + 8 * words > block_end)
+				return false;
+			unpack((const uint64_t *)p, n, h.width, offsets.data());
+			p += 8 * words;
+
+			double step = component_step(quant, c);
+			int64_t *prev = &last[(size_t)c * count + first];
+			Eigen::Vector4f *dst = c < 3 ? pos.data() : vel.data();
+			for(uint32_t i = 0; i < n; i++)
+			{
+				int64_t delta = (int64_t)(offsets[i] + (uint64_t)h.base);
+				prev[i] = keyframe ? delta : prev[i] + delta;
+				dst[first + i][c % 3] = (float)(prev[i] * step);
+			}
+		}
+		p = block_end;
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		pos[i].w() = mass[i];
+		vel[i].w() = 0.0f;
+	}
+	have_keyframe = true;
+	return true;
+}
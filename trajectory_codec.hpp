@@ -0,0 +1,117 @@
+#ifndef TRAJECTORY_CODEC_HPP
+#define TRAJECTORY_CODEC_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <Eigen/Core>
+
+#include "snapshot_ring.hpp"
+
+class thread_pool;
+
+/**
+ * @brief Settings of the quantized frame encoding, stored in the trajectory
+ * header
+ */
+struct trajectory_quantization
+{
+	/**
+	 * @brief Largest difference between a stored and a decoded coordinate,
+	 * no finer than float precision allows
+	 */
+	double position_error = 1.0e-4;
+	double velocity_error = 1.0e-4;
+	/**
+	 * @brief Bodies per block, each block picks its own bit widths
+	 */
+	uint32_t block_size = 4096;
+	/**
+	 * @brief Every this many frames is stored whole rather than as the change
+	 * from the frame before, a reader seeks to the keyframe before the frame it
+	 * wants and decodes forward from there
+	 */
+	uint32_t keyframe_every = 16;
+};
+
+/**
+ * @brief Encodes frames as quantized deltas
+ *
+ * Every coordinate becomes the integer nearest to it in units of twice its
+ * error bound, so decoding multiplies back and is never off by more than the
+ * bound. A keyframe stores those integers and the masses, the frames after
+ * it the difference from the previous frame's integers, which for bodies
+ * that barely moved are a few bits. The values of each of the six components
+ * of a block are stored as a base and a fixed bit width wide enough for the
+ * block's largest, so a block of quiet bodies costs little however much the
+ * rest move. Blocks are independent and are encoded in parallel.
+ */
+class frame_encoder
+{
+public:
+	/**
+	 * @param pool encodes the blocks in parallel, NULL for on the caller
+	 */
+	frame_encoder(uint32_t count, const trajectory_quantization &quant,
+		thread_pool *pool);
+
+	/**
+	 * @brief Most bytes encode() can write
+	 */
+	size_t max_size() const;
+	/**
+	 * @brief Encode s after the frame encoded last, or as a keyframe when it
+	 * is due
+	 * @param keyframe set to whether this frame is one
+	 * @return bytes written to out
+	 */
+	size_t encode(const snapshot &s, uint8_t *out, bool &keyframe);
+
+private:
+	uint32_t count;
+	trajectory_quantization quant;
+	thread_pool *pool;
+	uint32_t block_count;
+	uint64_t frames;
+	/**
+	 * @brief The integers of the last frame, x, y, z, vx, vy, vz each count
+	 * long
+	 */
+	std::vector<int64_t> last;
+	/**
+	 * @brief One encoded block each before they are put together
+	 */
+	std::vector<std::vector<uint8_t>> scratch;
+	std::vector<size_t> scratch_size;
+};
+
+/**
+ * @brief Decodes what frame_encoder wrote, one frame after another from a
+ * keyframe
+ */
+class frame_decoder
+{
+public:
+	frame_decoder(uint32_t count, const trajectory_quantization &quant);
+
+	/**
+	 * @brief Decode the frame after the last one decoded, or a keyframe
+	 * @return false if the data is malformed or the frame is not a keyframe
+	 * and none came before it
+	 */
+	bool decode(const uint8_t *data, size_t size, bool keyframe);
+
+	const Eigen::Vector4f *x() const { return pos.data(); }
+	const Eigen::Vector4f *v() const { return vel.data(); }
+
+private:
+	uint32_t count;
+	trajectory_quantization quant;
+	uint32_t block_count;
+	bool have_keyframe;
+	std::vector<int64_t> last;
+	std::vector<float> mass;
+	std::vector<Eigen::Vector4f> pos, vel;
+};
+
+#endif